@@ -19,11 +19,7 @@
  */
 
 int blockend;
-
-/*Preliminary FPA emulation. This works to an extent - !Draw works with it, !SICK
-  seems to (FPA Whetstone scores are around 100x without), but !AMPlayer doesn't
-  work, and GCC stuff tends to crash.*/
-//#define FPA
+int blockidle;
 
 #include <stdio.h>
 #include <string.h>
@@ -88,94 +84,10 @@ arm_is_dynarec(void)
 
 void updatemode(uint32_t m)
 {
-        uint32_t c, om = arm.mode;
-
-        usrregs[15] = &arm.reg[15];
-        switch (arm.mode & 0xf) { /* Store back registers */
-            case USER:
-            case SYSTEM: /* System (ARMv4) shares same bank as User mode */
-                for (c=8;c<15;c++) arm.user_reg[c] = arm.reg[c];
-                break;
-
-            case IRQ:
-                for (c=8;c<13;c++) arm.user_reg[c] = arm.reg[c];
-                arm.irq_reg[0] = arm.reg[13];
-                arm.irq_reg[1] = arm.reg[14];
-                break;
-
-            case FIQ:
-                for (c=8;c<15;c++) arm.fiq_reg[c] = arm.reg[c];
-                break;
-
-            case SUPERVISOR:
-                for (c=8;c<13;c++) arm.user_reg[c] = arm.reg[c];
-                arm.super_reg[0] = arm.reg[13];
-                arm.super_reg[1] = arm.reg[14];
-                break;
-
-            case ABORT:
-                for (c=8;c<13;c++) arm.user_reg[c] = arm.reg[c];
-                arm.abort_reg[0] = arm.reg[13];
-                arm.abort_reg[1] = arm.reg[14];
-                break;
-
-            case UNDEFINED:
-                for (c=8;c<13;c++) arm.user_reg[c] = arm.reg[c];
-                arm.undef_reg[0] = arm.reg[13];
-                arm.undef_reg[1] = arm.reg[14];
-                break;
-        }
-        arm.mode = m;
+        uint32_t om = arm.mode;
 
-        switch (m&15)
-        {
-            case USER:
-            case SYSTEM:
-                for (c=8;c<15;c++) arm.reg[c] = arm.user_reg[c];
-                for (c=0;c<15;c++) usrregs[c] = &arm.reg[c];
-                break;
-
-            case IRQ:
-                for (c=8;c<13;c++) arm.reg[c] = arm.user_reg[c];
-                arm.reg[13] = arm.irq_reg[0];
-                arm.reg[14] = arm.irq_reg[1];
-                for (c=0;c<13;c++) usrregs[c] = &arm.reg[c];
-                for (c=13;c<15;c++) usrregs[c] = &arm.user_reg[c];
-                break;
-            
-            case FIQ:
-                for (c=8;c<15;c++) arm.reg[c] = arm.fiq_reg[c];
-                for (c=0;c<8;c++)  usrregs[c] = &arm.reg[c];
-                for (c=8;c<15;c++) usrregs[c] = &arm.user_reg[c];
-                break;
-
-            case SUPERVISOR:
-                for (c=8;c<13;c++) arm.reg[c] = arm.user_reg[c];
-                arm.reg[13] = arm.super_reg[0];
-                arm.reg[14] = arm.super_reg[1];
-                for (c=0;c<13;c++) usrregs[c] = &arm.reg[c];
-                for (c=13;c<15;c++) usrregs[c] = &arm.user_reg[c];
-                break;
-            
-            case ABORT:
-                for (c=8;c<13;c++) arm.reg[c] = arm.user_reg[c];
-                arm.reg[13] = arm.abort_reg[0];
-                arm.reg[14] = arm.abort_reg[1];
-                for (c=0;c<13;c++) usrregs[c] = &arm.reg[c];
-                for (c=13;c<15;c++) usrregs[c] = &arm.user_reg[c];
-                break;
-
-            case UNDEFINED:
-                for (c=8;c<13;c++) arm.reg[c] = arm.user_reg[c];
-                arm.reg[13] = arm.undef_reg[0];
-                arm.reg[14] = arm.undef_reg[1];
-                for (c=0;c<13;c++) usrregs[c] = &arm.reg[c];
-                for (c=13;c<15;c++) usrregs[c] = &arm.user_reg[c];
-                break;
-
-            default:
-                fatal("Bad mode %i\n", arm.mode);
-        }
+        arm_switch_bank(om, m);
+        arm.mode = m;
 
         if (ARM_MODE_32(arm.mode)) {
                 arm.mmask = 0x1f;
@@ -210,8 +122,6 @@ void updatemode(uint32_t m)
 
 static int stmlookup[256];
 
-int countbitstable[65536];
-
 void
 arm_init(void)
 {
@@ -225,14 +135,6 @@ arm_init(void)
 			}
 		}
 	}
-	for (c = 0; c < 65536; c++) {
-		countbitstable[c] = 0;
-		for (d = 0; d < 16; d++) {
-			if (c & (1u << d)) {
-				countbitstable[c] += 4;
-			}
-		}
-	}
 
 	cpsr = 15;
 	for (c = 0; c < 16; c++) {
@@ -512,7 +414,11 @@ exception(uint32_t mmode, uint32_t address, uint32_t diff)
 
 	if (ARM_MODE_32(arm.mode)) {
 		arm.spsr[mmode] = arm.reg[16];
-		updatemode(0x10 | mmode);
+		/* Staying in 32-bit mode, so only the banked registers and the
+		   privilege level change */
+		arm_switch_bank(arm.mode, 0x10 | mmode);
+		arm.mode = 0x10 | mmode;
+		memmode = 1;
 		arm.reg[14] = link;
 		arm.reg[16] &= ~0x1fu;
 		arm.reg[16] |= 0x10 | mmode | irq_disable;
@@ -664,6 +570,35 @@ static const OpFn opcodes[256] = {
 
 int linecyc=0;
 
+#define IDLE_SPINS 64	/**< Times round an idle loop before letting time pass */
+
+static uint32_t idle_pc;	/**< ARM address of the idle loop last left */
+static uint32_t idle_inscount;	/**< inscount when it was last left */
+static int idle_spins;		/**< Times round that loop without running anything else */
+
+/**
+ * Called after leaving a block that is a loop only polling memory or I/O,
+ * which can only finish once something outside the ARM changes. Once it has
+ * gone round enough times without anything else running, let time pass until
+ * that may have happened.
+ */
+static void
+idle_loop(void)
+{
+	// Each time round adds at most IDLE_LOOP_MAX to inscount
+	if (PC == idle_pc && inscount - idle_inscount <= IDLE_LOOP_MAX) {
+		idle_spins++;
+	} else {
+		idle_pc = PC;
+		idle_spins = 0;
+	}
+	idle_inscount = inscount;
+	if (idle_spins >= IDLE_SPINS) {
+		idle_spins = 0;
+		rpcemu_idle_poll();
+	}
+}
+
 static inline int
 arm_opcode_needs_pc(uint32_t opcode)
 {
@@ -707,6 +642,36 @@ arm_opcode_may_abort(uint32_t opcode)
 	return 0;
 }
 
+/**
+ * Test whether an instruction ends the block it is in, because the
+ * instruction after it may not be the next one run. Taken branches end the
+ * block when executed, so are not included.
+ *
+ * @param opcode Opcode of instruction
+ * @return Non-zero if the block ends after this instruction
+ */
+static inline int
+arm_opcode_ends_block(uint32_t opcode)
+{
+	/* SWIs and coprocessor instructions, other than FPA ones generated inline */
+	if ((opcode & 0x0c000000) == 0x0c000000 && !codegen_fpa_inline(opcode)) {
+		return 1;
+	}
+	/* R15 may be modified by data processing */
+	if (!(opcode & 0x0c000000) && (RD == 15)) {
+		return 1;
+	}
+	/* R15 reloaded from LDM */
+	if ((opcode & 0x0e108000) == 0x08108000) {
+		return 1;
+	}
+	/* R15 reloaded from LDR */
+	if ((opcode & 0x0c100000) == 0x04100000 && (RD == 15)) {
+		return 1;
+	}
+	return 0;
+}
+
 /**
  * Select and return pointer to opcode function.
  *
@@ -737,6 +702,76 @@ arm_opcode_fn(uint32_t opcode)
 	return opcodes[(opcode >> 20) & 0xff];
 }
 
+/**
+ * Called when a block reaches the end of a page, to see whether it can carry
+ * on into the next one. Blocks may touch at most two pages, and only if the
+ * next one can be fetched from without a Prefetch Abort.
+ *
+ * @param startpc ARM address of start of block
+ * @return Non-zero if the block should end
+ */
+static int
+block_page_end(uint32_t startpc)
+{
+	if ((PC >> 12) != (startpc >> 12) + 1) {
+		return 1;
+	}
+	pccache = PC >> 12;
+	pccache2 = getpccache(PC);
+	if (pccache2 == NULL) {
+		// Leave the Prefetch Abort to be taken when execution gets there
+		pccache = 0xffffffff;
+		return 1;
+	}
+	return 0;
+}
+
+/**
+ * Generate the instructions of a block without executing them, for a block
+ * generated away from the emulator thread. With nothing executed, the block
+ * cannot rely on the outcome of any instruction, and stays within its page.
+ *
+ * @param pc    ARM address of start of block
+ * @param code  Pointer to fetch instructions from, indexed by address >> 2
+ * @param pcpsr Pointer to the flags, in the mode the block will run in
+ * @param end   Set by this function or by the code generator to end the block
+ * @return Opcode of the last instruction, for endblock()
+ */
+uint32_t
+arm_translate_block(uint32_t pc, const uint32_t *code, uint32_t *pcpsr, int *end)
+{
+	uint32_t opcode;
+
+	do {
+		opcode = code[pc >> 2];
+		if ((opcode >> 28) == 0xf) {
+			// NV condition code
+			generatepcinc();
+		} else {
+			if (arm_opcode_needs_pc(opcode)) {
+				generateupdatepc();
+			}
+			generatepcinc();
+			if ((opcode & 0x0e000000) == 0x0a000000) {
+				generateupdateinscount();
+			}
+			if ((opcode >> 28) != 0xe) {
+				generateflagtestandbranch(opcode, pcpsr);
+			}
+			generatecall(arm_opcode_fn(opcode), opcode, pcpsr);
+			if (arm_opcode_may_abort(opcode)) {
+				generateirqtest();
+			}
+			if (arm_opcode_ends_block(opcode)) {
+				*end = 1;
+			}
+		}
+		pc += 4;
+	} while (!*end && (pc & 0xffc) != 0);
+
+	return opcode;
+}
+
 /**
  * Execute several ARM instructions.
  *
@@ -747,6 +782,8 @@ arm_exec(void)
 {
 	for (linecyc = 256; linecyc >= 0; linecyc--) {
 		if (!isblockvalid(PC)) {
+			const uint32_t startpc = PC;
+
 			// Interpret block
 			if ((PC >> 12) != pccache) {
 				pccache = PC >> 12;
@@ -763,11 +800,9 @@ arm_exec(void)
 			do {
 				const uint32_t opcode = pccache2[PC >> 2];
 
-				if ((opcode & 0x0e000000) == 0x0a000000) { blockend = 1; } /* Always end block on branches */
-				if ((opcode & 0x0c000000) == 0x0c000000) { blockend = 1; } /* And SWIs and copro stuff */
-				if (!(opcode & 0x0c000000) && (RD == 15)) { blockend = 1; } /* End if R15 can be modified */
-				if ((opcode & 0x0e108000) == 0x08108000) { blockend = 1; } /* End if R15 reloaded from LDM */
-				if ((opcode & 0x0c100000) == 0x04100000 && (RD == 15)) { blockend = 1; } /* End if R15 reloaded from LDR */
+				if (arm_opcode_ends_block(opcode)) {
+					blockend = 1;
+				}
 				if (flaglookup[opcode >> 28][(*pcpsr) >> 28]) {
 					OpFn fn = arm_opcode_fn(opcode);
 					fn(opcode);
@@ -775,25 +810,29 @@ arm_exec(void)
 				// if ((opcode & 0x0e000000) == 0x0a000000) blockend = 1; /* Always end block on branches */
 				// if ((opcode & 0x0c000000) == 0x0c000000) blockend = 1; /* And SWIs and copro stuff */
 				arm.reg[15] += 4;
-				if ((PC & 0xffc) == 0) {
-					blockend = 1;
+				if ((PC & 0xffc) == 0 && !blockend && !(arm.event & 0x40)) {
+					blockend = block_page_end(startpc);
 				}
 				inscount++;
 			} while (!blockend && !(arm.event & 0x40));
 		} else {
-			const uint32_t hash = HASH(PC);
+			const int templ = codeblock_lookup(PC);
 			/* if (pagedirty[PC>>9])
 			{
 				pagedirty[PC>>9]=0;
 				cacheclearpage(PC>>9);
 			}
-			else */ if (codeblockpc[hash] == PC) {
-				const uint32_t templ = codeblocknum[hash];
+			else */ if (templ >= 0) {
 				void (*gen_func)(void);
 
+				codecache_hits++;
 				gen_func = (void *) (&rcodeblock[templ][BLOCKSTART]);
 				// gen_func=(void *)(&codeblock[blocks[templ]>>24][blocks[templ]&0xFFF][4]);
 				gen_func();
+				if (blockidle) {
+					blockidle = 0;
+					idle_loop();
+				}
 				if (arm.event & 0x40) {
 					arm.reg[15] += 4;
 				}
@@ -801,6 +840,7 @@ arm_exec(void)
 					updatemode(arm.reg[cpsr] & arm.mmask);
 				}
 			} else {
+				const uint32_t startpc = PC;
 				uint32_t opcode;
 
 				if ((PC >> 12) != pccache) {
@@ -814,7 +854,8 @@ arm_exec(void)
 						continue;
 					}
 				}
-				initcodeblock(PC);
+				codecache_misses++;
+				initcodeblock(PC, pccache2);
 				blockend = 0;
 				do {
 					opcode = pccache2[PC >> 2];
@@ -839,18 +880,17 @@ arm_exec(void)
 							generateirqtest();
 						}
 						// if ((opcode & 0x0e000000) == 0x0a000000) blockend = 1; /* Always end block on branches */
-						if ((opcode & 0x0c000000) == 0x0c000000) blockend = 1; /* And SWIs and copro stuff */
-						if (!(opcode & 0x0c000000) && (RD == 15)) blockend = 1; /* End if R15 can be modified */
-						if ((opcode & 0x0e108000) == 0x08108000) blockend = 1; /* End if R15 reloaded from LDM */
-						if ((opcode & 0x0c100000) == 0x04100000 && (RD == 15)) blockend=1; /* End if R15 reloaded from LDR */
+						if (arm_opcode_ends_block(opcode)) {
+							blockend = 1;
+						}
 						if (flaglookup[opcode >> 28][(*pcpsr) >> 28]) {
 							OpFn fn = arm_opcode_fn(opcode);
 							fn(opcode);
 						}
 					}
 					arm.reg[15] += 4;
-					if ((PC & 0xffc) == 0) {
-						blockend = 1;
+					if ((PC & 0xffc) == 0 && !blockend && !(arm.event & 0x40)) {
+						blockend = block_page_end(startpc);
 					}
 				} while (!blockend && !(arm.event & 0x40));
 				endblock(opcode);
@@ -18,11 +18,6 @@
   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
  */
 
-/*Preliminary FPA emulation. This works to an extent - !Draw works with it, !SICK
-  seems to (FPA Whetstone scores are around 100x without), but !AMPlayer doesn't
-  work, and GCC stuff tends to crash.*/
-//#define FPA
-
 #include <stdio.h>
 #include <string.h>
 #include <stdint.h>
@@ -60,6 +55,145 @@ static int unpredictable_count = 1000; ///< Limit logging of unpredictable instr
 uint32_t pccache;
 static const uint32_t *pccache2;
 
+/* Instructions are decoded once into the handler that executes them, and the
+   result kept per page of code, so that each later execution dispatches
+   straight to its handler */
+#define OP_LDRH		0x100
+#define OP_STRH		0x101
+#define OP_LDRSB	0x102
+#define OP_LDRSH	0x103
+#define OP_COUNT	0x104	/**< Number of handlers */
+#define OP_COND		0x200	/**< Flag for instructions that are not always executed */
+#define OP_DECODE	0xffff	/**< Instruction not decoded yet */
+
+#define DECODE_PAGES	64	/**< Pages of decoded instructions kept */
+
+typedef struct {
+	const uint32_t	*code;		/**< pccache2 of the page, or NULL if unused */
+	uint32_t	page;		/**< Virtual page number */
+	uint16_t	op[1024];	/**< Handler of each instruction, or OP_DECODE */
+} DecodedPage;
+
+static DecodedPage decoded[DECODE_PAGES];
+static DecodedPage *pcdecoded;	/**< Decoded instructions of the page at pccache, or NULL */
+
+/**
+ * Decode an instruction into the handler that executes it.
+ *
+ * @param opcode Opcode of instruction
+ * @return Handler index, with OP_COND set if the instruction is conditional
+ */
+static unsigned
+arm_decode(uint32_t opcode)
+{
+	unsigned op = (opcode >> 20) & 0xff;
+
+	if (arm.arch_v4) {
+		if ((opcode & 0xe0000f0) == 0xb0) {
+			op = (opcode & 0x100000) ? OP_LDRH : OP_STRH;
+		} else if ((opcode & 0xe1000d0) == 0x1000d0) {
+			op = ((opcode & 0xf0) == 0xd0) ? OP_LDRSB : OP_LDRSH;
+		}
+	}
+	if ((opcode >> 28) != 0xe) {
+		op |= OP_COND;
+	}
+	return op;
+}
+
+/**
+ * Find the decoded instructions of a page of code, starting afresh if the
+ * page was not decoded or has been remapped since.
+ *
+ * The page is taken out of the write TLB, so that every write to it reaches
+ * arm_decode_clear_write(). Writes are only seen through the write TLB while
+ * the MMU is on, so with it off instructions are decoded as they are executed
+ * instead.
+ *
+ * @param page Virtual page number
+ * @param code pccache2 of the page
+ * @return Decoded instructions, or NULL if they can not be kept
+ */
+static DecodedPage *
+decoded_page(uint32_t page, const uint32_t *code)
+{
+	DecodedPage *d = &decoded[page % DECODE_PAGES];
+
+	if (!mmu) {
+		return NULL;
+	}
+	if (d->code != code || d->page != page) {
+		d->code = code;
+		d->page = page;
+		memset(d->op, 0xff, sizeof(d->op));
+	}
+	/* The page may have been in the write TLB before it was decoded, and
+	   writes through it would miss arm_decode_clear_write() */
+	vwaddrl[page] = 0xffffffff;
+	return d;
+}
+
+/**
+ * Discard all decoded instructions, when the memory map changes.
+ */
+void
+arm_decode_reset(void)
+{
+	int c;
+
+	for (c = 0; c < DECODE_PAGES; c++) {
+		decoded[c].code = NULL;
+	}
+	pcdecoded = NULL;
+	pccache = 0xffffffff;
+}
+
+/**
+ * Discard the decoded instructions of a page.
+ *
+ * @param page Virtual page number
+ */
+void
+arm_decode_clear_page(uint32_t page)
+{
+	DecodedPage *d = &decoded[page % DECODE_PAGES];
+
+	if (d->page == page) {
+		d->code = NULL;
+		if (d == pcdecoded) {
+			pcdecoded = NULL;
+			pccache = 0xffffffff;
+		}
+	}
+}
+
+/**
+ * Discard the decoded instruction at an address being written.
+ *
+ * @param addr Virtual address of write
+ * @return Non-zero if the page has decoded instructions, and so must be kept
+ *         out of the write TLB
+ */
+int
+arm_decode_clear_write(uint32_t addr)
+{
+	DecodedPage *d = &decoded[(addr >> 12) % DECODE_PAGES];
+
+	if (d->code == NULL || d->page != (addr >> 12)) {
+		return 0;
+	}
+	d->op[(addr >> 2) & 0x3ff] = OP_DECODE;
+	return 1;
+}
+
+#if defined __GNUC__
+#define OP(n)		op_##n
+#define OP_DEFAULT	op_default
+#else
+#define OP(n)		case n
+#define OP_DEFAULT	default
+#endif
+
 /**
  * Return true if this ARM core is the dynarec version
  *
@@ -73,94 +207,10 @@ arm_is_dynarec(void)
 
 void updatemode(uint32_t m)
 {
-        uint32_t c, om = arm.mode;
-
-        usrregs[15] = &arm.reg[15];
-        switch (arm.mode & 0xf) { /* Store back registers */
-            case USER:
-            case SYSTEM: /* System (ARMv4) shares same bank as User mode */
-                for (c=8;c<15;c++) arm.user_reg[c] = arm.reg[c];
-                break;
-
-            case IRQ:
-                for (c=8;c<13;c++) arm.user_reg[c] = arm.reg[c];
-                arm.irq_reg[0] = arm.reg[13];
-                arm.irq_reg[1] = arm.reg[14];
-                break;
-
-            case FIQ:
-                for (c=8;c<15;c++) arm.fiq_reg[c] = arm.reg[c];
-                break;
-
-            case SUPERVISOR:
-                for (c=8;c<13;c++) arm.user_reg[c] = arm.reg[c];
-                arm.super_reg[0] = arm.reg[13];
-                arm.super_reg[1] = arm.reg[14];
-                break;
-
-            case ABORT:
-                for (c=8;c<13;c++) arm.user_reg[c] = arm.reg[c];
-                arm.abort_reg[0] = arm.reg[13];
-                arm.abort_reg[1] = arm.reg[14];
-                break;
-
-            case UNDEFINED:
-                for (c=8;c<13;c++) arm.user_reg[c] = arm.reg[c];
-                arm.undef_reg[0] = arm.reg[13];
-                arm.undef_reg[1] = arm.reg[14];
-                break;
-        }
-        arm.mode = m;
+        uint32_t om = arm.mode;
 
-        switch (m&15)
-        {
-            case USER:
-            case SYSTEM:
-                for (c=8;c<15;c++) arm.reg[c] = arm.user_reg[c];
-                for (c=0;c<15;c++) usrregs[c] = &arm.reg[c];
-                break;
-
-            case IRQ:
-                for (c=8;c<13;c++) arm.reg[c] = arm.user_reg[c];
-                arm.reg[13] = arm.irq_reg[0];
-                arm.reg[14] = arm.irq_reg[1];
-                for (c=0;c<13;c++) usrregs[c] = &arm.reg[c];
-                for (c=13;c<15;c++) usrregs[c] = &arm.user_reg[c];
-                break;
-            
-            case FIQ:
-                for (c=8;c<15;c++) arm.reg[c] = arm.fiq_reg[c];
-                for (c=0;c<8;c++)  usrregs[c] = &arm.reg[c];
-                for (c=8;c<15;c++) usrregs[c] = &arm.user_reg[c];
-                break;
-
-            case SUPERVISOR:
-                for (c=8;c<13;c++) arm.reg[c] = arm.user_reg[c];
-                arm.reg[13] = arm.super_reg[0];
-                arm.reg[14] = arm.super_reg[1];
-                for (c=0;c<13;c++) usrregs[c] = &arm.reg[c];
-                for (c=13;c<15;c++) usrregs[c] = &arm.user_reg[c];
-                break;
-            
-            case ABORT:
-                for (c=8;c<13;c++) arm.reg[c] = arm.user_reg[c];
-                arm.reg[13] = arm.abort_reg[0];
-                arm.reg[14] = arm.abort_reg[1];
-                for (c=0;c<13;c++) usrregs[c] = &arm.reg[c];
-                for (c=13;c<15;c++) usrregs[c] = &arm.user_reg[c];
-                break;
-
-            case UNDEFINED:
-                for (c=8;c<13;c++) arm.reg[c] = arm.user_reg[c];
-                arm.reg[13] = arm.undef_reg[0];
-                arm.reg[14] = arm.undef_reg[1];
-                for (c=0;c<13;c++) usrregs[c] = &arm.reg[c];
-                for (c=13;c<15;c++) usrregs[c] = &arm.user_reg[c];
-                break;
-
-            default:
-                fatal("Bad mode %i\n", arm.mode);
-        }
+        arm_switch_bank(om, m);
+        arm.mode = m;
 
         if (ARM_MODE_32(arm.mode)) {
                 arm.mmask = 0x1f;
@@ -195,8 +245,6 @@ void updatemode(uint32_t m)
 
 static int stmlookup[256];
 
-int countbitstable[65536];
-
 void
 arm_init(void)
 {
@@ -210,14 +258,6 @@ arm_init(void)
 			}
 		}
 	}
-	for (c = 0; c < 65536; c++) {
-		countbitstable[c] = 0;
-		for (d = 0; d < 16; d++) {
-			if (c & (1u << d)) {
-				countbitstable[c] += 4;
-			}
-		}
-	}
 
 	cpsr = 15;
 	for (c = 0; c < 16; c++) {
@@ -278,6 +318,7 @@ arm_reset(CPUModel cpu_model)
 		arm.stm_writeback_at_end = 0;
 		arm.arch_v4 = 0;
 	}
+	arm_decode_reset();
 }
 
 void
@@ -497,7 +538,11 @@ exception(uint32_t mmode, uint32_t address, uint32_t diff)
 
 	if (ARM_MODE_32(arm.mode)) {
 		arm.spsr[mmode] = arm.reg[16];
-		updatemode(0x10 | mmode);
+		/* Staying in 32-bit mode, so only the banked registers and the
+		   privilege level change */
+		arm_switch_bank(arm.mode, 0x10 | mmode);
+		arm.mode = 0x10 | mmode;
+		memmode = 1;
 		arm.reg[14] = link;
 		arm.reg[16] &= ~0x1fu;
 		arm.reg[16] |= 0x10 | mmode | irq_disable;
@@ -545,12 +590,50 @@ arm_unpredictable(uint32_t opcode)
 int
 arm_exec(void)
 {
+#if defined __GNUC__
+	static const void *const handlers[OP_COUNT] = {
+		&&op_0x00, &&op_0x01, &&op_0x02, &&op_0x03, &&op_0x04, &&op_0x05, &&op_0x06, &&op_0x07, // 00
+		&&op_0x08, &&op_0x09, &&op_0x0a, &&op_0x0b, &&op_0x0c, &&op_0x0d, &&op_0x0e, &&op_0x0f, // 08
+		&&op_0x10, &&op_0x11, &&op_0x12, &&op_0x13, &&op_0x14, &&op_0x15, &&op_0x16, &&op_0x17, // 10
+		&&op_0x18, &&op_0x19, &&op_0x1a, &&op_0x1b, &&op_0x1c, &&op_0x1d, &&op_0x1e, &&op_0x1f, // 18
+		&&op_0x20, &&op_0x21, &&op_0x22, &&op_0x23, &&op_0x24, &&op_0x25, &&op_0x26, &&op_0x27, // 20
+		&&op_0x28, &&op_0x29, &&op_0x2a, &&op_0x2b, &&op_0x2c, &&op_0x2d, &&op_0x2e, &&op_0x2f, // 28
+		&&op_default, &&op_0x31, &&op_0x32, &&op_0x33, &&op_default, &&op_0x35, &&op_0x36, &&op_0x37, // 30
+		&&op_0x38, &&op_0x39, &&op_0x3a, &&op_0x3b, &&op_0x3c, &&op_0x3d, &&op_0x3e, &&op_0x3f, // 38
+		&&op_0x40, &&op_0x41, &&op_0x42, &&op_0x43, &&op_0x44, &&op_0x45, &&op_0x46, &&op_0x47, // 40
+		&&op_0x48, &&op_0x49, &&op_0x4a, &&op_0x4b, &&op_0x4c, &&op_0x4d, &&op_0x4e, &&op_0x4f, // 48
+		&&op_0x50, &&op_0x51, &&op_0x52, &&op_0x53, &&op_0x54, &&op_0x55, &&op_0x56, &&op_0x57, // 50
+		&&op_0x58, &&op_0x59, &&op_0x5a, &&op_0x5b, &&op_0x5c, &&op_0x5d, &&op_0x5e, &&op_0x5f, // 58
+		&&op_0x60, &&op_0x61, &&op_0x62, &&op_0x63, &&op_0x64, &&op_0x65, &&op_0x66, &&op_0x67, // 60
+		&&op_0x68, &&op_0x69, &&op_0x6a, &&op_0x6b, &&op_0x6c, &&op_0x6d, &&op_0x6e, &&op_0x6f, // 68
+		&&op_0x70, &&op_0x71, &&op_0x72, &&op_0x73, &&op_0x74, &&op_0x75, &&op_0x76, &&op_0x77, // 70
+		&&op_0x78, &&op_0x79, &&op_0x7a, &&op_0x7b, &&op_0x7c, &&op_0x7d, &&op_0x7e, &&op_0x7f, // 78
+		&&op_0x80, &&op_0x81, &&op_0x82, &&op_0x83, &&op_0x84, &&op_0x85, &&op_0x86, &&op_0x87, // 80
+		&&op_0x88, &&op_0x89, &&op_0x8a, &&op_0x8b, &&op_0x8c, &&op_0x8d, &&op_0x8e, &&op_0x8f, // 88
+		&&op_0x90, &&op_0x91, &&op_0x92, &&op_0x93, &&op_0x94, &&op_0x95, &&op_0x96, &&op_0x97, // 90
+		&&op_0x98, &&op_0x99, &&op_0x9a, &&op_0x9b, &&op_0x9c, &&op_0x9d, &&op_0x9e, &&op_0x9f, // 98
+		&&op_0xa0, &&op_0xa1, &&op_0xa2, &&op_0xa3, &&op_0xa4, &&op_0xa5, &&op_0xa6, &&op_0xa7, // a0
+		&&op_0xa8, &&op_0xa9, &&op_0xaa, &&op_0xab, &&op_0xac, &&op_0xad, &&op_0xae, &&op_0xaf, // a8
+		&&op_0xb0, &&op_0xb1, &&op_0xb2, &&op_0xb3, &&op_0xb4, &&op_0xb5, &&op_0xb6, &&op_0xb7, // b0
+		&&op_0xb8, &&op_0xb9, &&op_0xba, &&op_0xbb, &&op_0xbc, &&op_0xbd, &&op_0xbe, &&op_0xbf, // b8
+		&&op_0xc0, &&op_0xc1, &&op_0xc2, &&op_0xc3, &&op_0xc4, &&op_0xc5, &&op_0xc6, &&op_0xc7, // c0
+		&&op_0xc8, &&op_0xc9, &&op_0xca, &&op_0xcb, &&op_0xcc, &&op_0xcd, &&op_0xce, &&op_0xcf, // c8
+		&&op_0xd0, &&op_0xd1, &&op_0xd2, &&op_0xd3, &&op_0xd4, &&op_0xd5, &&op_0xd6, &&op_0xd7, // d0
+		&&op_0xd8, &&op_0xd9, &&op_0xda, &&op_0xdb, &&op_0xdc, &&op_0xdd, &&op_0xde, &&op_0xdf, // d8
+		&&op_0xe0, &&op_0xe1, &&op_0xe2, &&op_0xe3, &&op_0xe4, &&op_0xe5, &&op_0xe6, &&op_0xe7, // e0
+		&&op_0xe8, &&op_0xe9, &&op_0xea, &&op_0xeb, &&op_0xec, &&op_0xed, &&op_0xee, &&op_0xef, // e8
+		&&op_0xf0, &&op_0xf1, &&op_0xf2, &&op_0xf3, &&op_0xf4, &&op_0xf5, &&op_0xf6, &&op_0xf7, // f0
+		&&op_0xf8, &&op_0xf9, &&op_0xfa, &&op_0xfb, &&op_0xfc, &&op_0xfd, &&op_0xfe, &&op_0xff, // f8
+		&&op_OP_LDRH, &&op_OP_STRH, &&op_OP_LDRSB, &&op_OP_LDRSH
+	};
+#endif
 	int linecyc;
 
 	for (linecyc = 0; linecyc < 200; linecyc++) {
 		uint32_t opcode;
 		uint32_t lhs, rhs, dest;
 		uint32_t addr, data, offset, writeback;
+		unsigned op;
 
 		if ((PC >> 12) != pccache) {
 			pccache = PC >> 12;
@@ -562,32 +645,25 @@ arm_exec(void)
 				arm.reg[15] += 4;
 				continue;
 			}
+			pcdecoded = decoded_page(pccache, pccache2);
 		}
 		opcode = pccache2[PC >> 2];
-
-		if (flaglookup[opcode >> 28][(*pcpsr) >> 28]) {
-			if (arm.arch_v4) {
-				if ((opcode & 0xe0000f0) == 0xb0) {
-					// LDRH/STRH
-					if (opcode & 0x100000) {
-						arm_ldrh(opcode);
-					} else {
-						arm_strh(opcode);
-					}
-					goto skip;
-				} else if ((opcode & 0xe1000d0) == 0x1000d0) {
-					// LDRSB/LDRSH
-					if ((opcode & 0xf0) == 0xd0) {
-						arm_ldrsb(opcode);
-					} else {
-						arm_ldrsh(opcode);
-					}
-					goto skip;
-				}
+		if (pcdecoded != NULL) {
+			op = pcdecoded->op[(PC >> 2) & 0x3ff];
+			if (op == OP_DECODE) {
+				op = arm_decode(opcode);
+				pcdecoded->op[(PC >> 2) & 0x3ff] = (uint16_t) op;
 			}
+		} else {
+			op = arm_decode(opcode);
+		}
 
-			switch ((opcode >> 20) & 0xff) {
-			case 0x00: // AND reg
+		if (!(op & OP_COND) || flaglookup[opcode >> 28][(*pcpsr) >> 28]) {
+#if defined __GNUC__
+			goto *handlers[op & ~OP_COND];
+#endif
+			switch (op & ~OP_COND) {
+			OP(0x00): // AND reg
 				if ((opcode & 0xf0) == 0x90) {
 					// MUL
 					arm.reg[MULRD] = (MULRD == MULRM) ? 0 :
@@ -598,7 +674,7 @@ arm_exec(void)
 				}
 				break;
 
-			case 0x01: // ANDS reg
+			OP(0x01): // ANDS reg
 				if ((opcode & 0xf0) == 0x90) {
 					// MULS
 					arm.reg[MULRD] = (MULRD == MULRM) ? 0 :
@@ -616,7 +692,7 @@ arm_exec(void)
 				}
 				break;
 
-			case 0x02: // EOR reg
+			OP(0x02): // EOR reg
 				if ((opcode & 0xf0) == 0x90) {
 					// MLA
 					arm.reg[MULRD] = (MULRD == MULRM) ? 0 :
@@ -627,7 +703,7 @@ arm_exec(void)
 				}
 				break;
 
-			case 0x03: // EORS reg
+			OP(0x03): // EORS reg
 				if ((opcode & 0xf0) == 0x90) {
 					// MLAS
 					arm.reg[MULRD] = (MULRD == MULRM) ? 0 :
@@ -645,12 +721,12 @@ arm_exec(void)
 				}
 				break;
 
-			case 0x04: // SUB reg
+			OP(0x04): // SUB reg
 				dest = GETADDR(RN) - shift2(opcode);
 				arm_write_dest(opcode, dest);
 				break;
 
-			case 0x05: // SUBS reg
+			OP(0x05): // SUBS reg
 				lhs = GETADDR(RN);
 				rhs = shift2(opcode);
 				dest = lhs - rhs;
@@ -662,12 +738,12 @@ arm_exec(void)
 				}
 				break;
 
-			case 0x06: // RSB reg
+			OP(0x06): // RSB reg
 				dest = shift2(opcode) - GETADDR(RN);
 				arm_write_dest(opcode, dest);
 				break;
 
-			case 0x07: // RSBS reg
+			OP(0x07): // RSBS reg
 				lhs = GETADDR(RN);
 				rhs = shift2(opcode);
 				dest = rhs - lhs;
@@ -679,7 +755,7 @@ arm_exec(void)
 				}
 				break;
 
-			case 0x08: // ADD reg
+			OP(0x08): // ADD reg
 				if (arm.arch_v4 && (opcode & 0xf0) == 0x90) {
 					// UMULL
 					uint64_t mula = (uint64_t) arm.reg[MULRS];
@@ -694,7 +770,7 @@ arm_exec(void)
 				arm_write_dest(opcode, dest);
 				break;
 
-			case 0x09: // ADDS reg
+			OP(0x09): // ADDS reg
 				if (arm.arch_v4 && (opcode & 0xf0) == 0x90) {
 					// UMULLS
 					uint64_t mula = (uint64_t) arm.reg[MULRS];
@@ -717,7 +793,7 @@ arm_exec(void)
 				}
 				break;
 
-			case 0x0a: // ADC reg
+			OP(0x0a): // ADC reg
 				if (arm.arch_v4 && (opcode & 0xf0) == 0x90) {
 					// UMLAL
 					uint64_t mula = (uint64_t) arm.reg[MULRS];
@@ -734,7 +810,7 @@ arm_exec(void)
 				arm_write_dest(opcode, dest);
 				break;
 
-			case 0x0b: // ADCS reg
+			OP(0x0b): // ADCS reg
 				if (arm.arch_v4 && (opcode & 0xf0) == 0x90) {
 					// UMLALS
 					uint64_t mula = (uint64_t) arm.reg[MULRS];
@@ -759,7 +835,7 @@ arm_exec(void)
 				}
 				break;
 
-			case 0x0c: // SBC reg
+			OP(0x0c): // SBC reg
 				if (arm.arch_v4 && (opcode & 0xf0) == 0x90) {
 					// SMULL
 					int64_t mula = (int64_t) (int32_t) arm.reg[MULRS];
@@ -774,7 +850,7 @@ arm_exec(void)
 				arm_write_dest(opcode, dest);
 				break;
 
-			case 0x0d: // SBCS reg
+			OP(0x0d): // SBCS reg
 				if (arm.arch_v4 && (opcode & 0xf0) == 0x90) {
 					// SMULLS
 					int64_t mula = (int64_t) (int32_t) arm.reg[MULRS];
@@ -797,7 +873,7 @@ arm_exec(void)
 				}
 				break;
 
-			case 0x0e: // RSC reg
+			OP(0x0e): // RSC reg
 				if (arm.arch_v4 && (opcode & 0xf0) == 0x90) {
 					// SMLAL
 					int64_t mula = (int64_t) (int32_t) arm.reg[MULRS];
@@ -814,7 +890,7 @@ arm_exec(void)
 				arm_write_dest(opcode, dest);
 				break;
 
-			case 0x0f: // RSCS reg
+			OP(0x0f): // RSCS reg
 				if (arm.arch_v4 && (opcode & 0xf0) == 0x90) {
 					// SMLALS
 					int64_t mula = (int64_t) (int32_t) arm.reg[MULRS];
@@ -839,7 +915,7 @@ arm_exec(void)
 				}
 				break;
 
-			case 0x10: // MRS reg,CPSR and SWP
+			OP(0x10): // MRS reg,CPSR and SWP
 				if ((opcode & 0xff0) == 0x90) {
 					// SWP
 					if (RD != 15) {
@@ -870,7 +946,7 @@ arm_exec(void)
 				}
 				break;
 
-			case 0x11: // TST reg
+			OP(0x11): // TST reg
 				lhs = GETADDR(RN);
 				if (RD == 15) {
 					// TSTP reg
@@ -880,7 +956,7 @@ arm_exec(void)
 				}
 				break;
 
-			case 0x12: // MSR CPSR,reg
+			OP(0x12): // MSR CPSR,reg
 				if ((opcode & 0xf010) == 0xf000) {
 					arm_write_cpsr(opcode, arm.reg[RM]);
 				} else if (arm.arch_v4) {
@@ -890,7 +966,7 @@ arm_exec(void)
 				}
 				break;
 
-			case 0x13: // TEQ reg
+			OP(0x13): // TEQ reg
 				lhs = GETADDR(RN);
 				if (RD == 15) {
 					// TEQP reg
@@ -900,7 +976,7 @@ arm_exec(void)
 				}
 				break;
 
-			case 0x14: // MRS reg,SPSR and SWPB
+			OP(0x14): // MRS reg,SPSR and SWPB
 				if ((opcode & 0xff0) == 0x90) {
 					// SWPB
 					if (RD != 15) {
@@ -926,7 +1002,7 @@ arm_exec(void)
 				}
 				break;
 
-			case 0x15: // CMP reg
+			OP(0x15): // CMP reg
 				lhs = GETADDR(RN);
 				rhs = shift2(opcode);
 				dest = lhs - rhs;
@@ -938,7 +1014,7 @@ arm_exec(void)
 				}
 				break;
 
-			case 0x16: // MSR SPSR,reg
+			OP(0x16): // MSR SPSR,reg
 				if ((opcode & 0xf010) == 0xf000) {
 					arm_write_spsr(opcode, arm.reg[RM]);
 				} else if (arm.arch_v4) {
@@ -948,7 +1024,7 @@ arm_exec(void)
 				}
 				break;
 
-			case 0x17: // CMN reg
+			OP(0x17): // CMN reg
 				lhs = GETADDR(RN);
 				rhs = shift2(opcode);
 				dest = lhs + rhs;
@@ -960,12 +1036,12 @@ arm_exec(void)
 				}
 				break;
 
-			case 0x18: // ORR reg
+			OP(0x18): // ORR reg
 				dest = GETADDR(RN) | shift2(opcode);
 				arm_write_dest(opcode, dest);
 				break;
 
-			case 0x19: // ORRS reg
+			OP(0x19): // ORRS reg
 				lhs = GETADDR(RN);
 				if (RD == 15) {
 					arm_write_r15(opcode, lhs | shift2(opcode));
@@ -976,12 +1052,12 @@ arm_exec(void)
 				}
 				break;
 
-			case 0x1a: // MOV reg
+			OP(0x1a): // MOV reg
 				dest = shift2(opcode);
 				arm_write_dest(opcode, dest);
 				break;
 
-			case 0x1b: // MOVS reg
+			OP(0x1b): // MOVS reg
 				if (RD == 15) {
 					arm_write_r15(opcode, shift2(opcode));
 				} else {
@@ -990,12 +1066,12 @@ arm_exec(void)
 				}
 				break;
 
-			case 0x1c: // BIC reg
+			OP(0x1c): // BIC reg
 				dest = GETADDR(RN) & ~shift2(opcode);
 				arm_write_dest(opcode, dest);
 				break;
 
-			case 0x1d: // BICS reg
+			OP(0x1d): // BICS reg
 				lhs = GETADDR(RN);
 				if (RD == 15) {
 					arm_write_r15(opcode, lhs & ~shift2(opcode));
@@ -1006,12 +1082,12 @@ arm_exec(void)
 				}
 				break;
 
-			case 0x1e: // MVN reg
+			OP(0x1e): // MVN reg
 				dest = ~shift2(opcode);
 				arm_write_dest(opcode, dest);
 				break;
 
-			case 0x1f: // MVNS reg
+			OP(0x1f): // MVNS reg
 				if (RD == 15) {
 					arm_write_r15(opcode, ~shift2(opcode));
 				} else {
@@ -1020,12 +1096,12 @@ arm_exec(void)
 				}
 				break;
 
-			case 0x20: // AND imm
+			OP(0x20): // AND imm
 				dest = GETADDR(RN) & arm_imm(opcode);
 				arm_write_dest(opcode, dest);
 				break;
 
-			case 0x21: // ANDS imm
+			OP(0x21): // ANDS imm
 				lhs = GETADDR(RN);
 				if (RD == 15) {
 					arm_write_r15(opcode, lhs & arm_imm(opcode));
@@ -1036,12 +1112,12 @@ arm_exec(void)
 				}
 				break;
 
-			case 0x22: // EOR imm
+			OP(0x22): // EOR imm
 				dest = GETADDR(RN) ^ arm_imm(opcode);
 				arm_write_dest(opcode, dest);
 				break;
 
-			case 0x23: // EORS imm
+			OP(0x23): // EORS imm
 				lhs = GETADDR(RN);
 				if (RD == 15) {
 					arm_write_r15(opcode, lhs ^ arm_imm(opcode));
@@ -1052,12 +1128,12 @@ arm_exec(void)
 				}
 				break;
 
-			case 0x24: // SUB imm
+			OP(0x24): // SUB imm
 				dest = GETADDR(RN) - arm_imm(opcode);
 				arm_write_dest(opcode, dest);
 				break;
 
-			case 0x25: // SUBS imm
+			OP(0x25): // SUBS imm
 				lhs = GETADDR(RN);
 				rhs = arm_imm(opcode);
 				dest = lhs - rhs;
@@ -1069,12 +1145,12 @@ arm_exec(void)
 				}
 				break;
 
-			case 0x26: // RSB imm
+			OP(0x26): // RSB imm
 				dest = arm_imm(opcode) - GETADDR(RN);
 				arm_write_dest(opcode, dest);
 				break;
 
-			case 0x27: // RSBS imm
+			OP(0x27): // RSBS imm
 				lhs = GETADDR(RN);
 				rhs = arm_imm(opcode);
 				dest = rhs - lhs;
@@ -1086,12 +1162,12 @@ arm_exec(void)
 				}
 				break;
 
-			case 0x28: // ADD imm
+			OP(0x28): // ADD imm
 				dest = GETADDR(RN) + arm_imm(opcode);
 				arm_write_dest(opcode, dest);
 				break;
 
-			case 0x29: // ADDS imm
+			OP(0x29): // ADDS imm
 				lhs = GETADDR(RN);
 				rhs = arm_imm(opcode);
 				dest = lhs + rhs;
@@ -1103,12 +1179,12 @@ arm_exec(void)
 				}
 				break;
 
-			case 0x2a: // ADC imm
+			OP(0x2a): // ADC imm
 				dest = GETADDR(RN) + arm_imm(opcode) + CFSET;
 				arm_write_dest(opcode, dest);
 				break;
 
-			case 0x2b: // ADCS imm
+			OP(0x2b): // ADCS imm
 				lhs = GETADDR(RN);
 				rhs = arm_imm(opcode);
 				dest = lhs + rhs + CFSET;
@@ -1120,12 +1196,12 @@ arm_exec(void)
 				}
 				break;
 
-			case 0x2c: // SBC imm
+			OP(0x2c): // SBC imm
 				dest = GETADDR(RN) - arm_imm(opcode) - ((CFSET) ? 0 : 1);
 				arm_write_dest(opcode, dest);
 				break;
 
-			case 0x2d: // SBCS imm
+			OP(0x2d): // SBCS imm
 				lhs = GETADDR(RN);
 				rhs = arm_imm(opcode);
 				dest = lhs - rhs - (CFSET ? 0 : 1);
@@ -1137,12 +1213,12 @@ arm_exec(void)
 				}
 				break;
 
-			case 0x2e: // RSC imm
+			OP(0x2e): // RSC imm
 				dest = arm_imm(opcode) - GETADDR(RN) - ((CFSET) ? 0 : 1);
 				arm_write_dest(opcode, dest);
 				break;
 
-			case 0x2f: // RSCS imm
+			OP(0x2f): // RSCS imm
 				lhs = GETADDR(RN);
 				rhs = arm_imm(opcode);
 				dest = rhs - lhs - (CFSET ? 0 : 1);
@@ -1154,7 +1230,7 @@ arm_exec(void)
 				}
 				break;
 
-			case 0x31: // TST imm
+			OP(0x31): // TST imm
 				lhs = GETADDR(RN);
 				if (RD == 15) {
 					// TSTP imm
@@ -1164,7 +1240,7 @@ arm_exec(void)
 				}
 				break;
 
-			case 0x32: // MSR CPSR,imm
+			OP(0x32): // MSR CPSR,imm
 				if (RD == 15) {
 					arm_write_cpsr(opcode, arm_imm(opcode));
 				} else if (arm.arch_v4) {
@@ -1174,7 +1250,7 @@ arm_exec(void)
 				}
 				break;
 
-			case 0x33: // TEQ imm
+			OP(0x33): // TEQ imm
 				lhs = GETADDR(RN);
 				if (RD == 15) {
 					// TEQP imm
@@ -1184,7 +1260,7 @@ arm_exec(void)
 				}
 				break;
 
-			case 0x35: // CMP imm
+			OP(0x35): // CMP imm
 				lhs = GETADDR(RN);
 				rhs = arm_imm(opcode);
 				dest = lhs - rhs;
@@ -1196,7 +1272,7 @@ arm_exec(void)
 				}
 				break;
 
-			case 0x36: // MSR SPSR,imm
+			OP(0x36): // MSR SPSR,imm
 				if (RD == 15) {
 					arm_write_spsr(opcode, arm_imm(opcode));
 				} else if (arm.arch_v4) {
@@ -1206,7 +1282,7 @@ arm_exec(void)
 				}
 				break;
 
-			case 0x37: // CMN imm
+			OP(0x37): // CMN imm
 				lhs = GETADDR(RN);
 				rhs = arm_imm(opcode);
 				dest = lhs + rhs;
@@ -1218,12 +1294,12 @@ arm_exec(void)
 				}
 				break;
 
-			case 0x38: // ORR imm
+			OP(0x38): // ORR imm
 				dest = GETADDR(RN) | arm_imm(opcode);
 				arm_write_dest(opcode, dest);
 				break;
 
-			case 0x39: // ORRS imm
+			OP(0x39): // ORRS imm
 				lhs = GETADDR(RN);
 				if (RD == 15) {
 					arm_write_r15(opcode, lhs | arm_imm(opcode));
@@ -1234,12 +1310,12 @@ arm_exec(void)
 				}
 				break;
 
-			case 0x3a: // MOV imm
+			OP(0x3a): // MOV imm
 				dest = arm_imm(opcode);
 				arm_write_dest(opcode, dest);
 				break;
 
-			case 0x3b: // MOVS imm
+			OP(0x3b): // MOVS imm
 				if (RD == 15) {
 					arm_write_r15(opcode, arm_imm(opcode));
 				} else {
@@ -1248,12 +1324,12 @@ arm_exec(void)
 				}
 				break;
 
-			case 0x3c: // BIC imm
+			OP(0x3c): // BIC imm
 				dest = GETADDR(RN) & ~arm_imm(opcode);
 				arm_write_dest(opcode, dest);
 				break;
 
-			case 0x3d: // BICS imm
+			OP(0x3d): // BICS imm
 				lhs = GETADDR(RN);
 				if (RD == 15) {
 					arm_write_r15(opcode, lhs & ~arm_imm(opcode));
@@ -1264,12 +1340,12 @@ arm_exec(void)
 				}
 				break;
 
-			case 0x3e: // MVN imm
+			OP(0x3e): // MVN imm
 				dest = ~arm_imm(opcode);
 				arm_write_dest(opcode, dest);
 				break;
 
-			case 0x3f: // MVNS imm
+			OP(0x3f): // MVNS imm
 				if (RD == 15) {
 					arm_write_r15(opcode, ~arm_imm(opcode));
 				} else {
@@ -1278,15 +1354,15 @@ arm_exec(void)
 				}
 				break;
 
-			case 0x62: // STRT Rd, [Rn], -reg...
-			case 0x6a: // STRT Rd, [Rn], +reg...
+			OP(0x62): // STRT Rd, [Rn], -reg...
+			OP(0x6a): // STRT Rd, [Rn], +reg...
 				if (opcode & 0x10) {
 					arm_exception_undefined();
 					break;
 				}
 				// Fall-through
-			case 0x42: // STRT Rd, [Rn], #-imm
-			case 0x4a: // STRT Rd, [Rn], #+imm
+			OP(0x42): // STRT Rd, [Rn], #-imm
+			OP(0x4a): // STRT Rd, [Rn], #+imm
 				addr = GETADDR(RN);
 
 				// Store with User mode privileges
@@ -1311,15 +1387,15 @@ arm_exec(void)
 				arm.reg[RN] = addr;
 				break;
 
-			case 0x63: // LDRT Rd, [Rn], -reg...
-			case 0x6b: // LDRT Rd, [Rn], +reg...
+			OP(0x63): // LDRT Rd, [Rn], -reg...
+			OP(0x6b): // LDRT Rd, [Rn], +reg...
 				if (opcode & 0x10) {
 					arm_exception_undefined();
 					break;
 				}
 				// Fall-through
-			case 0x43: // LDRT Rd, [Rn], #-imm
-			case 0x4b: // LDRT Rd, [Rn], #+imm
+			OP(0x43): // LDRT Rd, [Rn], #-imm
+			OP(0x4b): // LDRT Rd, [Rn], #+imm
 				addr = GETADDR(RN);
 
 				// Load with User mode privileges
@@ -1354,15 +1430,15 @@ arm_exec(void)
 				LOADREG(RD, data);
 				break;
 
-			case 0x66: // STRBT Rd, [Rn], -reg...
-			case 0x6e: // STRBT Rd, [Rn], +reg...
+			OP(0x66): // STRBT Rd, [Rn], -reg...
+			OP(0x6e): // STRBT Rd, [Rn], +reg...
 				if (opcode & 0x10) {
 					arm_exception_undefined();
 					break;
 				}
 				// Fall-through
-			case 0x46: // STRBT Rd, [Rn], #-imm
-			case 0x4e: // STRBT Rd, [Rn], #+imm
+			OP(0x46): // STRBT Rd, [Rn], #-imm
+			OP(0x4e): // STRBT Rd, [Rn], #+imm
 				addr = GETADDR(RN);
 
 				// Store with User mode privileges
@@ -1387,15 +1463,15 @@ arm_exec(void)
 				arm.reg[RN] = addr;
 				break;
 
-			case 0x67: // LDRBT Rd, [Rn], -reg...
-			case 0x6f: // LDRBT Rd, [Rn], +reg...
+			OP(0x67): // LDRBT Rd, [Rn], -reg...
+			OP(0x6f): // LDRBT Rd, [Rn], +reg...
 				if (opcode & 0x10) {
 					arm_exception_undefined();
 					break;
 				}
 				// Fall-through
-			case 0x47: // LDRBT Rd, [Rn], #-imm
-			case 0x4f: // LDRBT Rd, [Rn], #+imm
+			OP(0x47): // LDRBT Rd, [Rn], #-imm
+			OP(0x4f): // LDRBT Rd, [Rn], #+imm
 				addr = GETADDR(RN);
 
 				// Load with User mode privileges
@@ -1427,23 +1503,23 @@ arm_exec(void)
 				LOADREG(RD, data);
 				break;
 
-			case 0x60: // STR Rd, [Rn], -reg...
-			case 0x68: // STR Rd, [Rn], +reg...
-			case 0x70: // STR Rd, [Rn, -reg...]
-			case 0x72: // STR Rd, [Rn, -reg...]!
-			case 0x78: // STR Rd, [Rn, +reg...]
-			case 0x7a: // STR Rd, [Rn, +reg...]!
+			OP(0x60): // STR Rd, [Rn], -reg...
+			OP(0x68): // STR Rd, [Rn], +reg...
+			OP(0x70): // STR Rd, [Rn, -reg...]
+			OP(0x72): // STR Rd, [Rn, -reg...]!
+			OP(0x78): // STR Rd, [Rn, +reg...]
+			OP(0x7a): // STR Rd, [Rn, +reg...]!
 				if (opcode & 0x10) {
 					arm_exception_undefined();
 					break;
 				}
 				// Fall-through
-			case 0x40: // STR Rd, [Rn], #-imm
-			case 0x48: // STR Rd, [Rn], #+imm
-			case 0x50: // STR Rd, [Rn, #-imm]
-			case 0x52: // STR Rd, [Rn, #-imm]!
-			case 0x58: // STR Rd, [Rn, #+imm]
-			case 0x5a: // STR Rd, [Rn, #+imm]!
+			OP(0x40): // STR Rd, [Rn], #-imm
+			OP(0x48): // STR Rd, [Rn], #+imm
+			OP(0x50): // STR Rd, [Rn, #-imm]
+			OP(0x52): // STR Rd, [Rn, #-imm]!
+			OP(0x58): // STR Rd, [Rn, #+imm]
+			OP(0x5a): // STR Rd, [Rn, #+imm]!
 				addr = GETADDR(RN);
 
 				// Calculate offset
@@ -1480,23 +1556,23 @@ arm_exec(void)
 				}
 				break;
 
-			case 0x61: // LDR Rd, [Rn], -reg...
-			case 0x69: // LDR Rd, [Rn], +reg...
-			case 0x71: // LDR Rd, [Rn, -reg...]
-			case 0x73: // LDR Rd, [Rn, -reg...]!
-			case 0x79: // LDR Rd, [Rn, +reg...]
-			case 0x7b: // LDR Rd, [Rn, +reg...]!
+			OP(0x61): // LDR Rd, [Rn], -reg...
+			OP(0x69): // LDR Rd, [Rn], +reg...
+			OP(0x71): // LDR Rd, [Rn, -reg...]
+			OP(0x73): // LDR Rd, [Rn, -reg...]!
+			OP(0x79): // LDR Rd, [Rn, +reg...]
+			OP(0x7b): // LDR Rd, [Rn, +reg...]!
 				if (opcode & 0x10) {
 					arm_exception_undefined();
 					break;
 				}
 				// Fall-through
-			case 0x41: // LDR Rd, [Rn], #-imm
-			case 0x49: // LDR Rd, [Rn], #+imm
-			case 0x51: // LDR Rd, [Rn, #-imm]
-			case 0x53: // LDR Rd, [Rn, #-imm]!
-			case 0x59: // LDR Rd, [Rn, #+imm]
-			case 0x5b: // LDR Rd, [Rn, #+imm]!
+			OP(0x41): // LDR Rd, [Rn], #-imm
+			OP(0x49): // LDR Rd, [Rn], #+imm
+			OP(0x51): // LDR Rd, [Rn, #-imm]
+			OP(0x53): // LDR Rd, [Rn, #-imm]!
+			OP(0x59): // LDR Rd, [Rn, #+imm]
+			OP(0x5b): // LDR Rd, [Rn, #+imm]!
 				addr = GETADDR(RN);
 
 				// Calculate offset
@@ -1543,23 +1619,23 @@ arm_exec(void)
 				LOADREG(RD, data);
 				break;
 
-			case 0x64: // STRB Rd, [Rn], -reg...
-			case 0x6c: // STRB Rd, [Rn], +reg...
-			case 0x74: // STRB Rd, [Rn, -reg...]
-			case 0x76: // STRB Rd, [Rn, -reg...]!
-			case 0x7c: // STRB Rd, [Rn, +reg...]
-			case 0x7e: // STRB Rd, [Rn, +reg...]!
+			OP(0x64): // STRB Rd, [Rn], -reg...
+			OP(0x6c): // STRB Rd, [Rn], +reg...
+			OP(0x74): // STRB Rd, [Rn, -reg...]
+			OP(0x76): // STRB Rd, [Rn, -reg...]!
+			OP(0x7c): // STRB Rd, [Rn, +reg...]
+			OP(0x7e): // STRB Rd, [Rn, +reg...]!
 				if (opcode & 0x10) {
 					arm_exception_undefined();
 					break;
 				}
 				// Fall-through
-			case 0x44: // STRB Rd, [Rn], #-imm
-			case 0x4c: // STRB Rd, [Rn], #+imm
-			case 0x54: // STRB Rd, [Rn, #-imm]
-			case 0x56: // STRB Rd, [Rn, #-imm]!
-			case 0x5c: // STRB Rd, [Rn, #+imm]
-			case 0x5e: // STRB Rd, [Rn, #+imm]!
+			OP(0x44): // STRB Rd, [Rn], #-imm
+			OP(0x4c): // STRB Rd, [Rn], #+imm
+			OP(0x54): // STRB Rd, [Rn, #-imm]
+			OP(0x56): // STRB Rd, [Rn, #-imm]!
+			OP(0x5c): // STRB Rd, [Rn, #+imm]
+			OP(0x5e): // STRB Rd, [Rn, #+imm]!
 				addr = GETADDR(RN);
 
 				// Calculate offset
@@ -1596,23 +1672,23 @@ arm_exec(void)
 				}
 				break;
 
-			case 0x65: // LDRB Rd, [Rn], -reg...
-			case 0x6d: // LDRB Rd, [Rn], +reg...
-			case 0x75: // LDRB Rd, [Rn, -reg...]
-			case 0x77: // LDRB Rd, [Rn, -reg...]!
-			case 0x7d: // LDRB Rd, [Rn, +reg...]
-			case 0x7f: // LDRB Rd, [Rn, +reg...]!
+			OP(0x65): // LDRB Rd, [Rn], -reg...
+			OP(0x6d): // LDRB Rd, [Rn], +reg...
+			OP(0x75): // LDRB Rd, [Rn, -reg...]
+			OP(0x77): // LDRB Rd, [Rn, -reg...]!
+			OP(0x7d): // LDRB Rd, [Rn, +reg...]
+			OP(0x7f): // LDRB Rd, [Rn, +reg...]!
 				if (opcode & 0x10) {
 					arm_exception_undefined();
 					break;
 				}
 				// Fall-through
-			case 0x45: // LDRB Rd, [Rn], #-imm
-			case 0x4d: // LDRB Rd, [Rn], #+imm
-			case 0x55: // LDRB Rd, [Rn, #-imm]
-			case 0x57: // LDRB Rd, [Rn, #-imm]!
-			case 0x5d: // LDRB Rd, [Rn, #+imm]
-			case 0x5f: // LDRB Rd, [Rn, #+imm]!
+			OP(0x45): // LDRB Rd, [Rn], #-imm
+			OP(0x4d): // LDRB Rd, [Rn], #+imm
+			OP(0x55): // LDRB Rd, [Rn, #-imm]
+			OP(0x57): // LDRB Rd, [Rn, #-imm]!
+			OP(0x5d): // LDRB Rd, [Rn, #+imm]
+			OP(0x5f): // LDRB Rd, [Rn, #+imm]!
 				addr = GETADDR(RN);
 
 				// Calculate offset
@@ -1656,10 +1732,10 @@ arm_exec(void)
 				LOADREG(RD, data);
 				break;
 
-			case 0x80: // STMDA
-			case 0x82: // STMDA !
-			case 0x90: // STMDB
-			case 0x92: // STMDB !
+			OP(0x80): // STMDA
+			OP(0x82): // STMDA !
+			OP(0x90): // STMDB
+			OP(0x92): // STMDB !
 				offset = arm_ldm_stm_offset(opcode);
 				addr = arm.reg[RN] - offset;
 				writeback = addr;
@@ -1670,10 +1746,10 @@ arm_exec(void)
 				arm_store_multiple(opcode, addr, writeback);
 				break;
 
-			case 0x88: // STMIA
-			case 0x8a: // STMIA !
-			case 0x98: // STMIB
-			case 0x9a: // STMIB !
+			OP(0x88): // STMIA
+			OP(0x8a): // STMIA !
+			OP(0x98): // STMIB
+			OP(0x9a): // STMIB !
 				offset = arm_ldm_stm_offset(opcode);
 				addr = arm.reg[RN];
 				writeback = addr + offset;
@@ -1684,10 +1760,10 @@ arm_exec(void)
 				arm_store_multiple(opcode, addr, writeback);
 				break;
 
-			case 0x84: // STMDA ^
-			case 0x86: // STMDA ^!
-			case 0x94: // STMDB ^
-			case 0x96: // STMDB ^!
+			OP(0x84): // STMDA ^
+			OP(0x86): // STMDA ^!
+			OP(0x94): // STMDB ^
+			OP(0x96): // STMDB ^!
 				offset = arm_ldm_stm_offset(opcode);
 				addr = arm.reg[RN] - offset;
 				writeback = addr;
@@ -1698,10 +1774,10 @@ arm_exec(void)
 				arm_store_multiple_s(opcode, addr, writeback);
 				break;
 
-			case 0x8c: // STMIA ^
-			case 0x8e: // STMIA ^!
-			case 0x9c: // STMIB ^
-			case 0x9e: // STMIB ^!
+			OP(0x8c): // STMIA ^
+			OP(0x8e): // STMIA ^!
+			OP(0x9c): // STMIB ^
+			OP(0x9e): // STMIB ^!
 				offset = arm_ldm_stm_offset(opcode);
 				addr = arm.reg[RN];
 				writeback = addr + offset;
@@ -1712,10 +1788,10 @@ arm_exec(void)
 				arm_store_multiple_s(opcode, addr, writeback);
 				break;
 
-			case 0x81: // LDMDA
-			case 0x83: // LDMDA !
-			case 0x91: // LDMDB
-			case 0x93: // LDMDB !
+			OP(0x81): // LDMDA
+			OP(0x83): // LDMDA !
+			OP(0x91): // LDMDB
+			OP(0x93): // LDMDB !
 				offset = arm_ldm_stm_offset(opcode);
 				addr = arm.reg[RN] - offset;
 				writeback = addr;
@@ -1726,10 +1802,10 @@ arm_exec(void)
 				arm_load_multiple(opcode, addr, writeback);
 				break;
 
-			case 0x89: // LDMIA
-			case 0x8b: // LDMIA !
-			case 0x99: // LDMIB
-			case 0x9b: // LDMIB !
+			OP(0x89): // LDMIA
+			OP(0x8b): // LDMIA !
+			OP(0x99): // LDMIB
+			OP(0x9b): // LDMIB !
 				offset = arm_ldm_stm_offset(opcode);
 				addr = arm.reg[RN];
 				writeback = addr + offset;
@@ -1740,10 +1816,10 @@ arm_exec(void)
 				arm_load_multiple(opcode, addr, writeback);
 				break;
 
-			case 0x85: // LDMDA ^
-			case 0x87: // LDMDA ^!
-			case 0x95: // LDMDB ^
-			case 0x97: // LDMDB ^!
+			OP(0x85): // LDMDA ^
+			OP(0x87): // LDMDA ^!
+			OP(0x95): // LDMDB ^
+			OP(0x97): // LDMDB ^!
 				offset = arm_ldm_stm_offset(opcode);
 				addr = arm.reg[RN] - offset;
 				writeback = addr;
@@ -1754,10 +1830,10 @@ arm_exec(void)
 				arm_load_multiple_s(opcode, addr, writeback);
 				break;
 
-			case 0x8d: // LDMIA ^
-			case 0x8f: // LDMIA ^!
-			case 0x9d: // LDMIB ^
-			case 0x9f: // LDMIB ^!
+			OP(0x8d): // LDMIA ^
+			OP(0x8f): // LDMIA ^!
+			OP(0x9d): // LDMIB ^
+			OP(0x9f): // LDMIB ^!
 				offset = arm_ldm_stm_offset(opcode);
 				addr = arm.reg[RN];
 				writeback = addr + offset;
@@ -1768,10 +1844,10 @@ arm_exec(void)
 				arm_load_multiple_s(opcode, addr, writeback);
 				break;
 
-			case 0xa0: case 0xa1: case 0xa2: case 0xa3: // B
-			case 0xa4: case 0xa5: case 0xa6: case 0xa7:
-			case 0xa8: case 0xa9: case 0xaa: case 0xab:
-			case 0xac: case 0xad: case 0xae: case 0xaf:
+			OP(0xa0): OP(0xa1): OP(0xa2): OP(0xa3): // B
+			OP(0xa4): OP(0xa5): OP(0xa6): OP(0xa7):
+			OP(0xa8): OP(0xa9): OP(0xaa): OP(0xab):
+			OP(0xac): OP(0xad): OP(0xae): OP(0xaf):
 				// Extract offset bits, and sign-extend
 				offset = (opcode << 8);
 				offset = (uint32_t) ((int32_t) offset >> 6);
@@ -1779,10 +1855,10 @@ arm_exec(void)
 				              (arm.reg[15] & ~arm.r15_mask);
 				break;
 
-			case 0xb0: case 0xb1: case 0xb2: case 0xb3: // BL
-			case 0xb4: case 0xb5: case 0xb6: case 0xb7:
-			case 0xb8: case 0xb9: case 0xba: case 0xbb:
-			case 0xbc: case 0xbd: case 0xbe: case 0xbf:
+			OP(0xb0): OP(0xb1): OP(0xb2): OP(0xb3): // BL
+			OP(0xb4): OP(0xb5): OP(0xb6): OP(0xb7):
+			OP(0xb8): OP(0xb9): OP(0xba): OP(0xbb):
+			OP(0xbc): OP(0xbd): OP(0xbe): OP(0xbf):
 				// Extract offset bits, and sign-extend
 				offset = (opcode << 8);
 				offset = (uint32_t) ((int32_t) offset >> 6);
@@ -1791,14 +1867,14 @@ arm_exec(void)
 				              (arm.reg[15] & ~arm.r15_mask);
 				break;
 
-			case 0xc0: case 0xc1: case 0xc2: case 0xc3: // Co-pro
-			case 0xc4: case 0xc5: case 0xc6: case 0xc7:
-			case 0xc8: case 0xc9: case 0xca: case 0xcb:
-			case 0xcc: case 0xcd: case 0xce: case 0xcf:
-			case 0xd0: case 0xd1: case 0xd2: case 0xd3:
-			case 0xd4: case 0xd5: case 0xd6: case 0xd7:
-			case 0xd8: case 0xd9: case 0xda: case 0xdb:
-			case 0xdc: case 0xdd: case 0xde: case 0xdf:
+			OP(0xc0): OP(0xc1): OP(0xc2): OP(0xc3): // Co-pro
+			OP(0xc4): OP(0xc5): OP(0xc6): OP(0xc7):
+			OP(0xc8): OP(0xc9): OP(0xca): OP(0xcb):
+			OP(0xcc): OP(0xcd): OP(0xce): OP(0xcf):
+			OP(0xd0): OP(0xd1): OP(0xd2): OP(0xd3):
+			OP(0xd4): OP(0xd5): OP(0xd6): OP(0xd7):
+			OP(0xd8): OP(0xd9): OP(0xda): OP(0xdb):
+			OP(0xdc): OP(0xdd): OP(0xde): OP(0xdf):
 #ifdef FPA
 				if ((opcode & 0xf00) == 0x100 || (opcode & 0xf00) == 0x200) {
 					fpaopcode(opcode);
@@ -1808,8 +1884,8 @@ arm_exec(void)
 				arm_exception_undefined();
 				break;
 
-			case 0xe0: case 0xe2: case 0xe4: case 0xe6: // MCR
-			case 0xe8: case 0xea: case 0xec: case 0xee:
+			OP(0xe0): OP(0xe2): OP(0xe4): OP(0xe6): // MCR
+			OP(0xe8): OP(0xea): OP(0xec): OP(0xee):
 #ifdef FPA
 				if ((opcode & 0xf00) == 0x100) {
 					fpaopcode(opcode);
@@ -1823,8 +1899,8 @@ arm_exec(void)
 				}
 				break;
 
-			case 0xe1: case 0xe3: case 0xe5: case 0xe7: // MRC
-			case 0xe9: case 0xeb: case 0xed: case 0xef:
+			OP(0xe1): OP(0xe3): OP(0xe5): OP(0xe7): // MRC
+			OP(0xe9): OP(0xeb): OP(0xed): OP(0xef):
 #ifdef FPA
 				if ((opcode & 0xf00) == 0x100) {
 					fpaopcode(opcode);
@@ -1843,14 +1919,30 @@ arm_exec(void)
 				}
 				break;
 
-			case 0xf0: case 0xf1: case 0xf2: case 0xf3: // SWI
-			case 0xf4: case 0xf5: case 0xf6: case 0xf7:
-			case 0xf8: case 0xf9: case 0xfa: case 0xfb:
-			case 0xfc: case 0xfd: case 0xfe: case 0xff:
+			OP(0xf0): OP(0xf1): OP(0xf2): OP(0xf3): // SWI
+			OP(0xf4): OP(0xf5): OP(0xf6): OP(0xf7):
+			OP(0xf8): OP(0xf9): OP(0xfa): OP(0xfb):
+			OP(0xfc): OP(0xfd): OP(0xfe): OP(0xff):
 				opSWI(opcode);
 				break;
 
-			default:
+			OP(OP_LDRH):
+				arm_ldrh(opcode);
+				break;
+
+			OP(OP_STRH):
+				arm_strh(opcode);
+				break;
+
+			OP(OP_LDRSB):
+				arm_ldrsb(opcode);
+				break;
+
+			OP(OP_LDRSH):
+				arm_ldrsh(opcode);
+				break;
+
+			OP_DEFAULT:
 				if (arm.arch_v4) {
 					arm_exception_undefined();
 				} else {
@@ -1860,9 +1952,6 @@ arm_exec(void)
 			}
 		}
 
-	// This label is used to skip the switch above
-skip:
-
 		if (arm.event != 0) {
 			if (!ARM_MODE_32(arm.mode)) {
 				arm.reg[16] &= ~0xc0u;
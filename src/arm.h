@@ -23,6 +23,15 @@
 
 #include "rpcemu.h"
 
+/* Banks of R8-R14, indexing ARMState.bank_reg */
+#define BANK_USER	0	/* User and System */
+#define BANK_FIQ	1
+#define BANK_IRQ	2
+#define BANK_SUPERVISOR	3
+#define BANK_ABORT	4
+#define BANK_UNDEFINED	5
+#define BANK_COUNT	6
+
 typedef struct {
 	uint32_t	reg[17];
 	uint32_t	mode;
@@ -31,13 +40,9 @@ typedef struct {
 
 	uint32_t	event;
 
-	/* Banked registers */
-	uint32_t	user_reg[15];
-	uint32_t	fiq_reg[15];
-	uint32_t	irq_reg[2];
-	uint32_t	super_reg[2];
-	uint32_t	abort_reg[2];
-	uint32_t	undef_reg[2];
+	/* Banked registers, R8-R14 of each bank, holding those not in reg[]
+	   while another mode is current */
+	uint32_t	bank_reg[BANK_COUNT][7];
 	uint32_t	spsr[16];
 
 	uint32_t	r15_diff;
@@ -58,7 +63,13 @@ extern void generateflagtestandbranch(uint32_t opcode, uint32_t *pcpsr);
 extern void generatecall(OpFn addr, uint32_t opcode, uint32_t *pcpsr);
 extern void generateirqtest(void);
 extern void endblock(uint32_t opcode);
-extern void initcodeblock(uint32_t l);
+extern void initcodeblock(uint32_t l, const uint32_t *code);
+extern void codegen_log_stats(void);
+extern int codegen_fpa_inline(uint32_t opcode);
+extern uint32_t arm_translate_block(uint32_t pc, const uint32_t *code, uint32_t *pcpsr, int *end);
+extern void arm_decode_reset(void);
+extern void arm_decode_clear_page(uint32_t page);
+extern int arm_decode_clear_write(uint32_t addr);
 
 extern uint32_t *usrregs[16];
 extern int cpsr;
@@ -78,8 +89,11 @@ extern ARMState arm;
 
 extern int prog32;
 extern int blockend;
+extern int blockidle;
 extern int linecyc;
 
+#define IDLE_LOOP_MAX 8	/**< Most instructions in a loop the dynarec treats as idle, including its branch */
+
 extern int lastflagchange;
 
 #define RD ((opcode>>12)&0xF)
@@ -91,8 +105,6 @@ extern int lastflagchange;
 #define MULRS ((opcode>>8)&0xF)
 #define MULRM (opcode&0xF)
 
-extern int countbitstable[65536];
-
 #define NFLAG 0x80000000
 #define ZFLAG 0x40000000
 #define CFLAG 0x20000000
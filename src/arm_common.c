@@ -49,6 +49,68 @@
 //#define PowerDownMagic   0x46464F26
 #define SWI_OS_ServiceCall	0x30
 #define Service_ShutdownComplete 128
+
+/**
+ * Bank of R8-R14 used by each mode, indexed by the bottom four bits of the
+ * mode, or -1 if there is no such mode.
+ */
+static const int8_t mode_bank[16] = {
+	BANK_USER, BANK_FIQ, BANK_IRQ, BANK_SUPERVISOR,
+	-1, -1, -1, BANK_ABORT,
+	-1, -1, -1, BANK_UNDEFINED,
+	-1, -1, -1, BANK_USER
+};
+
+/**
+ * First register of each bank that is not shared with User mode.
+ */
+static const uint8_t bank_first[BANK_COUNT] = {
+	15, 8, 13, 13, 13, 13
+};
+
+/**
+ * Swap the banked registers of one mode for those of another. Only the
+ * registers that differ between the two banks are copied, so most switches
+ * copy just R13 and R14, and switches between modes sharing a bank (such as
+ * the 26 and 32-bit versions of a mode) copy nothing.
+ *
+ * @param old_mode Mode being left
+ * @param new_mode Mode being entered
+ */
+void
+arm_switch_bank(uint32_t old_mode, uint32_t new_mode)
+{
+	const int ob = mode_bank[old_mode & 0xf];
+	const int nb = mode_bank[new_mode & 0xf];
+	int first, c;
+
+	if (nb < 0) {
+		fatal("Bad mode %i\n", new_mode);
+	}
+	if (nb == ob) {
+		return;
+	}
+
+	first = bank_first[ob] < bank_first[nb] ? bank_first[ob] : bank_first[nb];
+
+	/* Store back the old mode's registers, including any shared with
+	   User mode that the new mode banks */
+	for (c = first; c < 15; c++) {
+		arm.bank_reg[c < bank_first[ob] ? BANK_USER : ob][c - 8] = arm.reg[c];
+	}
+	for (c = first; c < 15; c++) {
+		arm.reg[c] = arm.bank_reg[c < bank_first[nb] ? BANK_USER : nb][c - 8];
+	}
+
+	/* User mode registers, for LDM/STM with the S bit */
+	for (c = 0; c < 16; c++) {
+		if (c < bank_first[nb] || c == 15) {
+			usrregs[c] = &arm.reg[c];
+		} else {
+			usrregs[c] = &arm.bank_reg[BANK_USER][c - 8];
+		}
+	}
+}
 /**
  * Perform a Store Halfword.
  *
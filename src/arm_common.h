@@ -31,6 +31,7 @@ extern void arm_store_multiple_s(uint32_t opcode, uint32_t address, uint32_t wri
 extern void arm_load_multiple(uint32_t opcode, uint32_t address, uint32_t writeback);
 extern void arm_load_multiple_s(uint32_t opcode, uint32_t address, uint32_t writeback);
 extern int opSWI(uint32_t opcode);
+extern void arm_switch_bank(uint32_t old_mode, uint32_t new_mode);
 
 #define refillpipeline() blockend=1;
 
@@ -492,7 +493,17 @@ arm_ldr_rotate(uint32_t value, uint32_t addr)
 static inline uint32_t
 arm_ldm_stm_offset(uint32_t opcode)
 {
-	return (uint32_t) countbitstable[opcode & 0xffff];
+#if defined __GNUC__
+	/* POPCNT where the build targets it */
+	return (uint32_t) __builtin_popcount(opcode & 0xffff) * 4;
+#else
+	uint32_t v = opcode & 0xffff;
+
+	v = v - ((v >> 1) & 0x5555);
+	v = (v & 0x3333) + ((v >> 2) & 0x3333);
+	v = (v + (v >> 4)) & 0x0f0f;
+	return ((v + (v >> 8)) & 0x1f) * 4;
+#endif
 }
 
 #endif
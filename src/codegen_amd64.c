@@ -24,9 +24,20 @@
   r12 contains R15*/
 
 #include <assert.h>
+#include <cpuid.h>
+#include <inttypes.h>
+#include <pthread.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <string.h>
+#include <time.h>
+
+#if defined __linux__
+#	include <unistd.h>
+#	include <sys/mman.h>
+#	include <sys/syscall.h>
+#endif
 
 #include "rpcemu.h"
 #include "arm.h"
@@ -36,26 +47,191 @@
 
 int lastflagchange;
 
-uint8_t rcodeblock[BLOCKS][1792] __attribute__ ((aligned (4096)));
-static const void *codeblockaddr[BLOCKS];
-uint32_t codeblockpc[0x8000];
-int codeblocknum[0x8000];
-static uint8_t codeblockpresent[0x10000];
+/*
+ * Generated code lives in a bump-allocated arena. It is a static array rather
+ * than a heap allocation so that the code stays within RIP-relative range of
+ * the emulator's globals. When the arena or the block table is full, all
+ * blocks are discarded and allocation starts again from the beginning.
+ */
+static uint8_t rcodearena[CODE_ARENA_MAX_MB << 20] __attribute__ ((aligned (4096)));
+static size_t codearena_size;	/**< Usable size of arena, from config */
+static size_t codearena_pos;	/**< Offset of next free byte in arena */
+static size_t codearena_highwater;
+uint8_t *rcodeblock[BLOCKS];	/**< Start of each block's code within arena */
+uint32_t codeblockpc[CODEBLOCK_SETS * CODEBLOCK_WAYS];
+int codeblocknum[CODEBLOCK_SETS * CODEBLOCK_WAYS];
+static uint8_t codeblockspans[0x10000];		/**< Pages with blocks that continue into the next page */
+static uint8_t block_spans[BLOCKS];		/**< Whether each block continues into the next page */
+
+/*
+ * Writes to code are found by keeping pages with code out of the write TLB,
+ * so that every write to them goes through vwadd() and cacheclearwrite().
+ * Only writes to a 256-byte region with code discard blocks, and then only
+ * the blocks with code in that region, found through a list of the blocks
+ * starting in each page.
+ */
+#define CODE_REGION_SHIFT 8
+
+static uint16_t codeblockpresent[0x10000];	/**< Regions of each page that may contain code of a block */
+static int page_blocks[0x10000];		/**< First block starting in each page, or -1 */
+static int block_page_next[BLOCKS];		/**< Next block starting in the same page, or -1 */
+static int block_page_prev[BLOCKS];		/**< Previous block starting in the same page, or -1 */
+static uint32_t blocks_end[BLOCKS];		/**< ARM address of the last instruction of each block */
+static uint64_t smc_writes;			/**< Writes to pages with code */
+static uint64_t smc_invalidations;		/**< Writes that discarded blocks */
+static uint64_t smc_blocks;			/**< Blocks discarded by writes */
 
 //#define BLOCKS 4096
 //#define HASH(l) ((l>>3)&0x3fff)
 
-static int blocknum;//,blockcount;
 static int tempinscount;
 
 static int codeblockpos;
 static int lastjumppos;
 
-static int blockpoint, blockpoint2;
-static uint32_t blocks[BLOCKS];
-static int pcinc;
+static int blockpoint;		/**< Number of blocks allocated since last flush */
+static int blockpoint2;		/**< Block currently being generated */
+static uint32_t block_startpc;	/**< ARM address of block currently being generated */
+static uint32_t block_pc;	/**< ARM address of the instruction being generated */
+static uint32_t blocks[BLOCKS];	/**< ARM address of each block, or 0xffffffff if discarded */
+static const uint32_t *block_code[BLOCKS];	/**< Pointer each block fetched its instructions from */
+static int pcinc;		/**< Bytes the ARM PC has advanced since %r12d was last caught up, including the instruction being generated */
 static int lastrecompiled;
 static int block_enter;
+static uint32_t block_lastpc;
+static int codecache_flushes;
+static uint64_t codecache_evictions;
+static uint64_t codecache_conflicts;	/**< Blocks evicted from a full set */
+
+static int host_bmi2;		/**< Host has the BMI2 shifts, found once by initcodeblocks() */
+static uint64_t reg_shifts;	/**< Register-specified shifts generated */
+
+uint64_t codecache_hits;	/**< Blocks found by arm_exec() */
+uint64_t codecache_misses;	/**< Blocks not found by arm_exec(), and so generated */
+
+#define BLOCK_LINKS	5	/**< Maximum number of direct successors per block, including a return */
+#define BLOCK_SIDE_EXITS (BLOCK_LINKS - 3)	/**< Taken conditional branches leaving a block early */
+#define LINK_HASH_SIZE	256
+#define LINK_HASH(pc)	(((pc) >> 2) & (LINK_HASH_SIZE - 1))
+
+/**
+ * A patchable JE at an exit of a block that leads directly to the block of a
+ * statically known successor. While unlinked the displacement is zero, so
+ * execution falls through to the codeblockpc[] lookup, or for a side exit to
+ * the epilogue. The return link of a block ending with BL has no jump; it
+ * only tracks the block to predict for the matching return.
+ */
+typedef struct {
+	uint32_t target;	/**< ARM address of successor, or 0xffffffff if unused */
+	int pos;		/**< Offset of the rel32 displacement within the block, or -1 if none */
+	int linked;		/**< Block the jump leads to, or -1 if unlinked */
+	int prev, next;		/**< Neighbours in the incoming or pending list */
+} BlockLink;
+
+static BlockLink blocklinks[BLOCKS * BLOCK_LINKS];
+static int link_incoming[BLOCKS];		/**< Links leading to each block */
+static int link_pending[LINK_HASH_SIZE];	/**< Unlinked links, by target address */
+static int block_links;				/**< Links used so far by the block being generated */
+static int block_return_link;			/**< Return link of the block being generated, or -1 */
+
+/*
+ * Return address prediction. Each BL pushes its return address, with the
+ * block found there by its return link, and a function return that matches
+ * the top entry jumps straight to that block, provided it is still the block
+ * for that address. Anything else falls back to the codeblockpc[] lookup.
+ */
+#define RETURN_STACK_SIZE 16
+
+typedef struct {
+	uint32_t pc;		/**< ARM address to return to */
+	int32_t block;		/**< Block predicted for it, or -1 */
+} ReturnPrediction;
+
+static ReturnPrediction return_stack[RETURN_STACK_SIZE];
+static uint32_t return_top;		/**< Index of the most recent entry */
+static uint64_t return_predicted, return_mispredicted;
+
+static uint64_t idle_loops;		/**< Blocks generated as idle loops */
+
+#define BLOCK_PC_EXITS	(BLOCK_MAX_SIZE / 6)	/**< Exits needing R15 rebuilt; each is a 6 byte jump so this cannot overflow */
+#define PC_EXIT_STUB_SIZE 9	/**< Size of the code each distinct lag adds to the end of a block */
+
+/*
+ * Side table of the exits from the middle of an instruction, for an abort or
+ * interrupt, taken while %r12d lags behind R15. Each is a long jump which
+ * endblock() resolves to a stub that adds the lag back before leaving through
+ * the epilogue, shared by every exit with the same lag.
+ */
+static int pc_exit_pos[BLOCK_PC_EXITS];	/**< Position of the displacement of each jump */
+static int8_t pc_exit_lag[BLOCK_PC_EXITS];	/**< Bytes %r12d lags behind R15 at each jump */
+static int pc_exits;			/**< Number of entries in the side table */
+static uint32_t pc_exit_lags;		/**< Bitmap of distinct lags, by (lag + 4) / 4 */
+static int pc_exit_stubs;		/**< Number of distinct lags */
+
+/*
+ * Blocks are first generated cold, with no register allocation, flag
+ * elimination or constant propagation, and count down how many more times
+ * they may run. Once the count goes negative the block is hot, and is
+ * generated again with full optimisation. Tier statistics are indexed by
+ * block_hot.
+ */
+int32_t codeblockheat[BLOCKS];		/**< Runs left before each cold block is hot */
+static int block_hot;			/**< Whether the block being generated is fully optimised */
+static uint64_t tier_blocks[2];		/**< Blocks generated in each tier */
+static uint64_t tier_inscount[2];	/**< ARM instructions executed in each tier */
+static clock_t tier_time[2];		/**< Processor time spent generating each tier */
+static clock_t block_time;		/**< When generation of the current block started */
+
+/*
+ * Registers known to hold a constant at the instruction being generated,
+ * in hot blocks. An instruction that computes a constant leaves it in
+ * const_rd until its writes have been accounted for.
+ */
+static uint32_t const_valid;		/**< Bitmask of registers with known values */
+static uint32_t const_val[16];		/**< Known value of each register */
+static int const_rd;			/**< Register set to a constant by this instruction, or -1 */
+static uint32_t const_rd_val;
+
+/*
+ * With config.dynarec_compile_thread, hot blocks are generated on a separate
+ * thread while the emulator thread keeps running the cold version. The
+ * compile thread only writes the code and links of a block it allocated
+ * itself; the emulator thread publishes it into codeblockpc[] and links it
+ * once the cold block next runs out of runs. Generation itself is serialised
+ * by codegen_mutex, as the generator's state is shared.
+ */
+#define COMPILE_QUEUE_SIZE 64
+
+typedef enum {
+	COMPILE_FREE,
+	COMPILE_QUEUED,		/**< Waiting for the compile thread */
+	COMPILE_BUSY,		/**< Being generated */
+	COMPILE_DONE		/**< Generated, waiting to be published */
+} CompileState;
+
+typedef struct {
+	CompileState state;
+	uint32_t pc;		/**< ARM address of start of block */
+	const uint32_t *code;	/**< Pointer to fetch instructions from, indexed by address >> 2 */
+	uint32_t *pcpsr;	/**< Pointer to the flags when the block was queued */
+	uint32_t epoch;		/**< codepage_epoch[] of the block's page when queued */
+	unsigned generation;	/**< codecache_generation when generated */
+	int block;		/**< Block generated, or -1 if there was no space */
+} CompileRequest;
+
+static CompileRequest compile_queue[COMPILE_QUEUE_SIZE];
+static pthread_mutex_t compile_queue_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t compile_queue_cond = PTHREAD_COND_INITIALIZER;
+static pthread_mutex_t codegen_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t compile_thread;
+static int compile_thread_started;
+static int codegen_lock_depth;		/**< Nesting of codegen_lock() on the emulator thread */
+static int block_background;		/**< Whether the block being generated is for the compile thread */
+static int background_end;		/**< Ends a block generated for the compile thread */
+static int *block_end = &blockend;	/**< Flag that ends the block being generated */
+static unsigned codecache_generation;	/**< Number of times the code cache has been flushed */
+static uint32_t codepage_epoch[0x10000];	/**< Number of times blocks were discarded from each page */
+static uint64_t compile_queued, compile_published, compile_dropped;
 
 static inline void
 addbyte(uint32_t a)
@@ -170,160 +346,1568 @@ gen_x86_mov_stack_reg32(int x86reg, int offset)
 	}
 }
 
-void
-initcodeblocks(void)
+/*
+ * Up to PINNED_MAX of the ARM registers used most by a block are kept in host
+ * registers for the whole of the block. They are loaded on entry to the block,
+ * and written back to arm.reg[] on exit from the block and around calls to C
+ * functions, which may read or modify any ARM register.
+ */
+#define PINNED_MAX	4
+
+static const int pinned_hostregs[PINNED_MAX] = { R8, R9, R10, R11 };
+static int reg_pinned[16];	/**< Host register holding each ARM register, or -1 */
+static uint32_t pinned_dirty;	/**< Bitmask of pinned ARM registers modified in block */
+static uint32_t block_writes;	/**< Bitmask of ARM registers the pre-scan expects the block to modify */
+static int block_body;		/**< Offset of the code following the loading of pinned registers */
+
+#define BLOCK_SCAN_MAX	256	/**< Maximum number of instructions examined before generating a block */
+
+/*
+ * NZCV flags that may still be read after each instruction of the block being
+ * generated. Flag-setting instructions only store the flags that are live, so
+ * flags that are always overwritten before being read are never computed.
+ */
+static int block_len;				/**< Number of instructions found by block_scan() */
+static uint32_t block_flags_live[BLOCK_SCAN_MAX];	/**< Flags live after each instruction */
+static uint32_t flags_lahf[256];		/**< Maps x86 flags from LAHF to ARM N, Z and C */
+
+static const int canrecompile[256] = {
+	1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1, // 00
+	1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1, // 10
+	1,1,1,1,1,1,0,0,1,1,0,0,0,0,0,0, // 20
+	0,1,0,1,0,1,0,1,1,1,1,1,1,1,1,1, // 30
+
+	1,1,0,0,1,1,0,0,1,1,0,0,1,1,0,0, // 40
+	1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1, // 50
+	1,1,0,0,1,1,0,0,1,1,0,0,1,1,0,0, // 60
+	1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1, // 70
+
+	1,1,1,1,0,0,0,0,1,1,1,1,0,0,0,0, // 80
+	1,1,1,1,0,0,0,0,1,1,1,1,0,0,0,0, // 90
+	1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1, // a0
+	1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1, // b0
+
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, // c0
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, // d0
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, // e0
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, // f0
+};
+
+#define FD	((opcode >> 12) & 7)	/**< FPA destination register */
+#define FN	((opcode >> 16) & 7)	/**< FPA first operand register */
+
+/**
+ * Check whether an FPA instruction is generated as native code. These are
+ * the only coprocessor instructions that do not end a block. The extended
+ * precision transfers, LFM/SFM, the status register transfers and the
+ * transcendental operations are left to fpaopcode().
+ *
+ * @param opcode Opcode of coprocessor instruction
+ * @return Non-zero if the instruction is generated as native code
+ */
+int
+codegen_fpa_inline(uint32_t opcode)
+{
+#ifdef FPA
+	if ((opcode & 0x0e000f00) == 0x0c000100) {
+		// LDF/STF single or double
+		return !(opcode & 0x400000) && !(RN == 15 && (opcode & 0x200000));
+	}
+	if ((opcode & 0x0f000f10) == 0x0e000100) {
+		// Data operation
+		switch (opcode & 0xf08000) {
+		case 0x000000: case 0x100000: case 0x200000: // ADF, MUF, SUF
+		case 0x300000: case 0x400000: case 0x900000: // RSF, DVF, FML
+		case 0xa00000: case 0x008000: case 0x108000: // FDV, MVF, MNF
+		case 0x208000: case 0x408000: // ABS, SQT
+			return 1;
+		}
+		return 0;
+	}
+	if ((opcode & 0x0f000f10) == 0x0e000110) {
+		if (RD == 15) {
+			// CMF, CNF, CMFE, CNFE
+			return (opcode & 0x100000) && ((opcode >> 21) & 7) >= 4;
+		}
+		// FLT, FIX
+		return ((opcode >> 20) & 0xf) <= 1;
+	}
+#else
+	NOT_USED(opcode);
+#endif
+	return 0;
+}
+
+/**
+ * Check whether an instruction may be generated as native code, rather than
+ * always calling its C function.
+ *
+ * @param opcode Opcode of instruction
+ * @return Non-zero if recompile() may be able to generate the instruction
+ */
+static int
+can_recompile(uint32_t opcode)
+{
+	return canrecompile[(opcode >> 20) & 0xff] ||
+	       ((opcode & 0x0c000000) == 0x0c000000 && codegen_fpa_inline(opcode));
+}
+
+/**
+ * Count how often an instruction uses each ARM register, and note which
+ * registers it may modify.
+ *
+ * @param opcode Opcode of instruction
+ * @param uses   Array of counts per ARM register
+ * @param writes Bitmask of ARM registers that may be modified
+ */
+static void
+count_reg_uses(uint32_t opcode, int *uses, uint32_t *writes)
 {
 	int c;
 
-	// Clear all blocks
-	memset(codeblockpc, 0xff, sizeof(codeblockpc));
-	memset(blocks, 0xff, sizeof(blocks));
-	for (c = 0; c < BLOCKS; c++) {
-		codeblockaddr[c] = &rcodeblock[c][0];
+	switch ((opcode >> 25) & 7) {
+	case 0: // Data processing register, multiply, swap
+		if ((opcode & 0x0f0000f0) == 0x00000090) {
+			// MUL, MLA, UMULL etc.
+			uses[MULRD]++;
+			uses[MULRN]++;
+			uses[MULRS]++;
+			uses[MULRM]++;
+			*writes |= (1u << MULRD) | (1u << MULRN);
+			break;
+		}
+		if ((opcode & 0x0fb00ff0) == 0x01000090) {
+			// SWP, SWPB
+			uses[RN]++;
+			uses[RM]++;
+			uses[RD]++;
+			*writes |= 1u << RD;
+			break;
+		}
+		if ((opcode & 0x0e000090) == 0x00000090) {
+			// LDRH, STRH, LDRSB, LDRSH
+			uses[RN]++;
+			uses[RD]++;
+			if (!(opcode & 0x400000)) {
+				uses[RM]++;
+			}
+			*writes |= (1u << RN) | (1u << RD);
+			break;
+		}
+		uses[RM]++;
+		if ((opcode & 0x90) == 0x10) {
+			// Register shift
+			uses[MULRS]++;
+		}
+		// Fall through
+	case 1: // Data processing immediate
+		if (((opcode >> 21) & 0xd) != 0xd) {
+			// Not MOV or MVN
+			uses[RN]++;
+		}
+		if (((opcode >> 21) & 0xc) != 0x8) {
+			// Not TST, TEQ, CMP or CMN
+			uses[RD]++;
+			*writes |= 1u << RD;
+		}
+		break;
+	case 2: // LDR/STR immediate
+	case 3: // LDR/STR register
+		uses[RN]++;
+		uses[RD]++;
+		if (opcode & 0x2000000) {
+			uses[RM]++;
+		}
+		*writes |= (1u << RN) | (1u << RD);
+		break;
+	case 4: // LDM/STM
+		uses[RN]++;
+		for (c = 0; c < 16; c++) {
+			if (opcode & (1u << c)) {
+				uses[c]++;
+			}
+		}
+		*writes |= (1u << RN) | (opcode & 0xffff);
+		break;
+	case 5: // B, BL
+		if (opcode & 0x1000000) {
+			uses[14]++;
+			*writes |= 1u << 14;
+		}
+		break;
+	case 6: // LDC/STC
+		uses[RN]++;
+		*writes |= 1u << RN;
+		break;
+	case 7: // CDP, MRC/MCR, SWI
+		if ((opcode & 0x01000010) == 0x00000010) {
+			// MRC/MCR
+			uses[RD]++;
+			*writes |= 1u << RD;
+		}
+		break;
 	}
-	blockpoint = 0;
+}
 
-	// Set memory pages containing rcodeblock[]s executable -
-	// necessary when NX/XD feature is active on CPU(s)
-	set_memory_executable(rcodeblock, sizeof(rcodeblock));
+/**
+ * Find how many instructions are expected to form a block, by applying the
+ * same conditions as used to end blocks in arm_exec(). A conditional branch
+ * may be followed by more of the block, if it was not taken when the block
+ * was generated. Only the first page is examined.
+ *
+ * @param l    ARM address of start of block
+ * @param code Pointer to fetch instructions from, indexed by address >> 2
+ * @return Number of instructions, at most BLOCK_SCAN_MAX
+ */
+static int
+block_scan(uint32_t l, const uint32_t *code)
+{
+	uint32_t pc = l;
+	int n = 0;
+
+	while (n < BLOCK_SCAN_MAX) {
+		const uint32_t opcode = code[pc >> 2];
+
+		n++;
+		if ((opcode >> 28) != 0xf) {
+			if (((opcode & 0x0e000000) == 0x0a000000 && (opcode >> 28) == 0xe) ||
+			    ((opcode & 0x0c000000) == 0x0c000000 && !codegen_fpa_inline(opcode)) ||
+			    (!(opcode & 0x0c000000) && RD == 15) ||
+			    (opcode & 0x0e108000) == 0x08108000 ||
+			    ((opcode & 0x0c100000) == 0x04100000 && RD == 15))
+			{
+				break;
+			}
+		}
+		pc += 4;
+		if ((pc & 0xffc) == 0) {
+			break;
+		}
+	}
+	return n;
 }
 
-void
-resetcodeblocks(void)
+/**
+ * Choose which ARM registers to keep in host registers for a block. A
+ * register is only chosen if it is used often enough to outweigh the cost of
+ * loading it on entry and writing it back around each call to a C function.
+ *
+ * @param l    ARM address of start of block
+ * @param code Pointer to fetch instructions from, indexed by address >> 2
+ * @param len  Number of instructions in block
+ */
+static void
+block_alloc_regs(uint32_t l, const uint32_t *code, int len)
 {
-	int c;
+	int uses[16];
+	int calls = 0;
+	int c, n;
+
+	memset(uses, 0, sizeof(uses));
+	block_writes = 0;
+	for (n = 0; n < len; n++) {
+		const uint32_t opcode = code[(l >> 2) + n];
+
+		if ((opcode >> 28) != 0xf) {
+			if (can_recompile(opcode)) {
+				count_reg_uses(opcode, uses, &block_writes);
+			} else {
+				calls++;
+			}
+		}
+	}
 
-	blockpoint = 0;
+	for (c = 0; c < 16; c++) {
+		reg_pinned[c] = -1;
+	}
+	pinned_dirty = 0;
+	for (n = 0; n < PINNED_MAX; n++) {
+		int best = -1;
+
+		for (c = 0; c < 15; c++) {
+			if (reg_pinned[c] < 0 && uses[c] > 2 + 2 * calls &&
+			    (best < 0 || uses[c] > uses[best]))
+			{
+				best = c;
+			}
+		}
+		if (best < 0) {
+			break;
+		}
+		reg_pinned[best] = pinned_hostregs[n];
+	}
+}
 
-	for (c = 0; c < BLOCKS; c++) {
-		if (blocks[c] != 0xffffffff) {
-			codeblockpc[blocks[c] & 0x7fff] = 0xffffffff;
-			codeblocknum[blocks[c] & 0x7fff] = 0xffffffff;
-			blocks[c] = 0xffffffff;
+/**
+ * Work out which of the NZCV flags an instruction may read, including by
+ * its condition code. Anything not known to leave the flags alone (including
+ * use of R15, which holds the flags in 26-bit modes) is assumed to read all
+ * of them.
+ *
+ * @param opcode Opcode of instruction
+ * @return Bitmask of flags read
+ */
+static uint32_t
+flags_read(uint32_t opcode)
+{
+	static const uint32_t cond_reads[16] = {
+		ZFLAG, ZFLAG, CFLAG, CFLAG, NFLAG, NFLAG, VFLAG, VFLAG,
+		CFLAG | ZFLAG, CFLAG | ZFLAG, NFLAG | VFLAG, NFLAG | VFLAG,
+		NFLAG | ZFLAG | VFLAG, NFLAG | ZFLAG | VFLAG, 0, 0
+	};
+	const uint32_t all = NFLAG | ZFLAG | CFLAG | VFLAG;
+	uint32_t reads = cond_reads[opcode >> 28];
+
+	switch ((opcode >> 25) & 7) {
+	case 0: // Data processing register, multiply, swap, etc.
+		if ((opcode & 0x90) == 0x90) {
+			// Multiply without S flag does not involve flags
+			if ((opcode & 0x0fd000f0) == 0x00000090 ||
+			    (opcode & 0x0f9000f0) == 0x00800090)
+			{
+				if (MULRD == 15 || MULRN == 15 || MULRS == 15 || MULRM == 15) {
+					return all;
+				}
+				return reads;
+			}
+			return all;
+		}
+		if (RM == 15 || ((opcode & 0x10) && MULRS == 15)) {
+			return all;
+		}
+		if ((opcode & 0xff0) == 0x060) {
+			// RRX
+			reads |= CFLAG;
+		}
+		// Fall through
+	case 1: // Data processing immediate
+		if ((opcode & 0x01900000) == 0x01000000) {
+			// MRS, MSR and unallocated
+			return all;
+		}
+		if (RN == 15 || RD == 15) {
+			return all;
+		}
+		if (((opcode >> 21) & 0xf) >= 5 && ((opcode >> 21) & 0xf) <= 7) {
+			// ADC, SBC, RSC
+			reads |= CFLAG;
+		}
+		return reads;
+
+	case 3: // LDR/STR register
+		if ((opcode & 0x10) || RM == 15) {
+			return all;
+		}
+		if ((opcode & 0xff0) == 0x060) {
+			// RRX
+			reads |= CFLAG;
+		}
+		// Fall through
+	case 2: // LDR/STR immediate
+		if (RN == 15 || RD == 15) {
+			return all;
+		}
+		return reads;
+
+	case 4: // LDM/STM
+		if ((opcode & 0x8000) || RN == 15) {
+			return all;
+		}
+		return reads;
+
+	case 6: // LDC/STC
+	case 7: // CDP, MRC/MCR, SWI
+		if (codegen_fpa_inline(opcode)) {
+			return reads;
 		}
+		return all;
 	}
+	return all;
 }
 
-void
-cacheclearpage(uint32_t a)
+/**
+ * Work out which of the NZCV flags an instruction always overwrites.
+ *
+ * @param opcode Opcode of instruction
+ * @return Bitmask of flags written
+ */
+static uint32_t
+flags_written(uint32_t opcode)
+{
+	if ((opcode >> 28) == 0xe && (opcode & 0x0f00f000) == 0x0e00f000 &&
+	    codegen_fpa_inline(opcode))
+	{
+		// CMF, CNF
+		return NFLAG | ZFLAG | CFLAG | VFLAG;
+	}
+	if ((opcode >> 28) != 0xe || (opcode & 0x0c100000) != 0x00100000 || RD == 15) {
+		// Not an unconditional data processing instruction setting flags
+		return 0;
+	}
+	if ((opcode & 0x02000090) == 0x90) {
+		// Multiply, etc.
+		return 0;
+	}
+	switch ((opcode >> 21) & 0xf) {
+	case 0x2: case 0x3: case 0x4: case 0x5: // SUB, RSB, ADD, ADC
+	case 0x6: case 0x7: case 0xa: case 0xb: // SBC, RSC, CMP, CMN
+		return NFLAG | ZFLAG | CFLAG | VFLAG;
+	}
+	// Logical operations only set C if the shifter produces a carry
+	if (opcode & 0x2000000) {
+		return (opcode & 0xf00) ? (NFLAG | ZFLAG | CFLAG) : (NFLAG | ZFLAG);
+	}
+	if ((opcode & 0x10) || (opcode & 0xff0) == 0) {
+		return NFLAG | ZFLAG;
+	}
+	return NFLAG | ZFLAG | CFLAG;
+}
+
+/**
+ * Work out which flags are live after each instruction of a block, by
+ * working backwards from the end of the block, where all are live.
+ *
+ * @param l    ARM address of start of block
+ * @param code Pointer to fetch instructions from, indexed by address >> 2
+ * @param len  Number of instructions in block
+ */
+static void
+block_flags_liveness(uint32_t l, const uint32_t *code, int len)
 {
-	int c, d;
+	uint32_t live = NFLAG | ZFLAG | CFLAG | VFLAG;
+	int n;
 
-	if (!codeblockpresent[a & 0xffff]) {
-		return;
+	for (n = len - 1; n >= 0; n--) {
+		const uint32_t opcode = code[(l >> 2) + n];
+
+		block_flags_live[n] = live;
+		if ((opcode >> 28) != 0xf) {
+			live = (live & ~flags_written(opcode)) | flags_read(opcode);
+		}
 	}
-	codeblockpresent[a & 0xffff] = 0;
-	// a >>= 10;
-	d = HASH(a << 12);
-	for (c = 0; c < 0x400; c++) {
-		if ((codeblockpc[c + d] >> 12) == a) {
-			codeblockpc[c + d] = 0xffffffff;
+}
+
+/**
+ * Get the flags that are live after the instruction being generated.
+ *
+ * @return Bitmask of live flags
+ */
+static uint32_t
+flags_live_after(void)
+{
+	const uint32_t n = (block_pc - block_startpc) >> 2;
+
+	if (n >= (uint32_t) block_len) {
+		return NFLAG | ZFLAG | CFLAG | VFLAG;
+	}
+	return block_flags_live[n];
+}
+
+/**
+ * Generate code to write pinned ARM registers back to arm.reg[].
+ *
+ * @param mask Bitmask of ARM registers to write back, if pinned
+ */
+static void
+gen_writeback_regs(uint32_t mask)
+{
+	int c;
+
+	for (c = 0; c < 15; c++) {
+		if (reg_pinned[c] >= 0 && (mask & (1u << c))) {
+			addbyte(0x45); addbyte(0x89); addbyte(0x47 | ((reg_pinned[c] & 7) << 3)); addbyte(c<<2); // MOV %{host},R{c}
 		}
 	}
 }
 
-void
-initcodeblock(uint32_t l)
+/**
+ * Generate code to load all pinned ARM registers from arm.reg[].
+ */
+static void
+gen_reload_regs(void)
 {
-	codeblockpresent[(l >> 12) & 0xffff] = 1;
-	tempinscount = 0;
-	// rpclog("Initcodeblock %08x\n", l);
-	blockpoint++;
-	blockpoint &= (BLOCKS - 1);
-	if (blocks[blockpoint] != 0xffffffff) {
-		// rpclog("Chucking out block %08x %d %03x\n", blocks[blockpoint], blocks[blockpoint] >> 24, blocks[blockpoint] & 0xfff);
-		codeblockpc[blocks[blockpoint] & 0x7fff] = 0xffffffff;
-		codeblocknum[blocks[blockpoint] & 0x7fff] = 0xffffffff;
-	}
-	blocknum = HASH(l);
-//        blockcount=0;//codeblockcount[blocknum];
-//        codeblockcount[blocknum]++;
-//        if (codeblockcount[blocknum]==3) codeblockcount[blocknum]=0;
-	codeblockpos = 0;
-	codeblockpc[blocknum] = l;
-	codeblocknum[blocknum] = blockpoint;
-	blocks[blockpoint] = blocknum;
-	blockpoint2 = blockpoint;
+	int c;
 
-	// Block Epilogue
-	addbyte(0x45); addbyte(0x89); addbyte(0x67); addbyte(15<<2); // MOV %r12d,R15
-	addbyte(0x48); addbyte(0x83); addbyte(0xc4); addbyte(8); // ADD $8,%rsp
-	// Restore registers
-	gen_x86_pop_reg(RBX);
-	gen_x86_pop_reg(R12);
-	gen_x86_pop_reg(R13);
-	gen_x86_pop_reg(R14);
-	gen_x86_pop_reg(R15);
-	gen_x86_leave();
-	gen_x86_ret();
+	for (c = 0; c < 15; c++) {
+		if (reg_pinned[c] >= 0) {
+			addbyte(0x45); addbyte(0x8b); addbyte(0x47 | ((reg_pinned[c] & 7) << 3)); addbyte(c<<2); // MOV R{c},%{host}
+		}
+	}
+}
 
-	// Block Prologue
-	assert(codeblockpos <= BLOCKSTART);
-	codeblockpos = BLOCKSTART;
-	// Set up a stack frame and preserve registers that are callee-saved
-	gen_x86_push_reg(RBP);
-	addbyte(0x48); addbyte(0x89); addbyte(0xe5); // MOV %rsp,%rbp
-	gen_x86_push_reg(R15);
-	gen_x86_push_reg(R14);
-	gen_x86_push_reg(R13);
-	gen_x86_push_reg(R12);
-	gen_x86_push_reg(RBX);
-	// Align stack to a multiple of 16 bytes - required by AMD64 ABI
-	addbyte(0x48); addbyte(0x83); addbyte(0xec); addbyte(8); // SUB $8,%rsp
+/**
+ * Generate a call to a C function, which sees and may modify the ARM
+ * registers in arm.reg[].
+ *
+ * @param addr Function to call
+ */
+static void
+gen_helper_call(const void *addr)
+{
+	// When the block loops back to itself, registers modified later in
+	// the block may also hold new values
+	gen_writeback_regs(pinned_dirty | block_writes);
+	gen_x86_call(addr);
+	gen_reload_regs();
+}
 
-	addbyte(0x49); addbyte(0xbf); addptr64(&arm); // MOVABS $(&arm),%r15
-	addbyte(0x49); addbyte(0xbe); addptr64(&vwaddrl[0]); // MOVABS $vwaddrl,%r14
-	addbyte(0x49); addbyte(0xbd); addptr64(&vraddrl[0]); // MOVABS $vraddrl,%r13
+static int *
+link_list_head(const BlockLink *link)
+{
+	if (link->linked >= 0) {
+		return &link_incoming[link->linked];
+	}
+	return &link_pending[LINK_HASH(link->target)];
+}
+
+static void
+link_list_add(int id)
+{
+	int *head = link_list_head(&blocklinks[id]);
+
+	blocklinks[id].prev = -1;
+	blocklinks[id].next = *head;
+	if (*head >= 0) {
+		blocklinks[*head].prev = id;
+	}
+	*head = id;
+}
+
+static void
+link_list_remove(int id)
+{
+	BlockLink *link = &blocklinks[id];
+
+	if (link->prev >= 0) {
+		blocklinks[link->prev].next = link->next;
+	} else {
+		*link_list_head(link) = link->next;
+	}
+	if (link->next >= 0) {
+		blocklinks[link->next].prev = link->prev;
+	}
+}
+
+/**
+ * Point the jump of a link at the entry of another block, or back at the
+ * following instruction if dest is -1.
+ *
+ * @param id   Link to patch
+ * @param dest Block to jump to, or -1
+ */
+static void
+link_patch(int id, int dest)
+{
+	if (blocklinks[id].pos >= 0) {
+		uint8_t *p = &rcodeblock[id / BLOCK_LINKS][blocklinks[id].pos];
+		uint32_t rel = 0;
+
+		if (dest >= 0) {
+			rel = (uint32_t) (&rcodeblock[dest][block_enter] - (p + 4));
+		}
+		memcpy(p, &rel, sizeof(uint32_t));
+	}
+	blocklinks[id].linked = dest;
+}
+
+/**
+ * Unlink every jump leading into a block, so it can be discarded or reused.
+ * The links become pending until a block for their target is generated again.
+ *
+ * @param b Block number
+ */
+static void
+block_unlink_incoming(int b)
+{
+	while (link_incoming[b] >= 0) {
+		const int id = link_incoming[b];
+
+		link_list_remove(id);
+		link_patch(id, -1);
+		link_list_add(id);
+	}
+}
+
+/**
+ * Note that a block has code in the region of a page containing an ARM
+ * address, and take the page out of the write TLB so that writes to it are
+ * checked.
+ *
+ * @param addr ARM address
+ */
+static void
+code_mark(uint32_t addr)
+{
+	const uint16_t bit = 1u << ((addr >> CODE_REGION_SHIFT) & 0xf);
+
+	codeblockpresent[(addr >> 12) & 0xffff] |= bit;
+	/* codeblockpresent[] is shared by pages 256MB apart, so the bit may
+	   already be set by another page */
+	vwaddrl[addr >> 12] = 0xffffffff;
+}
+
+static void
+page_list_add(int b)
+{
+	int *head = &page_blocks[(blocks[b] >> 12) & 0xffff];
+
+	block_page_prev[b] = -1;
+	block_page_next[b] = *head;
+	if (*head >= 0) {
+		block_page_prev[*head] = b;
+	}
+	*head = b;
+}
+
+static void
+page_list_remove(int b)
+{
+	const uint32_t page = (blocks[b] >> 12) & 0xffff;
+
+	if (block_page_prev[b] >= 0) {
+		block_page_next[block_page_prev[b]] = block_page_next[b];
+	} else {
+		page_blocks[page] = block_page_next[b];
+	}
+	if (block_page_next[b] >= 0) {
+		block_page_prev[block_page_next[b]] = block_page_prev[b];
+	}
+	if (page_blocks[page] < 0 && !codeblockspans[(page - 1) & 0xffff]) {
+		// Nothing left in the page, so writes to it need no checking
+		codeblockpresent[page] = 0;
+	}
+}
+
+/**
+ * Discard a block so that it can no longer be entered, and forget its links.
+ *
+ * @param b Block number
+ */
+static void
+block_discard(int b)
+{
+	int n;
+
+	if (blocks[b] != 0xffffffff) {
+		page_list_remove(b);
+	}
+	block_unlink_incoming(b);
+	for (n = 0; n < BLOCK_LINKS; n++) {
+		const int id = b * BLOCK_LINKS + n;
+
+		if (blocklinks[id].target != 0xffffffff) {
+			link_list_remove(id);
+			if (blocklinks[id].linked >= 0) {
+				link_patch(id, -1);
+			}
+			blocklinks[id].target = 0xffffffff;
+		}
+	}
+	blocks[b] = 0xffffffff;
+}
+
+/**
+ * Link all pending jumps whose target is the start of a newly generated block.
+ *
+ * @param b  Block number
+ * @param pc ARM address of the start of the block
+ */
+static void
+block_resolve_pending(int b, uint32_t pc)
+{
+	int id = link_pending[LINK_HASH(pc)];
+
+	while (id >= 0) {
+		const int next = blocklinks[id].next;
+
+		if (blocklinks[id].target == pc) {
+			link_list_remove(id);
+			link_patch(id, b);
+			link_list_add(id);
+		}
+		id = next;
+	}
+}
+
+/**
+ * Discard all links of the given blocks, leaving every jump pointing at the
+ * following instruction.
+ *
+ * @param count Number of blocks, starting from 0, that may have links
+ */
+static void
+links_reset(int count)
+{
+	int id;
+
+	for (id = 0; id < count * BLOCK_LINKS; id++) {
+		if (blocklinks[id].target != 0xffffffff && blocklinks[id].linked >= 0) {
+			link_patch(id, -1);
+		}
+		blocklinks[id].target = 0xffffffff;
+	}
+	memset(link_incoming, 0xff, count * sizeof(link_incoming[0]));
+	memset(link_pending, 0xff, sizeof(link_pending));
+}
+
+/**
+ * Find the block starting at an ARM address, without affecting the order of
+ * its set.
+ *
+ * @param pc ARM address
+ * @return Block number, or -1 if there is no block for this address
+ */
+static int
+codeblock_find(uint32_t pc)
+{
+	const uint32_t set = HASH(pc);
+	int way;
+
+	for (way = 0; way < CODEBLOCK_WAYS; way++) {
+		if (codeblockpc[set + way] == pc) {
+			return codeblocknum[set + way];
+		}
+	}
+	return -1;
+}
+
+/**
+ * Take codegen_mutex on the emulator thread. It may already hold it, when an
+ * instruction run while generating a block flushes the code cache.
+ */
+static void
+codegen_lock(void)
+{
+	if (codegen_lock_depth++ == 0) {
+		pthread_mutex_lock(&codegen_mutex);
+	}
+}
+
+static void
+codegen_unlock(void)
+{
+	if (--codegen_lock_depth == 0) {
+		pthread_mutex_unlock(&codegen_mutex);
+	}
+}
+
+#if defined __linux__
+/*
+ * Descriptions of generated code for the Linux perf profiler, chosen by
+ * config.dynarec_perf_map. A perf map, /tmp/perf-<pid>.map, is read by perf
+ * report and perf top. A jitdump file, /tmp/jit-<pid>.dump, is merged into a
+ * recording made with "perf record -k mono" by "perf inject --jit".
+ *
+ * Each block is described when it is generated. Evicted and rewritten blocks
+ * leave their code in place, and the arena is only reused once the code cache
+ * is flushed, when perf_flush() starts the perf map again so that it only
+ * describes the live arena. Jitdump records are timestamped, so remain correct
+ * across flushes without this.
+ */
+#define PERF_MAP	1
+#define PERF_JITDUMP	2
+
+#define JITDUMP_MAGIC		0x4a695444
+#define JITDUMP_CODE_LOAD	0
+
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t total_size;
+	uint32_t elf_mach;
+	uint32_t pad1;
+	uint32_t pid;
+	uint64_t timestamp;
+	uint64_t flags;
+} JitdumpHeader;
+
+typedef struct {
+	uint32_t id;
+	uint32_t total_size;
+	uint64_t timestamp;
+	uint32_t pid;
+	uint32_t tid;
+	uint64_t vma;
+	uint64_t code_addr;
+	uint64_t code_size;
+	uint64_t code_index;
+} JitdumpCodeLoad;
+
+static FILE *perf_file;		/**< Perf map or jitdump file, or NULL */
+static uint64_t perf_code_index;	/**< Number of jitdump code load records */
+
+/**
+ * Get the time for a jitdump record, from the clock perf uses with -k mono.
+ *
+ * @return Time in nanoseconds
+ */
+static uint64_t
+perf_timestamp(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec;
+}
+
+/**
+ * Create the file chosen by config.dynarec_perf_map.
+ */
+static void
+perf_open(void)
+{
+	char name[64];
+
+	if (config.dynarec_perf_map == PERF_MAP) {
+		snprintf(name, sizeof(name), "/tmp/perf-%d.map", (int) getpid());
+		perf_file = fopen(name, "w");
+	} else if (config.dynarec_perf_map == PERF_JITDUMP) {
+		JitdumpHeader header;
+
+		snprintf(name, sizeof(name), "/tmp/jit-%d.dump", (int) getpid());
+		perf_file = fopen(name, "w+");
+		if (perf_file == NULL) {
+			return;
+		}
+		// perf finds the file through this mapping being recorded
+		if (mmap(NULL, (size_t) sysconf(_SC_PAGESIZE), PROT_READ | PROT_EXEC,
+		         MAP_PRIVATE, fileno(perf_file), 0) == MAP_FAILED)
+		{
+			rpclog("Dynarec: couldn't map %s\n", name);
+		}
+		memset(&header, 0, sizeof(header));
+		header.magic = JITDUMP_MAGIC;
+		header.version = 1;
+		header.total_size = sizeof(header);
+		header.elf_mach = 62; // EM_X86_64
+		header.pid = (uint32_t) getpid();
+		header.timestamp = perf_timestamp();
+		fwrite(&header, sizeof(header), 1, perf_file);
+	} else {
+		return;
+	}
+	if (perf_file == NULL) {
+		error("Couldn't create %s", name);
+		return;
+	}
+	rpclog("Dynarec: describing generated code in %s\n", name);
+}
+
+/**
+ * Forget the blocks described in the perf map, as the code cache has been
+ * flushed and the arena will be reused.
+ */
+static void
+perf_flush(void)
+{
+	char name[64];
+
+	if (config.dynarec_perf_map != PERF_MAP) {
+		return;
+	}
+	snprintf(name, sizeof(name), "/tmp/perf-%d.map", (int) getpid());
+	perf_file = freopen(name, "w", perf_file);
+	if (perf_file == NULL) {
+		rpclog("Dynarec: couldn't restart %s, no longer describing generated code\n", name);
+	}
+}
+
+/**
+ * Work out the physical address of the ARM code of the block being generated,
+ * from where getpccache() found it in host memory.
+ *
+ * @return Physical address, or 0xffffffff if not known
+ */
+static uint32_t
+perf_block_phys(void)
+{
+	const struct {
+		const uint32_t *base;
+		uint32_t size;
+		uint32_t phys;
+	} areas[] = {
+		{ rom,   ROMSIZE,                          0x00000000 },
+		{ vram,  mem_vrammask + 1,                 0x02000000 },
+		{ ram00, mem_rammask + 1,                  0x10000000 },
+		{ ram01, mem_rammask + 1,                  0x14000000 },
+		{ ram1,  ram1 != NULL ? 0x8000000u : 0u,   0x18000000 },
+	};
+	const uintptr_t host = (uintptr_t) &block_code[blockpoint2][block_startpc >> 2];
+	size_t c;
+
+	for (c = 0; c < sizeof(areas) / sizeof(areas[0]); c++) {
+		const uintptr_t base = (uintptr_t) areas[c].base;
+
+		if (areas[c].base != NULL && host >= base && host - base < areas[c].size) {
+			return areas[c].phys + (uint32_t) (host - base);
+		}
+	}
+	return 0xffffffff;
+}
+
+/**
+ * Describe the block just generated to perf.
+ *
+ * @param size Bytes of generated code
+ */
+static void
+perf_block(int size)
+{
+	char name[64];
+
+	snprintf(name, sizeof(name), "ARM %08x phys %08x %s",
+	         block_startpc, perf_block_phys(), block_hot ? "hot" : "cold");
+	if (config.dynarec_perf_map == PERF_MAP) {
+		fprintf(perf_file, "%" PRIxPTR " %x %s\n",
+		        (uintptr_t) rcodeblock[blockpoint2], size, name);
+	} else {
+		JitdumpCodeLoad rec;
+
+		rec.id = JITDUMP_CODE_LOAD;
+		rec.total_size = (uint32_t) (sizeof(rec) + strlen(name) + 1 + size);
+		rec.timestamp = perf_timestamp();
+		rec.pid = (uint32_t) getpid();
+		rec.tid = (uint32_t) syscall(SYS_gettid);
+		rec.vma = (uint64_t) (uintptr_t) rcodeblock[blockpoint2];
+		rec.code_addr = rec.vma;
+		rec.code_size = (uint64_t) size;
+		rec.code_index = perf_code_index++;
+		fwrite(&rec, sizeof(rec), 1, perf_file);
+		fwrite(name, strlen(name) + 1, 1, perf_file);
+		fwrite(rcodeblock[blockpoint2], (size_t) size, 1, perf_file);
+	}
+	fflush(perf_file);
+}
+#endif
+
+/**
+ * Check whether the host CPU has the BMI2 instructions, which generated code
+ * may then use.
+ *
+ * @return Non-zero if BMI2 is available
+ */
+static int
+host_has_bmi2(void)
+{
+	unsigned eax, ebx, ecx, edx;
+
+	if (__get_cpuid_max(0, NULL) < 7) {
+		return 0;
+	}
+	__cpuid_count(7, 0, eax, ebx, ecx, edx);
+	return (ebx >> 8) & 1;
+}
+
+void
+initcodeblocks(void)
+{
+	unsigned size = config.dynarec_cache_size;
+	int c;
+
+	if (size < CODE_ARENA_MIN_MB) {
+		size = CODE_ARENA_MIN_MB;
+	} else if (size > CODE_ARENA_MAX_MB) {
+		size = CODE_ARENA_MAX_MB;
+	}
+	codearena_size = (size_t) size << 20;
+	rpclog("Dynarec: %u MB code cache\n", size);
+
+	host_bmi2 = host_has_bmi2();
+	rpclog("Dynarec: host %s BMI2\n", host_bmi2 ? "has" : "lacks");
+
+	// Clear all blocks
+	memset(codeblockpc, 0xff, sizeof(codeblockpc));
+	memset(blocks, 0xff, sizeof(blocks));
+	memset(blocklinks, 0xff, sizeof(blocklinks));
+	memset(page_blocks, 0xff, sizeof(page_blocks));
+	blockpoint = 0;
+	codearena_pos = 0;
+	links_reset(BLOCKS);
+
+	// AH after LAHF holds SF in bit 7, ZF in bit 6 and CF in bit 0
+	for (c = 0; c < 256; c++) {
+		flags_lahf[c] = ((c & 0x80) ? NFLAG : 0) |
+		                ((c & 0x40) ? ZFLAG : 0) |
+		                ((c & 0x01) ? CFLAG : 0);
+	}
+
+	// Set memory pages containing the code arena executable -
+	// necessary when NX/XD feature is active on CPU(s)
+	set_memory_executable(rcodearena, sizeof(rcodearena));
+
+#if defined __linux__
+	if (perf_file == NULL) {
+		perf_open();
+	}
+#endif
+}
+
+void
+resetcodeblocks(void)
+{
+	int c;
+
+	// Wait for any block being generated by the compile thread, which
+	// allocates from the arena too
+	codegen_lock();
+	for (c = 0; c < blockpoint; c++) {
+		if (blocks[c] != 0xffffffff) {
+			const uint32_t set = HASH(blocks[c]);
+			int way;
+
+			for (way = 0; way < CODEBLOCK_WAYS; way++) {
+				if (codeblocknum[set + way] == c) {
+					codeblockpc[set + way] = 0xffffffff;
+					codeblocknum[set + way] = -1;
+				}
+			}
+			page_blocks[(blocks[c] >> 12) & 0xffff] = -1;
+			codeblockpresent[(blocks[c] >> 12) & 0xffff] = 0;
+			codeblockpresent[(blocks_end[c] >> 12) & 0xffff] = 0;
+			codeblockspans[(blocks[c] >> 12) & 0xffff] = 0;
+			blocks[c] = 0xffffffff;
+		}
+	}
+	links_reset(blockpoint);
+
+	// No generated code is entered again before the next block is
+	// generated, so the whole arena can be reused
+	blockpoint = 0;
+	codearena_pos = 0;
+	codecache_generation++;
+#if defined __linux__
+	if (perf_file != NULL) {
+		perf_flush();
+	}
+#endif
+	codegen_unlock();
+}
+
+/**
+ * Get the regions of a page in which a block has code.
+ *
+ * @param b    Block number
+ * @param page ARM address >> 12 of page
+ * @return Bitmask of regions
+ */
+static uint16_t
+block_regions(int b, uint32_t page)
+{
+	uint32_t addr = blocks[b];
+	uint16_t mask = 0;
+
+	for (;;) {
+		if (((addr >> 12) & 0xffff) == (page & 0xffff)) {
+			mask |= 1u << ((addr >> CODE_REGION_SHIFT) & 0xf);
+		}
+		if ((addr >> CODE_REGION_SHIFT) == (blocks_end[b] >> CODE_REGION_SHIFT)) {
+			return mask;
+		}
+		addr = (addr | ((1u << CODE_REGION_SHIFT) - 1)) + 1;
+	}
+}
+
+/**
+ * Get the regions of a page in which the remaining blocks have code,
+ * including blocks from the previous page that continue into it.
+ *
+ * @param page ARM address >> 12 of page
+ * @return Bitmask of regions
+ */
+static uint16_t
+page_regions(uint32_t page)
+{
+	uint16_t mask = 0;
+	int b;
+
+	for (b = page_blocks[page & 0xffff]; b >= 0; b = block_page_next[b]) {
+		mask |= block_regions(b, page);
+	}
+	if (codeblockspans[(page - 1) & 0xffff]) {
+		for (b = page_blocks[(page - 1) & 0xffff]; b >= 0; b = block_page_next[b]) {
+			if (block_spans[b]) {
+				mask |= block_regions(b, page);
+			}
+		}
+	}
+	return mask;
+}
+
+/**
+ * Discard the blocks starting in a page that have code within a range of
+ * addresses.
+ *
+ * @param a     ARM address >> 12 of page
+ * @param first ARM address of start of range
+ * @param last  ARM address of end of range, inclusive
+ * @return Number of blocks discarded
+ */
+static int
+cacheclear_blocks(uint32_t a, uint32_t first, uint32_t last)
+{
+	int b = page_blocks[a & 0xffff];
+	int discarded = 0;
+
+	while (b >= 0) {
+		const int next = block_page_next[b];
+
+		if ((blocks[b] >> 12) == a && blocks[b] <= last && blocks_end[b] >= first) {
+			const uint32_t set = HASH(blocks[b]);
+			int way;
+
+			for (way = 0; way < CODEBLOCK_WAYS; way++) {
+				if (codeblockpc[set + way] == blocks[b] && codeblocknum[set + way] == b) {
+					codeblockpc[set + way] = 0xffffffff;
+				}
+			}
+			block_discard(b);
+			discarded++;
+		}
+		b = next;
+	}
+	return discarded;
+}
+
+void
+cacheclearpage(uint32_t a)
+{
+	if (!codeblockpresent[a & 0xffff]) {
+		return;
+	}
+	codepage_epoch[a & 0xffff]++;
+	cacheclear_blocks(a, a << 12, (a << 12) | 0xfff);
+
+	// Blocks from the previous page may also have code in this one
+	if (codeblockspans[(a - 1) & 0xffff]) {
+		cacheclear_blocks(a - 1, a << 12, (a << 12) | 0xfff);
+		codeblockspans[(a - 1) & 0xffff] = 0;
+	}
+
+	// Other pages share the entries of this one
+	codeblockpresent[a & 0xffff] = page_regions(a);
+}
+
+/**
+ * Called for a write to a page that is not in the write TLB. Blocks with
+ * code in the region written to are discarded.
+ *
+ * @param addr ARM address written to
+ * @return Non-zero if the page still has code, so must stay out of the
+ *         write TLB
+ */
+int
+cacheclearwrite(uint32_t addr)
+{
+	const uint32_t a = addr >> 12;
+	const uint32_t first = addr & ~((1u << CODE_REGION_SHIFT) - 1);
+	const uint32_t last = first + (1u << CODE_REGION_SHIFT) - 1;
+
+	if (!codeblockpresent[a & 0xffff]) {
+		return 0;
+	}
+	smc_writes++;
+	// Blocks queued for the compile thread may extend beyond the regions
+	// marked so far
+	codepage_epoch[a & 0xffff]++;
+	if (codeblockpresent[a & 0xffff] & (1u << ((addr >> CODE_REGION_SHIFT) & 0xf))) {
+		int discarded = cacheclear_blocks(a, first, last);
+
+		if (codeblockspans[(a - 1) & 0xffff]) {
+			discarded += cacheclear_blocks(a - 1, first, last);
+		}
+		if (discarded != 0) {
+			smc_invalidations++;
+			smc_blocks += discarded;
+		}
+		codeblockpresent[a & 0xffff] = page_regions(a);
+	}
+	return codeblockpresent[a & 0xffff] != 0;
+}
+
+/**
+ * Allocate space for a new block. There must be room for it in the arena and
+ * the block table.
+ *
+ * @param l ARM address of start of block
+ */
+static void
+block_alloc(uint32_t l)
+{
+	blockpoint2 = blockpoint++;
+	rcodeblock[blockpoint2] = &rcodearena[codearena_pos];
+	block_startpc = l;
+	block_pc = l - 4;
+	blocks_end[blockpoint2] = l;
+	block_spans[blockpoint2] = 0;
+	block_links = 0;
+	block_return_link = -1;
+	tempinscount = 0;
+	pcinc = 0;
+	pc_exits = 0;
+	pc_exit_lags = 0;
+	pc_exit_stubs = 0;
+	codeblockpos = 0;
+}
+
+/**
+ * Make a block the one found for an ARM address, as the most recently used in
+ * its set, discarding any block it replaces.
+ *
+ * @param l ARM address of start of block
+ * @param b Block number
+ */
+static void
+codeblock_insert(uint32_t l, int b)
+{
+	const uint32_t set = HASH(l);
+	int way;
+
+	// Replace the cold version of a hot block
+	for (way = 0; way < CODEBLOCK_WAYS; way++) {
+		if (codeblockpc[set + way] == l) {
+			codeblockpc[set + way] = 0xffffffff;
+			block_discard(codeblocknum[set + way]);
+		}
+	}
+
+	// Use a free way of the set, otherwise evict the least recently used
+	for (way = 0; way < CODEBLOCK_WAYS - 1; way++) {
+		if (codeblockpc[set + way] == 0xffffffff) {
+			break;
+		}
+	}
+	if (codeblockpc[set + way] != 0xffffffff) {
+		// The evicted block must no longer be reachable through links
+		block_discard(codeblocknum[set + way]);
+		codecache_conflicts++;
+	}
+	// Insert the new block as the most recently used
+	for (; way > 0; way--) {
+		codeblockpc[set + way] = codeblockpc[set + way - 1];
+		codeblocknum[set + way] = codeblocknum[set + way - 1];
+	}
+	codeblockpc[set] = l;
+	codeblocknum[set] = b;
+	blocks[b] = l;
+	page_list_add(b);
+}
+
+/**
+ * Analyse a newly allocated block, and generate its epilogue and prologue.
+ *
+ * @param l    ARM address of start of block
+ * @param code Pointer to fetch instructions from, indexed by address >> 2
+ */
+static void
+block_start(uint32_t l, const uint32_t *code)
+{
+	block_code[blockpoint2] = code;
+	tier_blocks[block_hot]++;
+	const_valid = 0;
+	const_rd = -1;
+	if (block_hot) {
+		codeblockheat[blockpoint2] = 0;
+		block_len = block_scan(l, code);
+		block_alloc_regs(l, code, block_len);
+		block_flags_liveness(l, code, block_len);
+	} else {
+		// Cold blocks keep no registers and store all flags
+		codeblockheat[blockpoint2] = (int32_t) (config.dynarec_hot_threshold & 0x7fffffff);
+		block_len = 0;
+		block_alloc_regs(l, code, 0);
+	}
+
+	// Block Epilogue
+	gen_writeback_regs(0xffff);
+	addbyte(0x45); addbyte(0x89); addbyte(0x67); addbyte(15<<2); // MOV %r12d,R15
+	addbyte(0x48); addbyte(0x83); addbyte(0xc4); addbyte(8); // ADD $8,%rsp
+	// Restore registers
+	gen_x86_pop_reg(RBX);
+	gen_x86_pop_reg(R12);
+	gen_x86_pop_reg(R13);
+	gen_x86_pop_reg(R14);
+	gen_x86_pop_reg(R15);
+	gen_x86_leave();
+	gen_x86_ret();
+
+	// Block Prologue
+	assert(codeblockpos <= BLOCKSTART);
+	codeblockpos = BLOCKSTART;
+	// Set up a stack frame and preserve registers that are callee-saved
+	gen_x86_push_reg(RBP);
+	addbyte(0x48); addbyte(0x89); addbyte(0xe5); // MOV %rsp,%rbp
+	gen_x86_push_reg(R15);
+	gen_x86_push_reg(R14);
+	gen_x86_push_reg(R13);
+	gen_x86_push_reg(R12);
+	gen_x86_push_reg(RBX);
+	// Align stack to a multiple of 16 bytes - required by AMD64 ABI
+	addbyte(0x48); addbyte(0x83); addbyte(0xec); addbyte(8); // SUB $8,%rsp
+
+	addbyte(0x49); addbyte(0xbf); addptr64(&arm); // MOVABS $(&arm),%r15
+	addbyte(0x49); addbyte(0xbe); addptr64(&vwaddrl[0]); // MOVABS $vwaddrl,%r14
+	addbyte(0x49); addbyte(0xbd); addptr64(&vraddrl[0]); // MOVABS $vraddrl,%r13
 	addbyte(0x45); addbyte(0x8b); addbyte(0x67); addbyte(15<<2); // MOV R15,%r12d
 	block_enter = codeblockpos;
+
+	// Blocks entered directly from other blocks start here
+	gen_reload_regs();
+	block_body = codeblockpos;
+
+	if (!block_hot) {
+		// Count runs, including loops back to block_body, and leave
+		// to be generated again once hot
+		addbyte(0x83); addbyte(0x2d); addrip_byte(&codeblockheat[blockpoint2], 1); // SUBL $1,codeblockheat[blockpoint2](%rip)
+		gen_x86_jump(CC_S, 0);
+	}
+}
+
+void
+initcodeblock(uint32_t l, const uint32_t *code)
+{
+	codegen_lock();
+
+	// A block that is still present was not returned by
+	// codeblock_lookup() because it has become hot
+	block_hot = (config.dynarec_hot_threshold == 0 || codeblock_find(l) >= 0);
+	block_background = 0;
+	block_time = clock();
+
+	// rpclog("Initcodeblock %08x\n", l);
+	if (blockpoint == BLOCKS || codearena_size - codearena_pos < BLOCK_MAX_SIZE) {
+		// Out of space, start again with an empty cache
+		codecache_flushes++;
+		codecache_evictions += blockpoint;
+		resetcodeblocks();
+	}
+	block_alloc(l);
+	codeblock_insert(l, blockpoint2);
+	block_start(l, code);
+}
+
+static void
+genstoreimm(int reg, uint32_t val)
+{
+	if (reg_pinned[reg] >= 0) {
+		addbyte(0x41); addbyte(0xb8 | (reg_pinned[reg] & 7)); addlong(val); // MOV $val,%{host}
+		pinned_dirty |= 1u << reg;
+	} else {
+		addbyte(0x41); addbyte(0xc7); addbyte(0x47); addbyte(reg<<2); addlong(val); // MOVL $val,R{reg}
+	}
+}
+
+/**
+ * Return how far %r12d lags behind R15 as seen by the instruction being
+ * generated. The PC is kept implicit within a block, and rebuilt from this
+ * only where an instruction, helper function or exit needs it.
+ *
+ * @return Lag in bytes, between -4 and 116
+ */
+static int
+pc_lag(void)
+{
+	return pcinc - 4;
+}
+
+static void
+gen_load_reg(int reg, int x86reg)
+{
+	if (reg == 15) {
+		if (pc_lag() != 0) {
+			addbyte(0x41); addbyte(0x8d); addbyte(0x44 | (x86reg << 3)); addbyte(0x24); addbyte((uint8_t) pc_lag()); // LEA lag(%r12),%{x86reg}
+		} else {
+			addbyte(0x44); addbyte(0x89); addbyte(0xe0 | x86reg); // MOV %r12d,%{x86reg}
+		}
+	} else if (reg_pinned[reg] >= 0) {
+		addbyte(0x44); addbyte(0x89); addbyte(0xc0 | ((reg_pinned[reg] & 7) << 3) | x86reg); // MOV %{host},%{x86reg}
+	} else {
+		addbyte(0x41); addbyte(0x8b); addbyte(0x47 | (x86reg << 3)); addbyte(reg<<2); // MOV R{reg},%{x86reg}
+	}
+}
+
+static void
+gen_save_reg(int reg, int x86reg)
+{
+	if (reg == 15) {
+		addbyte(0x41); addbyte(0x89); addbyte(0xc4 | (x86reg << 3)); // MOV %{x86reg},%r12d
+		if (pc_lag() != 0) {
+			addbyte(0x45); addbyte(0x8d); addbyte(0x64); addbyte(0x24); addbyte((uint8_t) -pc_lag()); // LEA -lag(%r12),%r12d
+		}
+	} else if (reg_pinned[reg] >= 0) {
+		addbyte(0x41); addbyte(0x89); addbyte(0xc0 | (x86reg << 3) | (reg_pinned[reg] & 7)); // MOV %{x86reg},%{host}
+		pinned_dirty |= 1u << reg;
+	} else {
+		addbyte(0x41); addbyte(0x89); addbyte(0x47 | (x86reg << 3)); addbyte(reg<<2); // MOV %{x86reg},R{reg}
+	}
+}
+
+/**
+ * Generate OP R{reg},%{x86reg}, where R{reg} is not R15.
+ */
+static void
+gen_op_reg(uint8_t op, int reg, int x86reg)
+{
+	if (reg_pinned[reg] >= 0) {
+		addbyte(0x41); addbyte(0x03|op); addbyte(0xc0 | (x86reg << 3) | (reg_pinned[reg] & 7)); // OP %{host},%{x86reg}
+	} else {
+		addbyte(0x41); addbyte(0x03|op); addbyte(0x47 | (x86reg << 3)); addbyte(reg<<2); // OP R{reg},%{x86reg}
+	}
 }
 
-static const int canrecompile[256] = {
-	1,0,1,0,1,0,0,0,1,0,0,0,0,0,0,0, // 00
-	0,0,0,0,0,0,0,0,1,0,1,0,1,0,1,0, // 10
-	1,0,1,0,1,0,0,0,1,0,0,0,0,0,0,0, // 20
-	0,0,0,0,0,0,0,0,1,0,1,0,1,0,1,0, // 30
-
-	1,1,0,0,1,1,0,0,1,1,0,0,1,1,0,0, // 40
-	1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1, // 50
-	1,1,0,0,1,1,0,0,1,1,0,0,1,1,0,0, // 60
-	1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1, // 70
+/**
+ * Generate OP %{x86reg},R{reg}, where R{reg} is not R15.
+ */
+static void
+gen_op_to_reg(uint8_t op, int x86reg, int reg)
+{
+	if (reg_pinned[reg] >= 0) {
+		addbyte(0x41); addbyte(0x01|op); addbyte(0xc0 | (x86reg << 3) | (reg_pinned[reg] & 7)); // OP %{x86reg},%{host}
+		pinned_dirty |= 1u << reg;
+	} else {
+		addbyte(0x41); addbyte(0x01|op); addbyte(0x47 | (x86reg << 3)); addbyte(reg<<2); // OP %{x86reg},R{reg}
+	}
+}
 
-	1,1,1,1,0,0,0,0,1,1,1,1,0,0,0,0, // 80
-	1,1,1,1,0,0,0,0,1,1,1,1,0,0,0,0, // 90
-	1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1, // a0
-	1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1, // b0
+/**
+ * Generate OPL $imm,R{reg}, where R{reg} is not R15.
+ */
+static void
+gen_op_imm_to_reg(uint8_t op, int reg, uint32_t imm)
+{
+	const uint8_t opcode = (imm & ~0x7f) ? 0x81 : 0x83;
 
-	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, // c0
-	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, // d0
-	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, // e0
-	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, // f0
-};
+	addbyte(0x41); addbyte(opcode);
+	if (reg_pinned[reg] >= 0) {
+		addbyte(0xc0 | op | (reg_pinned[reg] & 7)); // OPL $imm,%{host}
+		pinned_dirty |= 1u << reg;
+	} else {
+		addbyte(0x47 | op); addbyte(reg<<2); // OPL $imm,R{reg}
+	}
+	if (opcode == 0x81) {
+		addlong(imm);
+	} else {
+		addbyte(imm);
+	}
+}
 
+/**
+ * Generate MULL R{reg} or IMULL R{reg}, where R{reg} is not R15.
+ *
+ * @param reg       ARM register to multiply %eax by
+ * @param is_signed Non-zero for a signed multiply
+ */
 static void
-genstoreimm(int reg, uint32_t val)
+gen_mul_reg(int reg, int is_signed)
+{
+	const uint8_t op = is_signed ? 0x08 : 0;
+
+	if (reg_pinned[reg] >= 0) {
+		addbyte(0x41); addbyte(0xf7); addbyte(0xe0 | op | (reg_pinned[reg] & 7)); // [I]MULL %{host}
+	} else {
+		addbyte(0x41); addbyte(0xf7); addbyte(0x67 | op); addbyte(reg<<2); // [I]MULL R{reg}
+	}
+}
+
+/**
+ * Generate a long multiply without the S flag: UMULL, UMLAL, SMULL or SMLAL.
+ *
+ * @param opcode Opcode of instruction being emulated
+ * @return Non-zero if code was generated
+ */
+static int
+gen_mul_long(uint32_t opcode)
 {
-	addbyte(0x41); addbyte(0xc7); addbyte(0x47); addbyte(reg<<2); addlong(val); // MOVL $val,R{reg}
+	if (MULRD == 15 || MULRN == 15 || MULRS == 15 || MULRM == 15) {
+		return 0;
+	}
+	gen_load_reg(MULRM, EAX);
+	gen_mul_reg(MULRS, opcode & 0x400000);
+	if (opcode & 0x200000) {
+		// Accumulate
+		gen_op_reg(X86_OP_ADD, MULRN, EAX);
+		gen_op_reg(X86_OP_ADC, MULRD, EDX);
+	}
+	// RdLo is written first, so RdHi wins if they are the same register
+	gen_save_reg(MULRN, EAX);
+	gen_save_reg(MULRD, EDX);
+	return 1;
 }
 
+/**
+ * Generate SHLX/SHRX/SARX %ecx,R{reg},%eax, reading R{reg} straight from its
+ * host register or ARMState.
+ *
+ * @param pp  VEX prefix field selecting the shift
+ * @param reg ARM register to shift, not R15
+ */
 static void
-gen_load_reg(int reg, int x86reg)
+gen_bmi2_shift(uint8_t pp, int reg)
 {
-	if (reg == 15) {
-		addbyte(0x44); addbyte(0x89); addbyte(0xe0 | x86reg); // MOV %r12d,%{x86reg}
+	addbyte(0xc4); addbyte(0xc2); addbyte(0x70 | pp); addbyte(0xf7);
+	if (reg_pinned[reg] >= 0) {
+		addbyte(0xc0 | (reg_pinned[reg] & 7)); // %r{host}
 	} else {
-		addbyte(0x41); addbyte(0x8b); addbyte(0x47 | (x86reg << 3)); addbyte(reg<<2); // MOV R{reg},%{x86reg}
+		addbyte(0x47); addbyte(reg<<2); // R{reg}
 	}
 }
 
-static void
-gen_save_reg(int reg, int x86reg)
+/**
+ * Generate code to shift a register by the bottom byte of another, for the
+ * operand of a data processing instruction. With BMI2 the count need not be
+ * in %cl and the register is not copied to %eax first.
+ *
+ * Register usage:
+ *	%eax	result
+ *	%ecx	shift amount
+ *	%edx	scratch
+ *
+ * @param opcode Opcode of instruction
+ * @return 1 if code was generated, 0 if the instruction must be emulated by
+ *         calling its C function
+ */
+static int
+generate_shift_reg(uint32_t opcode)
 {
-	if (reg == 15) {
-		addbyte(0x41); addbyte(0x89); addbyte(0xc4 | (x86reg << 3)); // MOV %{x86reg},%r12d
+	static const uint8_t bmi2_pp[3] = { 1, 3, 2 }; // SHLX, SHRX, SARX
+	static const uint8_t modrm[3] = { 0xe0, 0xe8, 0xf8 }; // SHL, SHR, SAR
+
+	if ((opcode & 0x0e000090) != 0x10) {
+		// Not data processing, so a multiply, extension or undefined
+		return 0;
+	}
+	if (RM == 15 || MULRS == 15 || RN == 15) {
+		// R15 reads as 12 ahead here
+		return 0;
+	}
+	gen_load_reg(MULRS, ECX);
+	addbyte(0x0f); addbyte(0xb6); addbyte(0xc9); // MOVZBL %cl,%ecx
+	if ((opcode & 0x60) == 0x60) {
+		// ROR only uses the bottom 5 bits, as x86 does
+		gen_load_reg(RM, EAX);
+		addbyte(0xd3); addbyte(0xc8); // ROR %cl,%eax
+		reg_shifts++;
+		return 1;
+	}
+	if ((opcode & 0x60) == 0x40) {
+		// ASR by 32 or more is the same as by 31
+		addbyte(0xba); addlong(31); // MOV $31,%edx
+		addbyte(0x39); addbyte(0xd1); // CMP %edx,%ecx
+		addbyte(0x0f); addbyte(0x47); addbyte(0xca); // CMOVA %edx,%ecx
+	}
+	if (host_bmi2) {
+		gen_bmi2_shift(bmi2_pp[(opcode >> 5) & 3], RM);
 	} else {
-		addbyte(0x41); addbyte(0x89); addbyte(0x47 | (x86reg << 3)); addbyte(reg<<2); // MOV %{x86reg},R{reg}
+		gen_load_reg(RM, EAX);
+		addbyte(0xd3); addbyte(modrm[(opcode >> 5) & 3]); // SHL/SHR/SAR %cl,%eax
+	}
+	if ((opcode & 0x60) != 0x40) {
+		// LSL and LSR by 32 or more give 0
+		addbyte(0x31); addbyte(0xd2); // XOR %edx,%edx
+		addbyte(0x83); addbyte(0xf9); addbyte(32); // CMP $32,%ecx
+		addbyte(0x0f); addbyte(0x43); addbyte(0xc2); // CMOVAE %edx,%eax
 	}
+	reg_shifts++;
+	return 1;
 }
 
 static int
@@ -332,8 +1916,7 @@ generate_shift(uint32_t opcode)
 	uint32_t shift_amount;
 
 	if (opcode & 0x10) {
-		// Can't do register shifts or multiplies
-		return 0;
+		return generate_shift_reg(opcode);
 	}
 	if ((opcode & 0xff0) == 0) {
 		// No shift
@@ -386,7 +1969,7 @@ gen_data_proc_reg(uint32_t opcode, uint8_t op, int dirmatters)
 		addbyte(0x01|op); addbyte(0xc2); // OP %eax,%edx
 		gen_save_reg(RD, EDX);
 	} else {
-		addbyte(0x41); addbyte(0x03|op); addbyte(0x47); addbyte(RN<<2); // OP RN,%eax
+		gen_op_reg(op, RN, EAX);
 		gen_save_reg(RD, EAX);
 	}
 }
@@ -396,11 +1979,7 @@ gen_data_proc_imm(uint32_t opcode, uint8_t op, uint32_t imm)
 {
 	if (RN == RD) {
 		// Can use RMW instruction
-		if (imm & ~0x7f) {
-			addbyte(0x41); addbyte(0x81); addbyte(0x47|op); addbyte(RD<<2); addlong(imm); // OPL $imm,RD
-		} else {
-			addbyte(0x41); addbyte(0x83); addbyte(0x47|op); addbyte(RD<<2); addbyte(imm); // OPL $imm,RD
-		}
+		gen_op_imm_to_reg(op, RD, imm);
 	} else {
 		// Load/modify/store
 		gen_load_reg(RN, EAX);
@@ -412,11 +1991,153 @@ gen_data_proc_imm(uint32_t opcode, uint8_t op, uint32_t imm)
 	}
 }
 
+/**
+ * Check whether a register is known to hold a constant.
+ */
+static int
+const_known(int reg)
+{
+	return reg != 15 && (const_valid & (1u << reg));
+}
+
+/**
+ * Generate a data processing instruction whose result is known, by storing
+ * it directly.
+ *
+ * @param opcode Opcode of instruction
+ * @param val    Result of instruction
+ */
+static void
+gen_const_result(uint32_t opcode, uint32_t val)
+{
+	genstoreimm(RD, val);
+	const_rd = RD;
+	const_rd_val = val;
+}
+
+/**
+ * Generate code to put the address of a LDR/STR with an immediate offset and
+ * no writeback in %ebx, if its base register holds a known constant.
+ *
+ * @param opcode Opcode of instruction
+ * @return Non-zero if the address was known
+ */
+static int
+gen_const_addr(uint32_t opcode)
+{
+	uint32_t addr;
+
+	if ((opcode & 0x2200000) || !const_known(RN)) {
+		return 0;
+	}
+	if (opcode & 0x800000) {
+		addr = const_val[RN] + (opcode & 0xfff);
+	} else {
+		addr = const_val[RN] - (opcode & 0xfff);
+	}
+	addbyte(0xbb); addlong(addr); // MOV $addr,%ebx
+	return 1;
+}
+
+/**
+ * Account for the registers written by an instruction that was generated
+ * natively, recording any constant it produced.
+ *
+ * @param opcode Opcode of instruction
+ */
+static void
+const_update(uint32_t opcode)
+{
+	int uses[16] = { 0 };
+	uint32_t writes = 0;
+
+	count_reg_uses(opcode, uses, &writes);
+	const_valid &= ~writes;
+	if (const_rd >= 0 && block_hot && (opcode >> 28) == 0xe) {
+		const_valid |= 1u << const_rd;
+		const_val[const_rd] = const_rd_val;
+	}
+	const_rd = -1;
+}
+
+/**
+ * Generate a conditional exit to the epilogue from the middle of an
+ * instruction, for an abort or interrupt. The epilogue stores %r12d as R15, so
+ * while it lags the jump is recorded in the side table, for endblock() to send
+ * it through a stub that catches up first.
+ *
+ * @param condition Condition for leaving the block
+ */
+static void
+gen_exit_pc(int condition)
+{
+	const int lag = pc_lag();
+
+	if (lag == 0) {
+		gen_x86_jump(condition, 0);
+		return;
+	}
+	pc_exit_pos[pc_exits] = gen_x86_jump_forward_long(condition);
+	pc_exit_lag[pc_exits++] = (int8_t) lag;
+	if (!(pc_exit_lags & (1u << ((lag + 4) >> 2)))) {
+		pc_exit_lags |= 1u << ((lag + 4) >> 2);
+		pc_exit_stubs++;
+	}
+}
+
+/**
+ * Generate the stubs for the exits in the side table, one per distinct lag.
+ */
+static void
+gen_pc_exit_stubs(void)
+{
+	int lag, c;
+
+	for (lag = -4; lag < 124; lag += 4) {
+		if (!(pc_exit_lags & (1u << ((lag + 4) >> 2)))) {
+			continue;
+		}
+		for (c = 0; c < pc_exits; c++) {
+			if (pc_exit_lag[c] == lag) {
+				gen_x86_jump_here_long(pc_exit_pos[c]);
+			}
+		}
+		addbyte(0x41); addbyte(0x83); addbyte(0xc4); addbyte((uint8_t) lag); // ADD $lag,%r12d
+		gen_x86_jump(CC_ALWAYS, 0);
+	}
+}
+
+/**
+ * Generate code to store R15 as seen by the instruction being generated, for
+ * a helper function.
+ */
+static void
+gen_store_pc(void)
+{
+	addbyte(0x45); addbyte(0x89); addbyte(0x67); addbyte(15<<2); // MOV %r12d,R15
+	if (pc_lag() != 0) {
+		addbyte(0x41); addbyte(0x83); addbyte(0x47); addbyte(15<<2); addbyte((uint8_t) pc_lag()); // ADDL $lag,R15
+	}
+}
+
+/**
+ * Generate code to reload %r12d after a helper function, which may have
+ * changed R15, and let it lag behind again.
+ */
+static void
+gen_reload_pc(void)
+{
+	addbyte(0x45); addbyte(0x8b); addbyte(0x67); addbyte(15<<2); // MOV R15,%r12d
+	if (pc_lag() != 0) {
+		addbyte(0x45); addbyte(0x8d); addbyte(0x64); addbyte(0x24); addbyte((uint8_t) -pc_lag()); // LEA -lag(%r12),%r12d
+	}
+}
+
 static void
 gen_test_armirq(void)
 {
 	addbyte(0x41); addbyte(0xf7); addbyte(0x47); addbyte(offsetof(ARMState, event)); addlong(0x40); // TESTL $0x40,arm.event
-	gen_x86_jump(CC_NZ, 0);
+	gen_exit_pc(CC_NZ);
 }
 
 /**
@@ -440,7 +2161,7 @@ genldr(void)
 	jump_nextbit = gen_x86_jump_forward(CC_ALWAYS);
 	// .notinbuffer
 	gen_x86_jump_here(jump_notinbuffer);
-	gen_x86_call(readmemfl);
+	gen_helper_call(readmemfl);
 	if (arm.abort_base_restored) {
 		gen_test_armirq();
 	}
@@ -472,7 +2193,7 @@ genldrb(void)
 	jump_nextbit = gen_x86_jump_forward(CC_ALWAYS);
 	// .notinbuffer
 	gen_x86_jump_here(jump_notinbuffer);
-	gen_x86_call(readmemfb);
+	gen_helper_call(readmemfb);
 	if (arm.abort_base_restored) {
 		gen_test_armirq();
 	}
@@ -501,7 +2222,7 @@ genstr(void)
 	jump_nextbit = gen_x86_jump_forward(CC_ALWAYS);
 	// .notinbuffer
 	gen_x86_jump_here(jump_notinbuffer);
-	gen_x86_call(writememfl);
+	gen_helper_call(writememfl);
 	if (arm.abort_base_restored) {
 		gen_test_armirq();
 	}
@@ -529,12 +2250,185 @@ genstrb(void)
 	jump_nextbit = gen_x86_jump_forward(CC_ALWAYS);
 	// .notinbuffer
 	gen_x86_jump_here(jump_notinbuffer);
-	gen_x86_call(writememfb);
+	gen_helper_call(writememfb);
 	if (arm.abort_base_restored) {
 		gen_test_armirq();
 	}
-	// .nextbit
-	gen_x86_jump_here(jump_nextbit);
+	// .nextbit
+	gen_x86_jump_here(jump_nextbit);
+}
+
+/**
+ * Load a halfword in the same way as arm_ldrh() and arm_ldrsh(), from the word
+ * containing addr. An abort is tested for straight away, as an aborted
+ * halfword transfer never updates the base register.
+ *
+ * Register usage:
+ *	%ebx	addr
+ *	%eax	data (out)
+ *
+ * @param is_signed Non-zero to sign extend the halfword
+ */
+static void
+genldrh(int is_signed)
+{
+	const uint8_t movx = is_signed ? 0xbf : 0xb7;
+	int jump_nextbit, jump_notinbuffer;
+
+	addbyte(0x89); addbyte(0xda); // MOV %ebx,%edx
+	addbyte(0x89); addbyte(0xdf); // MOV %ebx,%edi
+	addbyte(0xc1); addbyte(0xea); addbyte(12); // SHR $12,%edx
+	addbyte(0x83); addbyte(0xe7); addbyte(0xfe); // AND $0xfffffffe,%edi
+	addbyte(0x49); addbyte(0x8b); addbyte(0x54); addbyte(0xd5); addbyte(0); // MOV (%r13,%rdx,8),%rdx
+	addbyte(0xf6); addbyte(0xc2); addbyte(1); // TEST $1,%dl
+	jump_notinbuffer = gen_x86_jump_forward(CC_NZ);
+	addbyte(0x0f); addbyte(movx); addbyte(0x04); addbyte(0x3a); // MOV[SZ]WL (%rdx,%rdi),%eax
+	jump_nextbit = gen_x86_jump_forward(CC_ALWAYS);
+	// .notinbuffer
+	gen_x86_jump_here(jump_notinbuffer);
+	addbyte(0x83); addbyte(0xe7); addbyte(0xfc); // AND $0xfffffffc,%edi
+	gen_helper_call(readmemfl);
+	gen_test_armirq();
+	addbyte(0x89); addbyte(0xd9); // MOV %ebx,%ecx
+	addbyte(0x83); addbyte(0xe1); addbyte(2); // AND $2,%ecx
+	addbyte(0xc1); addbyte(0xe1); addbyte(3); // SHL $3,%ecx
+	addbyte(0xd3); addbyte(0xe8); // SHR %cl,%eax
+	addbyte(0x0f); addbyte(movx); addbyte(0xc0); // MOV[SZ]WL %ax,%eax
+	// .nextbit
+	gen_x86_jump_here(jump_nextbit);
+}
+
+/**
+ * Load a signed byte in the same way as arm_ldrsb().
+ *
+ * Register usage:
+ *	%ebx	addr
+ *	%eax	data (out)
+ */
+static void
+genldrsb(void)
+{
+	int jump_nextbit, jump_notinbuffer;
+
+	addbyte(0x89); addbyte(0xda); // MOV %ebx,%edx
+	addbyte(0x89); addbyte(0xdf); // MOV %ebx,%edi
+	addbyte(0xc1); addbyte(0xea); addbyte(12); // SHR $12,%edx
+	addbyte(0x49); addbyte(0x8b); addbyte(0x54); addbyte(0xd5); addbyte(0); // MOV (%r13,%rdx,8),%rdx
+	addbyte(0xf6); addbyte(0xc2); addbyte(1); // TEST $1,%dl
+	jump_notinbuffer = gen_x86_jump_forward(CC_NZ);
+	addbyte(0x0f); addbyte(0xbe); addbyte(0x04); addbyte(0x3a); // MOVSBL (%rdx,%rdi),%eax
+	jump_nextbit = gen_x86_jump_forward(CC_ALWAYS);
+	// .notinbuffer
+	gen_x86_jump_here(jump_notinbuffer);
+	gen_helper_call(readmemfb);
+	gen_test_armirq();
+	addbyte(0x0f); addbyte(0xbe); addbyte(0xc0); // MOVSBL %al,%eax
+	// .nextbit
+	gen_x86_jump_here(jump_nextbit);
+}
+
+/**
+ * Store a halfword in the same way as arm_strh(). The slow path writes the
+ * two bytes separately, only testing for an abort after both.
+ *
+ * Register usage:
+ *	%ebx	addr
+ *	%esi	data
+ */
+static void
+genstrh(void)
+{
+	int jump_nextbit, jump_notinbuffer;
+
+	addbyte(0x89); addbyte(0xda); // MOV %ebx,%edx
+	addbyte(0x89); addbyte(0xdf); // MOV %ebx,%edi
+	addbyte(0xc1); addbyte(0xea); addbyte(12); // SHR $12,%edx
+	addbyte(0x83); addbyte(0xe7); addbyte(0xfe); // AND $0xfffffffe,%edi
+	addbyte(0x49); addbyte(0x8b); addbyte(0x14); addbyte(0xd6); // MOV (%r14,%rdx,8),%rdx
+	addbyte(0xf6); addbyte(0xc2); addbyte(3); // TEST $3,%dl
+	jump_notinbuffer = gen_x86_jump_forward(CC_NZ);
+	addbyte(0x66); addbyte(0x89); addbyte(0x34); addbyte(0x3a); // MOV %si,(%rdx,%rdi)
+	jump_nextbit = gen_x86_jump_forward(CC_ALWAYS);
+	// .notinbuffer
+	gen_x86_jump_here(jump_notinbuffer);
+	gen_x86_mov_reg32_stack(ESI, 0);
+	addbyte(0x40); addbyte(0x0f); addbyte(0xb6); addbyte(0xf6); // MOVZBL %sil,%esi
+	gen_helper_call(writememfb);
+	gen_x86_mov_stack_reg32(ESI, 0);
+	addbyte(0x89); addbyte(0xdf); // MOV %ebx,%edi
+	addbyte(0xc1); addbyte(0xee); addbyte(8); // SHR $8,%esi
+	addbyte(0x83); addbyte(0xcf); addbyte(1); // OR $1,%edi
+	addbyte(0x40); addbyte(0x0f); addbyte(0xb6); addbyte(0xf6); // MOVZBL %sil,%esi
+	gen_helper_call(writememfb);
+	gen_test_armirq();
+	// .nextbit
+	gen_x86_jump_here(jump_nextbit);
+}
+
+/**
+ * Generate LDRH, STRH, LDRSB or LDRSH, matching arm_ldrh() etc. An aborted
+ * transfer leaves the base register unchanged, whatever the abort model.
+ *
+ * @param opcode Opcode of instruction being emulated
+ * @return Non-zero if code was generated
+ */
+static int
+gen_halfword_transfer(uint32_t opcode)
+{
+	const int writeback = !(opcode & (1u << 24)) || (opcode & (1u << 21));
+	const uint8_t op = (opcode & (1u << 23)) ? X86_OP_ADD : X86_OP_SUB;
+	uint32_t offset = 0;
+
+	if (RD == 15 || (RN == 15 && writeback)) {
+		return 0;
+	}
+	if (opcode & (1u << 22)) {
+		offset = ((opcode >> 4) & 0xf0) | (opcode & 0xf);
+	} else if (RM == 15) {
+		return 0;
+	}
+
+	gen_load_reg(RN, EBX);
+	if (RN == 15) {
+		addbyte(0x81); addbyte(0xe3); addlong(arm.r15_mask); // AND $arm.r15_mask,%ebx
+	}
+	if (opcode & (1u << 24)) {
+		// Pre-indexed
+		if (!(opcode & (1u << 22))) {
+			gen_op_reg(op, RM, EBX);
+		} else if (offset != 0) {
+			addbyte(0x81); addbyte(0xc3 | op); addlong(offset); // ADD/SUB $offset,%ebx
+		}
+	}
+
+	if (opcode & (1u << 20)) {
+		if ((opcode & 0x60) == 0x40) {
+			genldrsb();
+		} else {
+			genldrh(opcode & 0x40);
+		}
+	} else {
+		gen_load_reg(RD, ESI);
+		genstrh();
+	}
+
+	if (!(opcode & (1u << 24))) {
+		// Post-indexed
+		if (!(opcode & (1u << 22))) {
+			gen_load_reg(RM, EDX);
+			gen_op_to_reg(op, EDX, RN);
+		} else if (offset != 0) {
+			gen_op_imm_to_reg(op, RN, offset);
+		}
+	} else if (opcode & (1u << 21)) {
+		// Pre-indexed with Writeback
+		gen_save_reg(RN, EBX);
+	}
+
+	if (opcode & (1u << 20)) {
+		gen_save_reg(RD, EAX);
+	}
+	return 1;
 }
 
 /**
@@ -602,9 +2496,9 @@ gen_call_ldm_stm_helper(uint32_t opcode, const void *helper_fn)
 {
 	addbyte(0xbf); addlong(opcode); // MOV $opcode,%edi (argument 1)
 
-	addbyte(0x45); addbyte(0x89); addbyte(0x67); addbyte(15<<2); // MOV %r12d,R15
-	gen_x86_call(helper_fn);
-	addbyte(0x45); addbyte(0x8b); addbyte(0x67); addbyte(15<<2); // MOV R15,%r12d
+	gen_store_pc();
+	gen_helper_call(helper_fn);
+	gen_reload_pc();
 
 	gen_test_armirq();
 }
@@ -764,9 +2658,661 @@ gen_arm_load_multiple(uint32_t opcode, uint32_t offset)
 	gen_x86_jump_here_long(jump_tlb_miss);
 	gen_call_ldm_stm_helper(opcode, arm_load_multiple);
 
-	// All done, continue here
-	gen_x86_jump_here(jump_done);
+	// All done, continue here
+	gen_x86_jump_here(jump_done);
+}
+
+/* Source of the ARM C flag when storing flags */
+#define FLAGS_C_CF	0	/**< x86 carry flag */
+#define FLAGS_C_NCF	1	/**< Inverse of x86 carry flag, for subtraction */
+#define FLAGS_C_BL	2	/**< Shifter carry saved in %bl */
+#define FLAGS_C_SET	3	/**< Shifter carry known to be set */
+#define FLAGS_C_CLEAR	4	/**< Shifter carry known to be clear */
+
+/**
+ * Generate code to replace the flags in the PSR with those in %eax.
+ *
+ * @param mask  Bitmask of ARM flags to replace
+ * @param pcpsr Pointer to the PSR holding the flags
+ */
+static void
+gen_flags_merge(uint32_t mask, const uint32_t *pcpsr)
+{
+	if (pcpsr == &arm.reg[15]) {
+		addbyte(0x41); addbyte(0x81); addbyte(0xe4); addlong(~mask); // AND $~mask,%r12d
+		addbyte(0x41); addbyte(0x09); addbyte(0xc4); // OR %eax,%r12d
+	} else {
+		addbyte(0x41); addbyte(0x81); addbyte(0x67); addbyte(16<<2); addlong(~mask); // ANDL $~mask,CPSR
+		addbyte(0x41); addbyte(0x09); addbyte(0x47); addbyte(16<<2); // OR %eax,CPSR
+	}
+}
+
+/**
+ * Generate code to convert the x86 flags to ARM flags and store them in the
+ * PSR, after a data processing operation. Only the flags given are changed.
+ *
+ * Clobbers %eax, %ecx and %edx.
+ *
+ * @param mask  Bitmask of ARM flags to store
+ * @param carry Source of the C flag, one of the FLAGS_C_* values
+ * @param pcpsr Pointer to the PSR holding the flags
+ */
+static void
+gen_flags_store(uint32_t mask, int carry, const uint32_t *pcpsr)
+{
+	if (mask == 0) {
+		// All the flags are overwritten before being read
+		return;
+	}
+
+	if ((mask & CFLAG) && carry == FLAGS_C_NCF) {
+		addbyte(0xf5); // CMC
+	}
+	addbyte(0x9f); // LAHF
+	if (mask & VFLAG) {
+		addbyte(0x0f); addbyte(0x90); addbyte(0xc0); // SETO %al
+	}
+	addbyte(0x0f); addbyte(0xb6); addbyte(0xd4); // MOVZBL %ah,%edx
+	if (mask & VFLAG) {
+		addbyte(0x0f); addbyte(0xb6); addbyte(0xc0); // MOVZBL %al,%eax
+		addbyte(0xc1); addbyte(0xe0); addbyte(28); // SHL $28,%eax
+	} else {
+		addbyte(0x31); addbyte(0xc0); // XOR %eax,%eax
+	}
+	addbyte(0x48); addbyte(0x8d); addbyte(0x0d); addrip(flags_lahf); // LEA flags_lahf(%rip),%rcx
+	addbyte(0x0b); addbyte(0x04); addbyte(0x91); // OR (%rcx,%rdx,4),%eax
+
+	// Logical operations clear the x86 carry, so the shifter carry is
+	// added separately
+	if ((mask & CFLAG) && carry == FLAGS_C_BL) {
+		addbyte(0x0f); addbyte(0xb6); addbyte(0xdb); // MOVZBL %bl,%ebx
+		addbyte(0xc1); addbyte(0xe3); addbyte(29); // SHL $29,%ebx
+		addbyte(0x09); addbyte(0xd8); // OR %ebx,%eax
+	} else if ((mask & CFLAG) && carry == FLAGS_C_SET) {
+		addbyte(0x0d); addlong(CFLAG); // OR $CFLAG,%eax
+	}
+	if ((mask & (NFLAG | ZFLAG | CFLAG)) != (NFLAG | ZFLAG | CFLAG)) {
+		addbyte(0x25); addlong(mask); // AND $mask,%eax
+	}
+	gen_flags_merge(mask, pcpsr);
+}
+
+/**
+ * Generate code for a data processing instruction with the S bit set. The
+ * flags are only stored if they may be read before being overwritten.
+ *
+ * @param opcode Opcode of instruction
+ * @param pcpsr  Pointer to the PSR holding the flags
+ * @return 1 if code was generated, 0 if the instruction must be emulated by
+ *         calling its C function
+ */
+static int
+recompile_flags(uint32_t opcode, const uint32_t *pcpsr)
+{
+	static const uint8_t x86_op[16] = {
+		X86_OP_AND, X86_OP_XOR, X86_OP_SUB, 0, X86_OP_ADD, 0, 0, 0,
+		0, 0, 0, 0, X86_OP_OR, 0, X86_OP_AND, 0
+	};
+	const uint32_t op = (opcode >> 21) & 0xf;
+	const uint32_t live = flags_live_after();
+	uint32_t written = NFLAG | ZFLAG;
+	uint32_t rhs = 0;
+	uint32_t mask;
+	int carry = FLAGS_C_CF;
+
+	if (RD == 15 || RN == 15) {
+		return 0;
+	}
+	if (!(opcode & 0x2000000) && ((opcode & 0x10) || RM == 15)) {
+		// Register shift, multiply or extension
+		return 0;
+	}
+	if (opcode & 0x2000000) {
+		rhs = arm_imm(opcode);
+	}
+
+	switch (op) {
+	case 0x2: // SUB
+	case 0xa: // CMP
+		written |= CFLAG | VFLAG;
+		carry = FLAGS_C_NCF;
+		break;
+	case 0x4: // ADD
+	case 0xb: // CMN
+		written |= CFLAG | VFLAG;
+		break;
+	case 0x0: case 0x1: case 0x8: case 0x9: // AND, EOR, TST, TEQ
+	case 0xc: case 0xd: case 0xe: case 0xf: // ORR, MOV, BIC, MVN
+		// C is set by the shifter, if the operand is shifted at all
+		if (opcode & 0x2000000) {
+			if (opcode & 0xf00) {
+				written |= CFLAG;
+				carry = (rhs & 0x80000000) ? FLAGS_C_SET : FLAGS_C_CLEAR;
+			}
+		} else if ((opcode & 0xff0) != 0) {
+			written |= CFLAG;
+			carry = FLAGS_C_BL;
+			if ((opcode & 0xf80) == 0 && (live & CFLAG)) {
+				// The carry from LSR #32, ASR #32 and RRX is not
+				// generated by the x86 shift
+				return 0;
+			}
+		}
+		break;
+	default: // RSB, ADC, SBC, RSC
+		return 0;
+	}
+	mask = written & live;
+
+	if (!(opcode & 0x2000000)) {
+		if (!generate_shift(opcode)) {
+			return 0;
+		}
+		if ((mask & CFLAG) && carry == FLAGS_C_BL) {
+			addbyte(0x0f); addbyte(0x92); addbyte(0xc3); // SETC %bl
+		}
+	}
+
+	switch (op) {
+	case 0xd: // MOV
+	case 0xf: // MVN
+		if (opcode & 0x2000000) {
+			addbyte(0xb8); addlong((op == 0xf) ? ~rhs : rhs); // MOV $rhs,%eax
+		} else if (op == 0xf) {
+			addbyte(0xf7); addbyte(0xd0); // NOT %eax
+		}
+		if (mask != 0) {
+			addbyte(0x85); addbyte(0xc0); // TEST %eax,%eax
+		}
+		gen_save_reg(RD, EAX);
+		break;
+
+	case 0x8: // TST
+	case 0x9: // TEQ
+	case 0xa: // CMP
+	case 0xb: // CMN
+		if (opcode & 0x2000000) {
+			static const uint8_t op_imm_eax[4] = { 0xa9, 0x35, 0x3d, 0x05 };
+
+			gen_load_reg(RN, EAX);
+			addbyte(op_imm_eax[op & 3]); addlong(rhs); // TEST/XOR/CMP/ADD $rhs,%eax
+		} else {
+			static const uint8_t op_eax_edx[4] = { 0x85, 0x31, 0x39, 0x01 };
+
+			gen_load_reg(RN, EDX);
+			addbyte(op_eax_edx[op & 3]); addbyte(0xc2); // TEST/XOR/CMP/ADD %eax,%edx
+		}
+		break;
+
+	default: // AND, EOR, SUB, ADD, ORR, BIC
+		if (opcode & 0x2000000) {
+			gen_data_proc_imm(opcode, x86_op[op], (op == 0xe) ? ~rhs : rhs);
+		} else {
+			if (op == 0xe) {
+				addbyte(0xf7); addbyte(0xd0); // NOT %eax
+			}
+			gen_data_proc_reg(opcode, x86_op[op], op == 0x2);
+		}
+		break;
+	}
+
+	gen_flags_store(mask, carry, pcpsr);
+	return 1;
+}
+
+/**
+ * Generate a patchable jump to the block for a statically known successor,
+ * taken if the ARM PC in %eax matches it.
+ *
+ * @param n      Index of the link within the current block
+ * @param target ARM address of the successor
+ */
+static void
+gen_block_link(int n, uint32_t target)
+{
+	const int id = blockpoint2 * BLOCK_LINKS + n;
+	int b;
+
+	addbyte(0x3d); addlong(target); // CMP $target,%eax
+	addbyte(0x0f); addbyte(0x84); addlong(0); // JE next block
+	blocklinks[id].target = target;
+	blocklinks[id].pos = codeblockpos - 4;
+	blocklinks[id].linked = -1;
+	if (block_background) {
+		// Linked by the emulator thread when the block is published
+		return;
+	}
+	b = codeblock_find(target);
+	if (b >= 0) {
+		link_patch(id, b);
+	}
+	link_list_add(id);
+}
+
+/**
+ * Generate code for a BL to push its return address onto the return stack.
+ * The first BL of a block gets a return link, to keep track of the block
+ * generated for the return address; any others push no block.
+ *
+ * @param ret ARM address BL returns to
+ */
+static void
+gen_return_push(uint32_t ret)
+{
+	int id = -1;
+	int b;
+
+	if (block_return_link < 0 && block_links < BLOCK_LINKS - 2) {
+		block_return_link = block_links++;
+		id = blockpoint2 * BLOCK_LINKS + block_return_link;
+		blocklinks[id].target = ret;
+		blocklinks[id].pos = -1;
+		blocklinks[id].linked = -1;
+		if (!block_background) {
+			b = codeblock_find(ret);
+			if (b >= 0) {
+				link_patch(id, b);
+			}
+			link_list_add(id);
+		}
+	}
+
+	addbyte(0x8b); addbyte(0x0d); addrip(&return_top); // MOV return_top(%rip),%ecx
+	addbyte(0x83); addbyte(0xc1); addbyte(1); // ADD $1,%ecx
+	addbyte(0x83); addbyte(0xe1); addbyte(RETURN_STACK_SIZE - 1); // AND $(RETURN_STACK_SIZE - 1),%ecx
+	addbyte(0x89); addbyte(0x0d); addrip(&return_top); // MOV %ecx,return_top(%rip)
+	addbyte(0x48); addbyte(0x8d); addbyte(0x15); addrip(return_stack); // LEA return_stack(%rip),%rdx
+	addbyte(0xc7); addbyte(0x04); addbyte(0xca); addlong(ret); // MOVL $ret,(%rdx,%rcx,8)
+	if (id >= 0) {
+		addbyte(0x8b); addbyte(0x05); addrip(&blocklinks[id].linked); // MOV blocklinks[id].linked(%rip),%eax
+		addbyte(0x89); addbyte(0x44); addbyte(0xca); addbyte(4); // MOV %eax,4(%rdx,%rcx,8)
+	} else {
+		addbyte(0xc7); addbyte(0x44); addbyte(0xca); addbyte(4); addlong((uint32_t) -1); // MOVL $-1,4(%rdx,%rcx,8)
+	}
+}
+
+/**
+ * Check whether an instruction ending a block is a function return, either
+ * MOV PC,LR or LDMFD sp!,{...,pc}.
+ *
+ * @param opcode Opcode of last instruction in block
+ * @return Non-zero if it is a return
+ */
+static int
+block_ends_with_return(uint32_t opcode)
+{
+	return (opcode & 0x0fefffff) == 0x01a0f00e ||
+	       ((opcode & 0x0fff8000) == 0x08bd8000);
+}
+
+/**
+ * Check whether the block being ended is a short loop back to its own start
+ * that only polls memory or I/O: loads without writeback, and data processing
+ * whose results are recomputed each time round, ending in a branch on flags
+ * set within the loop. Such a loop can only finish once something outside
+ * the ARM changes what it reads.
+ *
+ * @param opcode Opcode of last instruction in block
+ * @return Non-zero if the block is an idle loop
+ */
+static int
+block_is_idle_loop(uint32_t opcode)
+{
+	const uint32_t *code = block_code[blockpoint2];
+	const int len = (int) ((block_lastpc - block_startpc) >> 2);
+	uint32_t reads[IDLE_LOOP_MAX], writes[IDLE_LOOP_MAX];
+	uint32_t loop_writes = 0, defined = 0, flags = 0;
+	uint32_t offset;
+	int n;
+
+	if (len >= IDLE_LOOP_MAX || block_spans[blockpoint2] ||
+	    (opcode & 0x0f000000) != 0x0a000000 || (opcode >> 28) == 0xf)
+	{
+		return 0;
+	}
+	offset = (uint32_t) ((int32_t) (opcode << 8) >> 6);
+	if (((block_lastpc + 8 + offset) & arm.r15_mask) != block_startpc) {
+		return 0;
+	}
+
+	for (n = 0; n < len; n++) {
+		const uint32_t op = code[(block_startpc >> 2) + n];
+
+		if ((op >> 28) != 0xe) {
+			return 0;
+		}
+		reads[n] = 1u << ((op >> 16) & 0xf);
+		writes[n] = 1u << ((op >> 12) & 0xf);
+		if ((op & 0x0c000000) == 0 && (op & 0x02000090) != 0x90 &&
+		    (op & 0x01900000) != 0x01000000)
+		{
+			// Data processing
+			if (((op >> 21) & 0xd) == 0xd) {
+				reads[n] = 0; // MOV, MVN
+			}
+			if (!(op & 0x2000000)) {
+				reads[n] |= 1u << (op & 0xf);
+				if (op & 0x10) {
+					reads[n] |= 1u << ((op >> 8) & 0xf);
+				}
+			}
+			if (((op >> 21) & 0xc) == 0x8) {
+				writes[n] = 0; // TST, TEQ, CMP, CMN
+			}
+			if (flags_read(op) & ~flags) {
+				return 0;
+			}
+			flags |= flags_written(op);
+		} else if ((op & 0x0c000000) == 0x04000000 && (op & 0x01300000) == 0x01100000) {
+			// LDR, LDRB with offset and no writeback
+			if (op & 0x2000000) {
+				if ((op & 0x10) || ((op & 0xff0) == 0x060 && !(flags & CFLAG))) {
+					return 0;
+				}
+				reads[n] |= 1u << (op & 0xf);
+			}
+		} else if ((op & 0x0f300090) == 0x01100090 && (op & 0x60)) {
+			// LDRH, LDRSB, LDRSH with offset and no writeback
+			if (!(op & 0x400000)) {
+				reads[n] |= 1u << (op & 0xf);
+			}
+		} else {
+			return 0;
+		}
+		loop_writes |= writes[n];
+	}
+
+	// Every register read must hold the same value each time round,
+	// either untouched by the loop or written before being read
+	for (n = 0; n < len; n++) {
+		if (reads[n] & loop_writes & ~defined) {
+			return 0;
+		}
+		defined |= writes[n];
+	}
+
+	// The branch condition alone, as if it were MOV R0,R0
+	return !(flags_read((opcode & 0xf0000000) | 0x01a00000) & ~flags);
+}
+
+/**
+ * Generate code for a function return to jump straight to the block predicted
+ * by the return stack, when the ARM PC in %eax matches the top entry. Falls
+ * through otherwise.
+ */
+static void
+gen_return_predict(void)
+{
+	int miss[3];
+	int c;
+
+	addbyte(0x8b); addbyte(0x0d); addrip(&return_top); // MOV return_top(%rip),%ecx
+	addbyte(0x48); addbyte(0x8d); addbyte(0x15); addrip(return_stack); // LEA return_stack(%rip),%rdx
+	addbyte(0x3b); addbyte(0x04); addbyte(0xca); // CMP (%rdx,%rcx,8),%eax
+	miss[0] = gen_x86_jump_forward(CC_NE);
+
+	// Pop the entry, and check its block is still for this address
+	addbyte(0x8b); addbyte(0x54); addbyte(0xca); addbyte(4); // MOV 4(%rdx,%rcx,8),%edx
+	addbyte(0x83); addbyte(0xe9); addbyte(1); // SUB $1,%ecx
+	addbyte(0x83); addbyte(0xe1); addbyte(RETURN_STACK_SIZE - 1); // AND $(RETURN_STACK_SIZE - 1),%ecx
+	addbyte(0x89); addbyte(0x0d); addrip(&return_top); // MOV %ecx,return_top(%rip)
+	addbyte(0x81); addbyte(0xfa); addlong(BLOCKS); // CMP $BLOCKS,%edx - also catches -1
+	miss[1] = gen_x86_jump_forward(CC_NC);
+	addbyte(0x48); addbyte(0x8d); addbyte(0x0d); addrip(blocks); // LEA blocks(%rip),%rcx
+	addbyte(0x3b); addbyte(0x04); addbyte(0x91); // CMP (%rcx,%rdx,4),%eax
+	miss[2] = gen_x86_jump_forward(CC_NE);
+
+	addbyte(0x48); addbyte(0x83); addbyte(0x05); addrip_byte(&return_predicted, 1); // ADDQ $1,return_predicted(%rip)
+	addbyte(0x48); addbyte(0x8d); addbyte(0x0d); addrip(rcodeblock); // LEA rcodeblock(%rip),%rcx
+	addbyte(0x48); addbyte(0x8b); addbyte(0x14); addbyte(0xd1); // MOV (%rcx,%rdx,8),%rdx
+	addbyte(0x48); addbyte(0x83); addbyte(0xc2); addbyte(block_enter); // ADD $block_enter,%rdx
+	addbyte(0xff); addbyte(0xe2); // JMP *%rdx
+
+	for (c = 0; c < 3; c++) {
+		gen_x86_jump_here(miss[c]);
+	}
+	addbyte(0x48); addbyte(0x83); addbyte(0x05); addrip_byte(&return_mispredicted, 1); // ADDQ $1,return_mispredicted(%rip)
+}
+
+/**
+ * Generate an exit from the middle of a block, for a conditional branch that
+ * was not taken when the block was generated. The ARM PC must already have
+ * been advanced to the branch target, apart from pcinc.
+ *
+ * @param target ARM address of the branch target
+ */
+static void
+gen_side_exit(uint32_t target)
+{
+	if (pcinc != 0) {
+		addbyte(0x41); addbyte(0x83); addbyte(0xc4); addbyte(pcinc); // ADD $pcinc,%r12d
+	}
+
+	addbyte(0x83); addbyte(0x2d); addrip_byte(&linecyc, 1); // SUBL $1,linecyc(%rip)
+	gen_x86_jump(CC_S, 0);
+
+	addbyte(0x41); addbyte(0xf7); addbyte(0x47); addbyte(offsetof(ARMState, event)); addlong(0xff); // TESTL $0xff,arm.event
+	gen_x86_jump(CC_NZ, 0);
+
+	// %r12d has caught up, so is R15
+	addbyte(0x44); addbyte(0x89); addbyte(0xe0); // MOV %r12d,%eax
+	addbyte(0x83); addbyte(0xe8); addbyte(8); // SUB $8,%eax
+	addbyte(0x25); addlong(arm.r15_mask); // AND $arm.r15_mask,%eax
+
+	// The rest of the block may already have run if it loops back to
+	// itself, so write back everything it modifies
+	gen_writeback_regs(pinned_dirty | block_writes);
+	gen_block_link(block_links++, target);
+
+	// Unlinked, so leave through the epilogue and let arm_exec() find
+	// the next block
+	gen_x86_jump(CC_ALWAYS, 0);
+}
+
+/**
+ * Finish the taken path of a branch. A conditional branch that was not taken
+ * when the block was generated gets a side exit, so that the block continues
+ * with the following instruction; otherwise the block ends here. The compile
+ * thread cannot see the flags, so treats every conditional branch as not
+ * taken.
+ *
+ * @param opcode Opcode of branch
+ * @param pcpsr  Pointer to the flags at the time the block was generated
+ * @param target ARM address of the branch target
+ */
+static void
+gen_branch_taken(uint32_t opcode, const uint32_t *pcpsr, uint32_t target)
+{
+	const int taken = block_background ? (opcode >> 28) == 0xe :
+	                  flaglookup[opcode >> 28][(*pcpsr) >> 28];
+
+	if (!taken && block_links < BLOCK_SIDE_EXITS && codeblockpos < 1200) {
+		gen_side_exit(target & arm.r15_mask);
+	} else {
+		*block_end = 1;
+	}
+}
+
+#ifdef FPA
+/**
+ * Generate LDF or STF of a single or double precision value, in the same way
+ * as fpaopcode(). Doubles are held in memory with the high word first.
+ *
+ * @param opcode Opcode of instruction being emulated
+ */
+static void
+gen_fpa_transfer(uint32_t opcode)
+{
+	const uint32_t offset = (opcode & 0xff) << 2;
+	const uint8_t op = (opcode & (1u << 23)) ? X86_OP_ADD : X86_OP_SUB;
+	double *fd = &fparegs[FD];
+
+	gen_load_reg(RN, EBX);
+	if (RN == 15) {
+		addbyte(0x81); addbyte(0xe3); addlong(arm.r15_mask); // AND $arm.r15_mask,%ebx
+	}
+	if ((opcode & (1u << 24)) && offset != 0) {
+		// Pre-indexed
+		addbyte(0x81); addbyte(0xc3 | op); addlong(offset); // ADD/SUB $offset,%ebx
+	}
+
+	if (opcode & (1u << 20)) {
+		// LDF
+		if (opcode & 0x8000) {
+			genldr();
+			addbyte(0x89); addbyte(0x05); addrip((uint32_t *) fd + 1); // MOV %eax,Fd.hi(%rip)
+			addbyte(0x83); addbyte(0xc3); addbyte(4); // ADD $4,%ebx
+			genldr();
+			addbyte(0x89); addbyte(0x05); addrip(fd); // MOV %eax,Fd.lo(%rip)
+			addbyte(0x83); addbyte(0xeb); addbyte(4); // SUB $4,%ebx
+		} else {
+			genldr();
+			addbyte(0x66); addbyte(0x0f); addbyte(0x6e); addbyte(0xc0); // MOVD %eax,%xmm0
+			addbyte(0xf3); addbyte(0x0f); addbyte(0x5a); addbyte(0xc0); // CVTSS2SD %xmm0,%xmm0
+			addbyte(0xf2); addbyte(0x0f); addbyte(0x11); addbyte(0x05); addrip(fd); // MOVSD %xmm0,Fd(%rip)
+		}
+	} else {
+		// STF
+		if (opcode & 0x8000) {
+			addbyte(0x8b); addbyte(0x35); addrip((uint32_t *) fd + 1); // MOV Fd.hi(%rip),%esi
+			genstr();
+			addbyte(0x83); addbyte(0xc3); addbyte(4); // ADD $4,%ebx
+			addbyte(0x8b); addbyte(0x35); addrip(fd); // MOV Fd.lo(%rip),%esi
+			genstr();
+			addbyte(0x83); addbyte(0xeb); addbyte(4); // SUB $4,%ebx
+		} else {
+			addbyte(0xf2); addbyte(0x0f); addbyte(0x5a); addbyte(0x05); addrip(fd); // CVTSD2SS Fd(%rip),%xmm0
+			addbyte(0x66); addbyte(0x0f); addbyte(0x7e); addbyte(0xc6); // MOVD %xmm0,%esi
+			genstr();
+		}
+	}
+
+	if (opcode & (1u << 21)) {
+		// Writeback
+		if (opcode & (1u << 24)) {
+			gen_save_reg(RN, EBX);
+		} else if (offset != 0) {
+			gen_op_imm_to_reg(op, RN, offset);
+		}
+	}
+	if (!arm.abort_base_restored) {
+		gen_test_armirq();
+	}
+}
+
+/**
+ * Generate an FPA data operation, in double precision as fpaopcode() does.
+ *
+ * @param opcode Opcode of instruction being emulated
+ */
+static void
+gen_fpa_data(uint32_t opcode)
+{
+	const double *fm = (opcode & 8) ? &fconstants[opcode & 7] : &fparegs[opcode & 7];
+	uint8_t op;
+
+	switch (opcode & 0xf08000) {
+	case 0x008000: // MVF
+	case 0x108000: // MNF
+	case 0x208000: // ABS
+		addbyte(0x48); addbyte(0x8b); addbyte(0x05); addrip(fm); // MOV Fm(%rip),%rax
+		if ((opcode & 0xf08000) == 0x108000) {
+			addbyte(0x48); addbyte(0x0f); addbyte(0xba); addbyte(0xf8); addbyte(63); // BTC $63,%rax
+		} else if ((opcode & 0xf08000) == 0x208000) {
+			addbyte(0x48); addbyte(0x0f); addbyte(0xba); addbyte(0xf0); addbyte(63); // BTR $63,%rax
+		}
+		addbyte(0x48); addbyte(0x89); addbyte(0x05); addrip(&fparegs[FD]); // MOV %rax,Fd(%rip)
+		return;
+
+	case 0x408000: // SQT
+		addbyte(0xf2); addbyte(0x0f); addbyte(0x51); addbyte(0x05); addrip(fm); // SQRTSD Fm(%rip),%xmm0
+		break;
+
+	case 0x300000: // RSF
+		addbyte(0xf2); addbyte(0x0f); addbyte(0x10); addbyte(0x05); addrip(fm); // MOVSD Fm(%rip),%xmm0
+		addbyte(0xf2); addbyte(0x0f); addbyte(0x5c); addbyte(0x05); addrip(&fparegs[FN]); // SUBSD Fn(%rip),%xmm0
+		break;
+
+	default: // ADF, MUF, SUF, DVF, FML, FDV
+		switch (opcode & 0xf00000) {
+		case 0x000000: op = 0x58; break; // ADDSD
+		case 0x200000: op = 0x5c; break; // SUBSD
+		case 0x400000: case 0xa00000: op = 0x5e; break; // DIVSD
+		default: op = 0x59; break; // MULSD
+		}
+		addbyte(0xf2); addbyte(0x0f); addbyte(0x10); addbyte(0x05); addrip(&fparegs[FN]); // MOVSD Fn(%rip),%xmm0
+		addbyte(0xf2); addbyte(0x0f); addbyte(op); addbyte(0x05); addrip(fm); // OPSD Fm(%rip),%xmm0
+		break;
+	}
+	addbyte(0xf2); addbyte(0x0f); addbyte(0x11); addbyte(0x05); addrip(&fparegs[FD]); // MOVSD %xmm0,Fd(%rip)
+}
+
+/**
+ * Generate CMF or CNF, setting the flags as setsubf() does. An unordered
+ * comparison clears all four flags.
+ *
+ * @param opcode Opcode of instruction being emulated
+ * @param pcpsr  Pointer to the PSR holding the flags
+ */
+static void
+gen_fpa_compare(uint32_t opcode, const uint32_t *pcpsr)
+{
+	const double *fm = (opcode & 8) ? &fconstants[opcode & 7] : &fparegs[opcode & 7];
+
+	addbyte(0xf2); addbyte(0x0f); addbyte(0x10); addbyte(0x05); addrip(&fparegs[FN]); // MOVSD Fn(%rip),%xmm0
+	if (opcode & 0x200000) {
+		// CNF
+		addbyte(0x48); addbyte(0x8b); addbyte(0x05); addrip(fm); // MOV Fm(%rip),%rax
+		addbyte(0x48); addbyte(0x0f); addbyte(0xba); addbyte(0xf8); addbyte(63); // BTC $63,%rax
+		addbyte(0x66); addbyte(0x48); addbyte(0x0f); addbyte(0x6e); addbyte(0xc8); // MOVQ %rax,%xmm1
+	} else {
+		addbyte(0xf2); addbyte(0x0f); addbyte(0x10); addbyte(0x0d); addrip(fm); // MOVSD Fm(%rip),%xmm1
+	}
+	addbyte(0x31); addbyte(0xc0); // XOR %eax,%eax
+	addbyte(0x31); addbyte(0xc9); // XOR %ecx,%ecx
+	addbyte(0x31); addbyte(0xd2); // XOR %edx,%edx
+	addbyte(0x66); addbyte(0x0f); addbyte(0x2e); addbyte(0xc1); // UCOMISD %xmm1,%xmm0
+	addbyte(0x0f); addbyte(0x93); addbyte(0xc0); // SETAE %al - C
+	addbyte(0x0f); addbyte(0x94); addbyte(0xc2); // SETE %dl
+	addbyte(0x0f); addbyte(0x9b); addbyte(0xc1); // SETNP %cl
+	addbyte(0x21); addbyte(0xca); // AND %ecx,%edx - Z
+	addbyte(0x66); addbyte(0x0f); addbyte(0x2e); addbyte(0xc8); // UCOMISD %xmm0,%xmm1
+	addbyte(0x0f); addbyte(0x97); addbyte(0xc1); // SETA %cl - N
+	addbyte(0xc1); addbyte(0xe0); addbyte(29); // SHL $29,%eax
+	addbyte(0xc1); addbyte(0xe2); addbyte(30); // SHL $30,%edx
+	addbyte(0xc1); addbyte(0xe1); addbyte(31); // SHL $31,%ecx
+	addbyte(0x09); addbyte(0xd0); // OR %edx,%eax
+	addbyte(0x09); addbyte(0xc8); // OR %ecx,%eax
+	gen_flags_merge(NFLAG | ZFLAG | CFLAG | VFLAG, pcpsr);
+}
+
+/**
+ * Generate an FPA instruction accepted by codegen_fpa_inline().
+ *
+ * @param opcode Opcode of instruction being emulated
+ * @param pcpsr  Pointer to the PSR holding the flags
+ */
+static void
+gen_fpa(uint32_t opcode, const uint32_t *pcpsr)
+{
+	if ((opcode & 0x0e000000) == 0x0c000000) {
+		gen_fpa_transfer(opcode);
+	} else if (!(opcode & 0x10)) {
+		gen_fpa_data(opcode);
+	} else if (RD == 15) {
+		gen_fpa_compare(opcode, pcpsr);
+	} else if (opcode & 0x100000) {
+		// FIX
+		addbyte(0xf2); addbyte(0x0f); addbyte(0x2c); addbyte(0x05); addrip(&fparegs[opcode & 7]); // CVTTSD2SI Fm(%rip),%eax
+		gen_save_reg(RD, EAX);
+	} else {
+		// FLT
+		gen_load_reg(RD, EAX);
+		addbyte(0xf2); addbyte(0x0f); addbyte(0x2a); addbyte(0xc0); // CVTSI2SD %eax,%xmm0
+		addbyte(0xf2); addbyte(0x0f); addbyte(0x11); addbyte(0x05); addrip(&fparegs[FN]); // MOVSD %xmm0,Fn(%rip)
+	}
 }
+#endif
 
 static int
 recompile(uint32_t opcode, uint32_t *pcpsr)
@@ -774,16 +3320,44 @@ recompile(uint32_t opcode, uint32_t *pcpsr)
 	uint32_t rhs;
 	uint32_t offset;
 
-	NOT_USED(pcpsr);
+#ifdef FPA
+	if ((opcode & 0x0c000000) == 0x0c000000) {
+		if (!codegen_fpa_inline(opcode)) {
+			return 0;
+		}
+		gen_fpa(opcode, pcpsr);
+		lastrecompiled = 1;
+		if (lastjumppos != 0) {
+			gen_x86_jump_here_long(lastjumppos);
+		}
+		return 1;
+	}
+#endif
 
-	if (arm.arch_v4) {
-		if ((opcode & 0xe0000f0) == 0xb0) {
-			// LDRH/STRH
+	if (arm.arch_v4 && ((opcode & 0xe0000f0) == 0xb0 ||
+	    (opcode & 0xe1000d0) == 0x1000d0))
+	{
+		// LDRH/STRH, LDRSB/LDRSH
+		if (!gen_halfword_transfer(opcode)) {
 			return 0;
-		} else if ((opcode & 0xe1000d0) == 0x1000d0) {
-			// LDRSB/LDRSH
+		}
+		lastrecompiled = 1;
+		if (lastjumppos != 0) {
+			gen_x86_jump_here_long(lastjumppos);
+		}
+		return 1;
+	}
+
+	if ((opcode & 0x0c100000) == 0x00100000) {
+		// Data processing setting the flags
+		if (!recompile_flags(opcode, pcpsr)) {
 			return 0;
 		}
+		lastrecompiled = 1;
+		if (lastjumppos != 0) {
+			gen_x86_jump_here_long(lastjumppos);
+		}
+		return 1;
 	}
 
 	switch ((opcode >> 20) & 0xff) {
@@ -791,10 +3365,14 @@ recompile(uint32_t opcode, uint32_t *pcpsr)
 		if ((opcode & 0xf0) == 0x90) {
 			// MUL
 			if (MULRD == MULRM) {
-				return 0;
+				if (MULRD == 15) {
+					return 0;
+				}
+				genstoreimm(MULRD, 0);
+				break;
 			}
 			gen_load_reg(MULRM, EAX);
-			addbyte(0x41); addbyte(0xf7); addbyte(0x67); addbyte(MULRS<<2); // MULL Rs
+			gen_mul_reg(MULRS, 0);
 			gen_save_reg(MULRD, EAX);
 			break;
 		}
@@ -809,11 +3387,15 @@ recompile(uint32_t opcode, uint32_t *pcpsr)
 		if ((opcode & 0xf0) == 0x90) {
 			// MLA
 			if (MULRD == MULRM) {
-				return 0;
+				if (MULRD == 15) {
+					return 0;
+				}
+				genstoreimm(MULRD, 0);
+				break;
 			}
 			gen_load_reg(MULRM, EAX);
-			addbyte(0x41); addbyte(0xf7); addbyte(0x67); addbyte(MULRS<<2); // MULL Rs
-			addbyte(0x41); addbyte(0x03); addbyte(0x47); addbyte(MULRN<<2); // ADD Rn,%eax
+			gen_mul_reg(MULRS, 0);
+			gen_op_reg(X86_OP_ADD, MULRN, EAX);
 			gen_save_reg(MULRD, EAX);
 			break;
 		}
@@ -835,10 +3417,9 @@ recompile(uint32_t opcode, uint32_t *pcpsr)
 	case 0x08: // ADD reg
 		if (arm.arch_v4 && (opcode & 0xf0) == 0x90) {
 			// UMULL
-			gen_load_reg(MULRM, EAX);
-			addbyte(0x41); addbyte(0xf7); addbyte(0x67); addbyte(MULRS<<2); // MULL Rs
-			gen_save_reg(MULRN, EAX);
-			gen_save_reg(MULRD, EDX);
+			if (!gen_mul_long(opcode)) {
+				return 0;
+			}
 			break;
 		}
 		if (RD == 15) return 0;
@@ -849,14 +3430,47 @@ recompile(uint32_t opcode, uint32_t *pcpsr)
 		break;
 
 	case 0x0a: // ADC reg
-		// Currently not used
-		if (RD == 15) return 0;
-		if (!generate_shift(opcode)) {
+	case 0x0c: // SBC reg
+	case 0x0e: // RSC reg
+		if (arm.arch_v4 && (opcode & 0xf0) == 0x90) {
+			// UMLAL, SMULL, SMLAL
+			if (!gen_mul_long(opcode)) {
+				return 0;
+			}
+			break;
+		}
+		return 0;
+
+	case 0x10: // SWP
+	case 0x14: // SWPB
+		if ((opcode & 0xff0) != 0x90) {
+			// MRS
 			return 0;
 		}
-		gen_load_reg(15, ECX);
-		addbyte(0xc1); addbyte(0xe1); addbyte(3); // SHL $3,%ecx - puts ARM carry into x64 carry
-		gen_data_proc_reg(opcode, X86_OP_ADC, 0);
+		if (RD == 15 || RN == 15 || RM == 15) {
+			return 0;
+		}
+		gen_load_reg(RN, EBX);
+		if (opcode & 0x400000) {
+			genldrb();
+		} else {
+			genldr();
+		}
+		if (!arm.abort_base_restored) {
+			gen_test_armirq();
+		}
+		gen_x86_mov_reg32_stack(EAX, 0);
+		gen_load_reg(RM, ESI);
+		if (opcode & 0x400000) {
+			genstrb();
+		} else {
+			genstr();
+		}
+		if (!arm.abort_base_restored) {
+			gen_test_armirq();
+		}
+		gen_x86_mov_stack_reg32(EAX, 0);
+		gen_save_reg(RD, EAX);
 		break;
 
 	case 0x18: // ORR reg
@@ -869,6 +3483,10 @@ recompile(uint32_t opcode, uint32_t *pcpsr)
 
 	case 0x1a: // MOV reg
 		if (RD == 15) return 0;
+		if ((opcode & 0xff0) == 0 && const_known(RM)) {
+			gen_const_result(opcode, const_val[RM]);
+			break;
+		}
 		if (!generate_shift(opcode)) {
 			return 0;
 		}
@@ -896,25 +3514,41 @@ recompile(uint32_t opcode, uint32_t *pcpsr)
 	case 0x20: // AND imm
 		if (RD == 15) return 0;
 		rhs = arm_imm(opcode);
-		gen_data_proc_imm(opcode, X86_OP_AND, rhs);
+		if (const_known(RN)) {
+			gen_const_result(opcode, const_val[RN] & rhs);
+		} else {
+			gen_data_proc_imm(opcode, X86_OP_AND, rhs);
+		}
 		break;
 
 	case 0x22: // EOR imm
 		if (RD == 15) return 0;
 		rhs = arm_imm(opcode);
-		gen_data_proc_imm(opcode, X86_OP_XOR, rhs);
+		if (const_known(RN)) {
+			gen_const_result(opcode, const_val[RN] ^ rhs);
+		} else {
+			gen_data_proc_imm(opcode, X86_OP_XOR, rhs);
+		}
 		break;
 
 	case 0x24: // SUB imm
 		if (RD == 15) return 0;
 		rhs = arm_imm(opcode);
-		gen_data_proc_imm(opcode, X86_OP_SUB, rhs);
+		if (const_known(RN)) {
+			gen_const_result(opcode, const_val[RN] - rhs);
+		} else {
+			gen_data_proc_imm(opcode, X86_OP_SUB, rhs);
+		}
 		break;
 
 	case 0x28: // ADD imm
 		if (RD == 15) return 0;
 		rhs = arm_imm(opcode);
-		gen_data_proc_imm(opcode, X86_OP_ADD, rhs);
+		if (const_known(RN)) {
+			gen_const_result(opcode, const_val[RN] + rhs);
+		} else {
+			gen_data_proc_imm(opcode, X86_OP_ADD, rhs);
+		}
 		break;
 
 	case 0x2a: // ADC imm
@@ -929,25 +3563,33 @@ recompile(uint32_t opcode, uint32_t *pcpsr)
 	case 0x38: // ORR imm
 		if (RD == 15) return 0;
 		rhs = arm_imm(opcode);
-		gen_data_proc_imm(opcode, X86_OP_OR, rhs);
+		if (const_known(RN)) {
+			gen_const_result(opcode, const_val[RN] | rhs);
+		} else {
+			gen_data_proc_imm(opcode, X86_OP_OR, rhs);
+		}
 		break;
 
 	case 0x3a: // MOV imm
 		if (RD == 15) return 0;
 		rhs = arm_imm(opcode);
-		genstoreimm(RD, rhs);
+		gen_const_result(opcode, rhs);
 		break;
 
 	case 0x3c: // BIC imm
 		if (RD == 15) return 0;
 		rhs = ~arm_imm(opcode);
-		gen_data_proc_imm(opcode, X86_OP_AND, rhs);
+		if (const_known(RN)) {
+			gen_const_result(opcode, const_val[RN] & rhs);
+		} else {
+			gen_data_proc_imm(opcode, X86_OP_AND, rhs);
+		}
 		break;
 
 	case 0x3e: // MVN imm
 		if (RD == 15) return 0;
 		rhs = ~arm_imm(opcode);
-		genstoreimm(RD, rhs);
+		gen_const_result(opcode, rhs);
 		break;
 
 	case 0x40: // STR Rd, [Rn], #-imm
@@ -969,20 +3611,14 @@ recompile(uint32_t opcode, uint32_t *pcpsr)
 		if (opcode & 0x2000000) {
 			gen_x86_mov_stack_reg32(EAX, 0);
 			if (opcode & 0x800000) {
-				addbyte(0x41); addbyte(0x01); addbyte(0x47); addbyte(RN<<2); // ADD %eax,Rn
+				gen_op_to_reg(X86_OP_ADD, EAX, RN);
 			} else {
-				addbyte(0x41); addbyte(0x29); addbyte(0x47); addbyte(RN<<2); // SUB %eax,Rn
+				gen_op_to_reg(X86_OP_SUB, EAX, RN);
 			}
 		} else {
 			offset = opcode & 0xfff;
 			if (offset != 0) {
-				addbyte(0x41); addbyte(0x81); // ADDL/SUBL $offset,Rn
-				if (opcode & 0x800000) {
-					addbyte(0x47); // ADD
-				} else {
-					addbyte(0x6f); // SUB
-				}
-				addbyte(RN<<2); addlong(offset);
+				gen_op_imm_to_reg((opcode & 0x800000) ? X86_OP_ADD : X86_OP_SUB, RN, offset);
 			}
 		}
 		if (!arm.abort_base_restored) {
@@ -1009,20 +3645,14 @@ recompile(uint32_t opcode, uint32_t *pcpsr)
 		if (opcode & 0x2000000) {
 			gen_x86_mov_stack_reg32(EAX, 0);
 			if (opcode & 0x800000) {
-				addbyte(0x41); addbyte(0x01); addbyte(0x47); addbyte(RN<<2); // ADD %eax,Rn
+				gen_op_to_reg(X86_OP_ADD, EAX, RN);
 			} else {
-				addbyte(0x41); addbyte(0x29); addbyte(0x47); addbyte(RN<<2); // SUB %eax,Rn
+				gen_op_to_reg(X86_OP_SUB, EAX, RN);
 			}
 		} else {
 			offset = opcode & 0xfff;
 			if (offset != 0) {
-				addbyte(0x41); addbyte(0x81); // ADDL/SUBL $offset,Rn
-				if (opcode & 0x800000) {
-					addbyte(0x47); // ADD
-				} else {
-					addbyte(0x6f); // SUB
-				}
-				addbyte(RN<<2); addlong(offset);
+				gen_op_imm_to_reg((opcode & 0x800000) ? X86_OP_ADD : X86_OP_SUB, RN, offset);
 			}
 		}
 		if (!arm.abort_base_restored) {
@@ -1048,20 +3678,14 @@ recompile(uint32_t opcode, uint32_t *pcpsr)
 		if (opcode & 0x2000000) {
 			gen_x86_mov_stack_reg32(EDX, 0);
 			if (opcode & 0x800000) {
-				addbyte(0x41); addbyte(0x01); addbyte(0x57); addbyte(RN<<2); // ADD %edx,Rn
+				gen_op_to_reg(X86_OP_ADD, EDX, RN);
 			} else {
-				addbyte(0x41); addbyte(0x29); addbyte(0x57); addbyte(RN<<2); // SUB %edx,Rn
+				gen_op_to_reg(X86_OP_SUB, EDX, RN);
 			}
 		} else {
 			offset = opcode & 0xfff;
 			if (offset != 0) {
-				addbyte(0x41); addbyte(0x81); // ADDL/SUBL $offset,Rn
-				if (opcode & 0x800000) {
-					addbyte(0x47); // ADD
-				} else {
-					addbyte(0x6f); // SUB
-				}
-				addbyte(RN<<2); addlong(offset);
+				gen_op_imm_to_reg((opcode & 0x800000) ? X86_OP_ADD : X86_OP_SUB, RN, offset);
 			}
 		}
 		if (!arm.abort_base_restored) {
@@ -1088,20 +3712,14 @@ recompile(uint32_t opcode, uint32_t *pcpsr)
 		if (opcode & 0x2000000) {
 			gen_x86_mov_stack_reg32(EDX, 0);
 			if (opcode & 0x800000) {
-				addbyte(0x41); addbyte(0x01); addbyte(0x57); addbyte(RN<<2); // ADD %edx,Rn
+				gen_op_to_reg(X86_OP_ADD, EDX, RN);
 			} else {
-				addbyte(0x41); addbyte(0x29); addbyte(0x57); addbyte(RN<<2); // SUB %edx,Rn
+				gen_op_to_reg(X86_OP_SUB, EDX, RN);
 			}
 		} else {
 			offset = opcode & 0xfff;
 			if (offset != 0) {
-				addbyte(0x41); addbyte(0x81); // ADDL/SUBL $offset,Rn
-				if (opcode & 0x800000) {
-					addbyte(0x47); // ADD
-				} else {
-					addbyte(0x6f); // SUB
-				}
-				addbyte(RN<<2); addlong(offset);
+				gen_op_imm_to_reg((opcode & 0x800000) ? X86_OP_ADD : X86_OP_SUB, RN, offset);
 			}
 		}
 		if (!arm.abort_base_restored) {
@@ -1121,21 +3739,23 @@ recompile(uint32_t opcode, uint32_t *pcpsr)
 		if (RD == 15) {
 			return 0;
 		}
-		if (opcode & 0x2000000) {
-			if (!generate_shift(opcode)) {
-				return 0;
+		if (!gen_const_addr(opcode)) {
+			if (opcode & 0x2000000) {
+				if (!generate_shift(opcode)) {
+					return 0;
+				}
+			} else {
+				addbyte(0xb8); addlong(opcode & 0xfff); // MOV $(opcode & 0xfff),%eax
+			}
+			gen_load_reg(RN, EBX);
+			if (RN == 15) {
+				addbyte(0x81); addbyte(0xe3); addlong(arm.r15_mask); // AND $arm.r15_mask,%ebx
+			}
+			if (opcode & 0x800000) {
+				addbyte(0x01); addbyte(0xc3); // ADD %eax,%ebx
+			} else {
+				addbyte(0x29); addbyte(0xc3); // SUB %eax,%ebx
 			}
-		} else {
-			addbyte(0xb8); addlong(opcode & 0xfff); // MOV $(opcode & 0xfff),%eax
-		}
-		gen_load_reg(RN, EBX);
-		if (RN == 15) {
-			addbyte(0x81); addbyte(0xe3); addlong(arm.r15_mask); // AND $arm.r15_mask,%ebx
-		}
-		if (opcode & 0x800000) {
-			addbyte(0x01); addbyte(0xc3); // ADD %eax,%ebx
-		} else {
-			addbyte(0x29); addbyte(0xc3); // SUB %eax,%ebx
 		}
 		gen_load_reg(RD, ESI);
 		genstr();
@@ -1159,21 +3779,23 @@ recompile(uint32_t opcode, uint32_t *pcpsr)
 		if (RD == 15) {
 			return 0;
 		}
-		if (opcode & 0x2000000) {
-			if (!generate_shift(opcode)) {
-				return 0;
+		if (!gen_const_addr(opcode)) {
+			if (opcode & 0x2000000) {
+				if (!generate_shift(opcode)) {
+					return 0;
+				}
+			} else {
+				addbyte(0xb8); addlong(opcode & 0xfff); // MOV $(opcode & 0xfff),%eax
+			}
+			gen_load_reg(RN, EBX);
+			if (RN == 15) {
+				addbyte(0x81); addbyte(0xe3); addlong(arm.r15_mask); // AND $arm.r15_mask,%ebx
+			}
+			if (opcode & 0x800000) {
+				addbyte(0x01); addbyte(0xc3); // ADD %eax,%ebx
+			} else {
+				addbyte(0x29); addbyte(0xc3); // SUB %eax,%ebx
 			}
-		} else {
-			addbyte(0xb8); addlong(opcode & 0xfff); // MOV $(opcode & 0xfff),%eax
-		}
-		gen_load_reg(RN, EBX);
-		if (RN == 15) {
-			addbyte(0x81); addbyte(0xe3); addlong(arm.r15_mask); // AND $arm.r15_mask,%ebx
-		}
-		if (opcode & 0x800000) {
-			addbyte(0x01); addbyte(0xc3); // ADD %eax,%ebx
-		} else {
-			addbyte(0x29); addbyte(0xc3); // SUB %eax,%ebx
 		}
 		gen_load_reg(RD, ESI);
 		genstrb();
@@ -1197,21 +3819,23 @@ recompile(uint32_t opcode, uint32_t *pcpsr)
 		if (RD == 15) {
 			return 0;
 		}
-		if (opcode & 0x2000000) {
-			if (!generate_shift(opcode)) {
-				return 0;
+		if (!gen_const_addr(opcode)) {
+			if (opcode & 0x2000000) {
+				if (!generate_shift(opcode)) {
+					return 0;
+				}
+			} else {
+				addbyte(0xb8); addlong(opcode & 0xfff); // MOV $(opcode & 0xfff),%eax
+			}
+			gen_load_reg(RN, EBX);
+			if (RN == 15) {
+				addbyte(0x81); addbyte(0xe3); addlong(arm.r15_mask); // AND $arm.r15_mask,%ebx
+			}
+			if (opcode & 0x800000) {
+				addbyte(0x01); addbyte(0xc3); // ADD %eax,%ebx
+			} else {
+				addbyte(0x29); addbyte(0xc3); // SUB %eax,%ebx
 			}
-		} else {
-			addbyte(0xb8); addlong(opcode & 0xfff); // MOV $(opcode & 0xfff),%eax
-		}
-		gen_load_reg(RN, EBX);
-		if (RN == 15) {
-			addbyte(0x81); addbyte(0xe3); addlong(arm.r15_mask); // AND $arm.r15_mask,%ebx
-		}
-		if (opcode & 0x800000) {
-			addbyte(0x01); addbyte(0xc3); // ADD %eax,%ebx
-		} else {
-			addbyte(0x29); addbyte(0xc3); // SUB %eax,%ebx
 		}
 		genldr();
 		if (opcode & 0x200000) {
@@ -1235,21 +3859,23 @@ recompile(uint32_t opcode, uint32_t *pcpsr)
 		if (RD == 15) {
 			return 0;
 		}
-		if (opcode & 0x2000000) {
-			if (!generate_shift(opcode)) {
-				return 0;
+		if (!gen_const_addr(opcode)) {
+			if (opcode & 0x2000000) {
+				if (!generate_shift(opcode)) {
+					return 0;
+				}
+			} else {
+				addbyte(0xb8); addlong(opcode & 0xfff); // MOV $(opcode & 0xfff),%eax
+			}
+			gen_load_reg(RN, EBX);
+			if (RN == 15) {
+				addbyte(0x81); addbyte(0xe3); addlong(arm.r15_mask); // AND $arm.r15_mask,%ebx
+			}
+			if (opcode & 0x800000) {
+				addbyte(0x01); addbyte(0xc3); // ADD %eax,%ebx
+			} else {
+				addbyte(0x29); addbyte(0xc3); // SUB %eax,%ebx
 			}
-		} else {
-			addbyte(0xb8); addlong(opcode & 0xfff); // MOV $(opcode & 0xfff),%eax
-		}
-		gen_load_reg(RN, EBX);
-		if (RN == 15) {
-			addbyte(0x81); addbyte(0xe3); addlong(arm.r15_mask); // AND $arm.r15_mask,%ebx
-		}
-		if (opcode & 0x800000) {
-			addbyte(0x01); addbyte(0xc3); // ADD %eax,%ebx
-		} else {
-			addbyte(0x29); addbyte(0xc3); // SUB %eax,%ebx
 		}
 		genldrb();
 		if (opcode & 0x200000) {
@@ -1317,7 +3943,7 @@ recompile(uint32_t opcode, uint32_t *pcpsr)
 		offset = (opcode << 8);
 		offset = (uint32_t) ((int32_t) offset >> 6);
 		offset += 4;
-		if (((PC + offset) & 0xfc000000) == 0 || arm.r15_mask == 0xfffffffc) {
+		if (((block_pc + offset) & 0xfc000000) == 0 || arm.r15_mask == 0xfffffffc) {
 			addbyte(0x41); addbyte(0x81); addbyte(0xc4); addlong(offset); // ADD $offset,%r12d
 		} else {
 			gen_load_reg(15, EAX);
@@ -1328,7 +3954,7 @@ recompile(uint32_t opcode, uint32_t *pcpsr)
 			addbyte(0x09); addbyte(0xd0); // OR %edx,%eax
 			gen_save_reg(15, EAX);
 		}
-		blockend = 1;
+		gen_branch_taken(opcode, pcpsr, block_pc + 4 + offset);
 		break;
 
 	case 0xb0: case 0xb1: case 0xb2: case 0xb3: // BL
@@ -1338,9 +3964,10 @@ recompile(uint32_t opcode, uint32_t *pcpsr)
 		offset = (opcode << 8);
 		offset = (uint32_t) ((int32_t) offset >> 6);
 		offset += 4;
+		gen_return_push((block_pc + 4) & arm.r15_mask);
 		gen_load_reg(15, EAX);
 		addbyte(0x83); addbyte(0xe8); addbyte(0x04); // SUB $4,%eax
-		if (((PC + offset) & 0xfc000000) == 0 || arm.r15_mask == 0xfffffffc) {
+		if (((block_pc + offset) & 0xfc000000) == 0 || arm.r15_mask == 0xfffffffc) {
 			addbyte(0x41); addbyte(0x81); addbyte(0xc4); addlong(offset); // ADD $offset,%r12d
 			gen_save_reg(14, EAX);
 		} else {
@@ -1353,7 +3980,7 @@ recompile(uint32_t opcode, uint32_t *pcpsr)
 			addbyte(0x09); addbyte(0xd0); // OR %edx,%eax
 			gen_save_reg(15, EAX);
 		}
-		blockend = 1;
+		gen_branch_taken(opcode, pcpsr, block_pc + 4 + offset);
 		break;
 
 	default:
@@ -1371,33 +3998,48 @@ generatecall(OpFn addr, uint32_t opcode, uint32_t *pcpsr)
 {
 	lastrecompiled = 0;
 
-	if (canrecompile[(opcode >> 20) & 0xff]) {
+	if (can_recompile(opcode)) {
 		if (recompile(opcode, pcpsr)) {
+			const_update(opcode);
 			return;
 		}
 	}
+	// The C function may change any register
+	const_valid = 0;
+	const_rd = -1;
 
 	addbyte(0xbf); addlong(opcode); // MOV $opcode,%edi
-	addbyte(0x45); addbyte(0x89); addbyte(0x67); addbyte(15<<2); // MOV %r12d,R15
-	gen_x86_call(addr);
+	gen_store_pc();
+	gen_helper_call(addr);
 	addbyte(0x45); addbyte(0x8b); addbyte(0x67); addbyte(15<<2); // MOV R15,%r12d
 
 	if (!flaglookup[opcode >> 28][(*pcpsr) >> 28] && (opcode & 0xe000000) == 0xa000000) {
 		// rpclog("Carrying on - %d\n", pcinc);
-		// generateupdatepc();
-		if (pcinc != 0) {
-			addbyte(0x41); addbyte(0x83); addbyte(0xc4); addbyte(pcinc); // ADD $pcinc,%r12d
-			// pcinc = 0;
-		}
+		addbyte(0x41); addbyte(0x83); addbyte(0xc4); addbyte(4); // ADD $4,%r12d
 		gen_x86_jump(CC_ALWAYS, 0);
 	}
+	if (pc_lag() != 0) {
+		addbyte(0x45); addbyte(0x8d); addbyte(0x64); addbyte(0x24); addbyte((uint8_t) -pc_lag()); // LEA -lag(%r12),%r12d
+	}
 	if (lastjumppos != 0) {
 		gen_x86_jump_here_long(lastjumppos);
 	}
 }
 
+/**
+ * The ARM PC is kept implicit within a block, so there is nothing to do before
+ * an instruction that uses it.
+ */
 void
 generateupdatepc(void)
+{
+}
+
+/**
+ * Generate code to catch %r12d up with the ARM PC.
+ */
+static void
+gen_update_pc(void)
 {
 	if (pcinc != 0) {
 		addbyte(0x41); addbyte(0x83); addbyte(0xc4); addbyte(pcinc); // ADD $pcinc,%r12d
@@ -1414,6 +4056,7 @@ generateupdateinscount(void)
 		} else {
 			addbyte(0x83); addbyte(0x05); addrip_byte(&inscount, (uint8_t) tempinscount); // ADDL $tempinscount,inscount(%rip)
 		}
+		addbyte(0x48); addbyte(0x81); addbyte(0x05); addrip_long(&tier_inscount[block_hot], tempinscount); // ADDQ $tempinscount,tier_inscount[block_hot](%rip)
 		tempinscount = 0;
 	}
 }
@@ -1422,22 +4065,49 @@ void
 generatepcinc(void)
 {
 	lastjumppos = 0;
+	block_pc += 4;
+	block_lastpc = block_pc;
+	blocks_end[blockpoint2] = block_pc;
+	if (!block_background) {
+		// Blocks for the compile thread are marked when published
+		code_mark(block_pc);
+	}
+	if (((block_pc ^ block_startpc) >> 12) != 0 && !block_spans[blockpoint2]) {
+		// The block has continued into the next page, so writes to
+		// either page must discard it
+		block_spans[blockpoint2] = 1;
+		codeblockspans[(block_startpc >> 12) & 0xffff] = 1;
+	}
 	tempinscount++;
 	pcinc += 4;
 	if (pcinc == 124) {
-		generateupdatepc();
+		gen_update_pc();
 	}
-	if (codeblockpos >= 1200) {
-		blockend = 1;
+	if (codeblockpos + pc_exit_stubs * PC_EXIT_STUB_SIZE >= 1200) {
+		*block_end = 1;
 	}
 }
 
 void
 endblock(uint32_t opcode)
 {
-	NOT_USED(opcode);
+	uint32_t successor[2];
+	int found[CODEBLOCK_WAYS];
+	int successors = 0;
+	int jump_not_loop, self_loop = 0;
+	int way, c;
+
+	if (!block_background && blocks[blockpoint2] != block_startpc) {
+		// Block was discarded while being generated, so can never be
+		// entered; drop any side exit links added since, and leave its
+		// space to be reused
+		block_discard(blockpoint2);
+		tier_time[block_hot] += clock() - block_time;
+		codegen_unlock();
+		return;
+	}
 
-	generateupdatepc();
+	gen_update_pc();
 	generateupdateinscount();
 
 	addbyte(0x83); addbyte(0x2d); addrip_byte(&linecyc, 1); // SUBL $1,linecyc(%rip)
@@ -1446,25 +4116,347 @@ endblock(uint32_t opcode)
 	addbyte(0x41); addbyte(0xf7); addbyte(0x47); addbyte(offsetof(ARMState, event)); addlong(0xff); // TESTL $0xff,arm.event
 	gen_x86_jump(CC_NZ, 0);
 
-	addbyte(0x48); addbyte(0x8d); addbyte(0x0d); addrip(codeblockpc); // LEA codeblockpc(%rip),%rcx
-	gen_load_reg(15, EAX);
+	// %r12d has caught up, so is R15
+	addbyte(0x44); addbyte(0x89); addbyte(0xe0); // MOV %r12d,%eax
 	addbyte(0x83); addbyte(0xe8); addbyte(8); // SUB $8,%eax
-	addbyte(0x48); addbyte(0x8d); addbyte(0x1d); addrip(codeblocknum); // LEA codeblocknum(%rip),%rbx
-	addbyte(0x89); addbyte(0xc2); // MOV %eax,%edx
 	//if (arm.r15_mask != 0xfffffffc) {
 		addbyte(0x25); addlong(arm.r15_mask); // AND $arm.r15_mask,%eax
 	//}
-	addbyte(0x4c); addbyte(0x8d); addbyte(0x05); addrip(codeblockaddr); // LEA codeblockaddr(%rip),%r8
-	addbyte(0x81); addbyte(0xe2); addlong(0x1fffc); // AND $0x1fffc,%edx
+
+	// Statically known successors: the branch target and/or the following
+	// instruction
+	if ((opcode >> 28) != 0xf && (opcode & 0xe000000) == 0xa000000) {
+		uint32_t offset = (opcode << 8);
+
+		offset = (uint32_t) ((int32_t) offset >> 6);
+		successor[successors++] = (block_lastpc + 8 + offset) & arm.r15_mask;
+	}
+	if ((opcode >> 28) != 0xe || (opcode & 0xe000000) != 0xa000000) {
+		successor[successors++] = (block_lastpc + 4) & arm.r15_mask;
+	}
+
+	// A loop that only polls leaves the block each time round, so that
+	// arm_exec() can let time pass while it waits
+	if (block_is_idle_loop(opcode)) {
+		addbyte(0x3d); addlong(block_startpc); // CMP $block_startpc,%eax
+		jump_not_loop = gen_x86_jump_forward(CC_NZ);
+		addbyte(0xc7); addbyte(0x05); addrip_long(&blockidle, 1); // MOVL $1,blockidle(%rip)
+		gen_x86_jump(CC_ALWAYS, 0);
+		gen_x86_jump_here(jump_not_loop);
+		self_loop = 1;
+		idle_loops++;
+	}
+
+	// A block that loops back to itself can keep its registers pinned,
+	// provided it has not been discarded since it was entered, and its
+	// helper calls wrote back every register it modified
+	for (c = 0; c < successors && !self_loop; c++) {
+		if (successor[c] == block_startpc && !(pinned_dirty & ~block_writes)) {
+			addbyte(0x3d); addlong(block_startpc); // CMP $block_startpc,%eax
+			jump_not_loop = gen_x86_jump_forward(CC_NZ);
+			addbyte(0x81); addbyte(0x3d); addrip_long(&blocks[blockpoint2], block_startpc); // CMPL $block_startpc,blocks[blockpoint2](%rip)
+			gen_x86_jump(CC_E, block_body);
+			gen_x86_jump_here(jump_not_loop);
+			self_loop = 1;
+			break;
+		}
+	}
+
+	// Leaving the block, so write back modified registers
+	gen_writeback_regs(pinned_dirty);
+
+	// Direct jumps to the other successors
+	for (c = 0; c < successors; c++) {
+		if (!self_loop || successor[c] != block_startpc) {
+			gen_block_link(block_links++, successor[c]);
+		}
+	}
+
+	if (block_ends_with_return(opcode)) {
+		gen_return_predict();
+	}
+
+	addbyte(0x48); addbyte(0x8d); addbyte(0x0d); addrip(codeblockpc); // LEA codeblockpc(%rip),%rcx
+	addbyte(0x48); addbyte(0x8d); addbyte(0x1d); addrip(codeblocknum); // LEA codeblocknum(%rip),%rbx
+	addbyte(0x89); addbyte(0xc2); // MOV %eax,%edx
+	addbyte(0x48); addbyte(0x8d); addbyte(0x35); addrip(rcodeblock); // LEA rcodeblock(%rip),%rsi
+	addbyte(0x81); addbyte(0xe2); addlong((CODEBLOCK_SETS - 1) << 2); // AND $((CODEBLOCK_SETS - 1) << 2),%edx
+	addbyte(0xc1); addbyte(0xe2); addbyte(CODEBLOCK_WAYS_SHIFT); // SHL $CODEBLOCK_WAYS_SHIFT,%edx
+
+	// Search each way of the set, without updating the LRU order
 	addbyte(0x3b); addbyte(0x04); addbyte(0x11); // CMP (%rcx,%rdx),%eax
-	gen_x86_jump(CC_NE, 0);
+	found[0] = gen_x86_jump_forward(CC_E);
+	for (way = 1; way < CODEBLOCK_WAYS; way++) {
+		addbyte(0x3b); addbyte(0x44); addbyte(0x11); addbyte(way * 4); // CMP way*4(%rcx,%rdx),%eax
+		found[way] = gen_x86_jump_forward(CC_E);
+	}
+	gen_x86_jump(CC_ALWAYS, 0);
+	for (way = CODEBLOCK_WAYS - 1; way > 0; way--) {
+		gen_x86_jump_here(found[way]);
+		addbyte(0x83); addbyte(0xc2); addbyte(4); // ADD $4,%edx
+	}
+	gen_x86_jump_here(found[0]);
 
 	addbyte(0x8b); addbyte(0x04); addbyte(0x13); // MOV (%rbx,%rdx),%eax
-	addbyte(0x49); addbyte(0x8b); addbyte(0x04); addbyte(0xc0); // MOV (%r8,%rax,8),%rax
+	addbyte(0x48); addbyte(0x8b); addbyte(0x04); addbyte(0xc6); // MOV (%rsi,%rax,8),%rax
 
 	// Jump to next block bypassing function prologue
 	addbyte(0x48); addbyte(0x83); addbyte(0xc0); addbyte(block_enter); // ADD $block_enter,%rax
 	addbyte(0xff); addbyte(0xe0); // JMP *%rax
+
+	gen_pc_exit_stubs();
+
+	assert(codeblockpos <= BLOCK_MAX_SIZE);
+	codearena_pos += (codeblockpos + 15) & ~15;
+	if (codearena_pos > codearena_highwater) {
+		codearena_highwater = codearena_pos;
+	}
+#if defined __linux__
+	if (perf_file != NULL) {
+		perf_block(codeblockpos);
+	}
+#endif
+	tier_time[block_hot] += clock() - block_time;
+	if (block_background) {
+		return;
+	}
+
+	// Now that this block is complete, link any blocks waiting for it
+	block_resolve_pending(blockpoint2, block_startpc);
+	codegen_unlock();
+}
+
+/**
+ * Generate a hot block on the compile thread. Blocks are not generated while
+ * the code cache is full, as only the emulator thread may flush it.
+ *
+ * @param req        Request for the block
+ * @param generation Set to codecache_generation at the time of generation
+ * @return Block number, or -1 if there was no space
+ */
+static int
+compile_block(const CompileRequest *req, unsigned *generation)
+{
+	int b = -1;
+
+	pthread_mutex_lock(&codegen_mutex);
+	if (blockpoint < BLOCKS && codearena_size - codearena_pos >= BLOCK_MAX_SIZE) {
+		uint32_t opcode;
+
+		block_hot = 1;
+		block_background = 1;
+		block_time = clock();
+		background_end = 0;
+		block_end = &background_end;
+
+		block_alloc(req->pc);
+		block_start(req->pc, req->code);
+		opcode = arm_translate_block(req->pc, req->code, req->pcpsr, &background_end);
+		endblock(opcode);
+		b = blockpoint2;
+
+		block_end = &blockend;
+		block_background = 0;
+	}
+	*generation = codecache_generation;
+	pthread_mutex_unlock(&codegen_mutex);
+
+	return b;
+}
+
+/**
+ * Function run by the compile thread, generating queued blocks in turn.
+ */
+static void *
+compile_thread_function(void *p)
+{
+	NOT_USED(p);
+
+	pthread_mutex_lock(&compile_queue_mutex);
+	for (;;) {
+		CompileRequest *req = NULL;
+		unsigned generation;
+		int n, b;
+
+		for (n = 0; n < COMPILE_QUEUE_SIZE; n++) {
+			if (compile_queue[n].state == COMPILE_QUEUED) {
+				req = &compile_queue[n];
+				break;
+			}
+		}
+		if (req == NULL) {
+			if (pthread_cond_wait(&compile_queue_cond, &compile_queue_mutex)) {
+				fatal("pthread_cond_wait failed");
+			}
+			continue;
+		}
+		req->state = COMPILE_BUSY;
+		pthread_mutex_unlock(&compile_queue_mutex);
+
+		b = compile_block(req, &generation);
+
+		pthread_mutex_lock(&compile_queue_mutex);
+		req->block = b;
+		req->generation = generation;
+		req->state = COMPILE_DONE;
+	}
+
+	return NULL;
+}
+
+/**
+ * Publish a block generated by the compile thread in place of the cold
+ * version, unless the code cache has been flushed or the block's page has
+ * been written to since it was queued.
+ *
+ * @param req Request for the block
+ * @return Block number, or -1 if the block is out of date
+ */
+static int
+compile_publish(const CompileRequest *req)
+{
+	const int b = req->block;
+	uint32_t addr;
+	int n;
+
+	if (b < 0 || req->generation != codecache_generation ||
+	    req->epoch != codepage_epoch[(req->pc >> 12) & 0xffff])
+	{
+		compile_dropped++;
+		return -1;
+	}
+	codeblock_insert(req->pc, b);
+	for (addr = req->pc; addr < blocks_end[b]; addr += 1u << CODE_REGION_SHIFT) {
+		code_mark(addr);
+	}
+	code_mark(blocks_end[b]);
+
+	// Link the exits of the block, now that other blocks can find it
+	for (n = 0; n < BLOCK_LINKS; n++) {
+		const int id = b * BLOCK_LINKS + n;
+
+		if (blocklinks[id].target != 0xffffffff) {
+			const int dest = codeblock_find(blocklinks[id].target);
+
+			if (dest >= 0) {
+				link_patch(id, dest);
+			}
+			link_list_add(id);
+		}
+	}
+	block_resolve_pending(b, req->pc);
+	compile_published++;
+	return b;
+}
+
+/**
+ * Called by codeblock_lookup() when a cold block has become hot. With the
+ * compile thread enabled, the hot block is queued to be generated there, and
+ * the cold block keeps running until it is ready.
+ *
+ * @param num Cold block
+ * @return Block to run, or -1 to generate the hot block now
+ */
+int
+codegen_promote(int num)
+{
+	const uint32_t pc = blocks[num];
+	CompileRequest *req = NULL;
+	int n;
+
+	if (!config.dynarec_compile_thread) {
+		return -1;
+	}
+	if (!compile_thread_started) {
+		if (pthread_create(&compile_thread, NULL, compile_thread_function, NULL)) {
+			fatal("Couldn't create dynarec compile thread");
+		}
+		compile_thread_started = 1;
+	}
+
+	pthread_mutex_lock(&compile_queue_mutex);
+	for (n = 0; n < COMPILE_QUEUE_SIZE; n++) {
+		if (compile_queue[n].state != COMPILE_FREE && compile_queue[n].pc == pc) {
+			req = &compile_queue[n];
+			break;
+		}
+	}
+	if (req != NULL && req->state == COMPILE_DONE) {
+		const int b = compile_publish(req);
+
+		req->state = COMPILE_FREE;
+		if (b >= 0) {
+			pthread_mutex_unlock(&compile_queue_mutex);
+			return b;
+		}
+		// Out of date, so generate it again
+		req = NULL;
+	}
+	if (req == NULL) {
+		// Use a free entry, otherwise one whose block was never wanted
+		for (n = 0; n < COMPILE_QUEUE_SIZE; n++) {
+			if (compile_queue[n].state == COMPILE_FREE) {
+				break;
+			}
+		}
+		if (n == COMPILE_QUEUE_SIZE) {
+			for (n = 0; n < COMPILE_QUEUE_SIZE; n++) {
+				if (compile_queue[n].state == COMPILE_DONE) {
+					compile_dropped++;
+					break;
+				}
+			}
+		}
+		if (n == COMPILE_QUEUE_SIZE) {
+			// Queue is full, so generate the block now
+			pthread_mutex_unlock(&compile_queue_mutex);
+			return -1;
+		}
+		req = &compile_queue[n];
+		req->pc = pc;
+		req->code = block_code[num];
+		req->pcpsr = pcpsr;
+		req->epoch = codepage_epoch[(pc >> 12) & 0xffff];
+		req->state = COMPILE_QUEUED;
+		compile_queued++;
+		if (pthread_cond_signal(&compile_queue_cond)) {
+			fatal("Couldn't signal dynarec compile thread");
+		}
+	}
+	pthread_mutex_unlock(&compile_queue_mutex);
+
+	// Keep running the cold block meanwhile
+	codeblockheat[num] = (int32_t) (config.dynarec_hot_threshold & 0x7fffffff);
+	return num;
+}
+
+/**
+ * Log statistics about the use of the code cache.
+ */
+void
+codegen_log_stats(void)
+{
+	rpclog("Dynarec: %" PRIu64 " block lookups, %" PRIu64 " lookup misses\n",
+	       codecache_hits + codecache_misses, codecache_misses);
+	rpclog("Dynarec: %" PRIu64 " blocks evicted in %d flushes, %" PRIu64 " evicted from full sets\n",
+	       codecache_evictions, codecache_flushes, codecache_conflicts);
+	rpclog("Dynarec: %u KB of %u KB code cache used at most\n",
+	       (unsigned) (codearena_highwater >> 10), (unsigned) (codearena_size >> 10));
+	rpclog("Dynarec: %" PRIu64 " writes to pages with code, %" PRIu64 " discarding %" PRIu64 " blocks\n",
+	       smc_writes, smc_invalidations, smc_blocks);
+	rpclog("Dynarec: cold tier %" PRIu64 " blocks, %" PRIu64 " instructions, %.3f s generating\n",
+	       tier_blocks[0], tier_inscount[0], (double) tier_time[0] / CLOCKS_PER_SEC);
+	rpclog("Dynarec: hot tier %" PRIu64 " blocks, %" PRIu64 " instructions, %.3f s generating\n",
+	       tier_blocks[1], tier_inscount[1], (double) tier_time[1] / CLOCKS_PER_SEC);
+	rpclog("Dynarec: %" PRIu64 " returns predicted, %" PRIu64 " mispredicted\n",
+	       return_predicted, return_mispredicted);
+	rpclog("Dynarec: %" PRIu64 " idle loops\n", idle_loops);
+	rpclog("Dynarec: %" PRIu64 " register-specified shifts%s\n",
+	       reg_shifts, host_bmi2 ? " using BMI2" : "");
+	if (compile_thread_started) {
+		rpclog("Dynarec: compile thread %" PRIu64 " blocks queued, %" PRIu64 " published, %" PRIu64 " out of date\n",
+		       compile_queued, compile_published, compile_dropped);
+	}
 }
 
 void
@@ -1538,7 +4530,7 @@ generateirqtest(void)
 	}
 
 	addbyte(0x85); addbyte(0xc0); // TEST %eax,%eax
-	gen_x86_jump(CC_NE, 0);
+	gen_exit_pc(CC_NE);
 	if (lastjumppos != 0) {
 		gen_x86_jump_here_long(lastjumppos);
 	}
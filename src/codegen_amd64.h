@@ -21,15 +21,68 @@
 //#define isblockvalid(l) (((l)&0xFFC00000)==0x3800000)
 #define isblockvalid(l) (dcache)
 
-#define BLOCKS 1024
+#define BLOCKS 65536		/**< Maximum number of blocks in the code cache */
+#define BLOCK_MAX_SIZE 1792	/**< Maximum size of generated code for a block */
 
-extern uint8_t rcodeblock[BLOCKS][1792];
-extern uint32_t codeblockpc[0x8000];
-extern int codeblocknum[0x8000];
+#define CODE_ARENA_MIN_MB 16	/**< Minimum code cache size in MB */
+#define CODE_ARENA_MAX_MB 64	/**< Maximum code cache size in MB */
+
+/*
+ * Blocks are found through a set-associative table indexed by ARM address.
+ * Within each set, way 0 is the most recently used.
+ */
+#define CODEBLOCK_SETS 0x4000
+#define CODEBLOCK_WAYS_SHIFT 2
+#define CODEBLOCK_WAYS (1 << CODEBLOCK_WAYS_SHIFT)
+
+extern uint8_t *rcodeblock[BLOCKS];
+extern uint64_t codecache_hits, codecache_misses;
+extern uint32_t codeblockpc[CODEBLOCK_SETS * CODEBLOCK_WAYS];
+extern int codeblocknum[CODEBLOCK_SETS * CODEBLOCK_WAYS];
+extern int32_t codeblockheat[BLOCKS];
+
+extern uint32_t *pcpsr;
+
+extern int codegen_promote(int num);
 
 extern uint8_t flaglookup[16][16];
 
-#define BLOCKSTART 32
+#define BLOCKSTART 48
+
+/** Index into codeblockpc[] of the first way of the set for an address */
+#define HASH(l) ((((l)>>2)&(CODEBLOCK_SETS-1))<<CODEBLOCK_WAYS_SHIFT)
+
+/**
+ * Find the block starting at an ARM address, and make it the most recently
+ * used in its set. A block that has become hot is not returned, so that it
+ * is generated again with full optimisation, unless codegen_promote() has
+ * the compile thread generate it instead.
+ *
+ * @param pc ARM address
+ * @return Block number, or -1 if there is no block for this address
+ */
+static inline int
+codeblock_lookup(uint32_t pc)
+{
+	const uint32_t set = HASH(pc);
+	int way;
+
+	for (way = 0; way < CODEBLOCK_WAYS; way++) {
+		if (codeblockpc[set + way] == pc) {
+			const int num = codeblocknum[set + way];
 
-#define HASH(l) (((l)>>2)&0x7FFF)
+			for (; way > 0; way--) {
+				codeblockpc[set + way] = codeblockpc[set + way - 1];
+				codeblocknum[set + way] = codeblocknum[set + way - 1];
+			}
+			codeblockpc[set] = pc;
+			codeblocknum[set] = num;
+			if (codeblockheat[num] < 0) {
+				return codegen_promote(num);
+			}
+			return num;
+		}
+	}
+	return -1;
+}
 //#define callblock(l) (((codeblockpc[0][HASH(l)]==l)||(codeblockpc[1][HASH(l)]==l))?codecallblock(l):0)
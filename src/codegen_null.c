@@ -19,6 +19,7 @@
  */
 
 #include "rpcemu.h"
+#include "arm.h"
 #include "mem.h"
 
 void initcodeblocks(void)
@@ -27,10 +28,20 @@ void initcodeblocks(void)
 
 void resetcodeblocks(void)
 {
+	arm_decode_reset();
 }
 
 void cacheclearpage(uint32_t a)
 {
-	NOT_USED(a);
+	arm_decode_clear_page(a);
+}
+
+int cacheclearwrite(uint32_t addr)
+{
+	return arm_decode_clear_write(addr);
+}
+
+void codegen_log_stats(void)
+{
 }
 
@@ -21,6 +21,7 @@
 //ESI is pointer to ARMState
 
 #include <assert.h>
+#include <inttypes.h>
 #include <stdint.h>
 #include <string.h>
 
@@ -32,11 +33,17 @@
 
 int lastflagchange;
 
+uint64_t codecache_hits;	/**< Blocks found by arm_exec() */
+uint64_t codecache_misses;	/**< Blocks not found by arm_exec(), and so generated */
+
 uint8_t rcodeblock[BLOCKS][1792+512+64] __attribute__ ((aligned (4096)));
 static const void *codeblockaddr[BLOCKS];
 uint32_t codeblockpc[0x8000];
 int codeblocknum[0x8000];
-static uint8_t codeblockpresent[0x10000];
+static uint8_t codeblockpresent[0x10000];	/**< Pages that may contain code of a block */
+static uint8_t codeblockspans[0x10000];		/**< Pages with blocks that continue into the next page */
+static uint8_t block_spans[BLOCKS];		/**< Whether each block continues into the next page */
+static uint32_t block_startpc;			/**< ARM address of block currently being generated */
 
 //#define BLOCKS 4096
 //#define HASH(l) ((l>>3)&0x3fff)
@@ -147,27 +154,57 @@ resetcodeblocks(void)
 	}
 }
 
-void
-cacheclearpage(uint32_t a)
+/**
+ * Discard the blocks starting in a page.
+ *
+ * @param a            ARM address >> 12 of page
+ * @param spanning_only Only discard blocks that continue into the next page
+ */
+static void
+cacheclear_blocks(uint32_t a, int spanning_only)
 {
 	int c, d;
 
-	if (!codeblockpresent[a & 0xffff]) {
-		return;
-	}
-	codeblockpresent[a & 0xffff] = 0;
 	// a >>= 10;
 	d = HASH(a << 12);
 	for (c = 0; c < 0x400; c++) {
-		if ((codeblockpc[c + d] >> 12) == a) {
+		if (codeblockpc[c + d] != 0xffffffff && (codeblockpc[c + d] >> 12) == a &&
+		    (!spanning_only || block_spans[codeblocknum[c + d]]))
+		{
 			codeblockpc[c + d] = 0xffffffff;
 		}
 	}
 }
 
 void
-initcodeblock(uint32_t l)
+cacheclearpage(uint32_t a)
+{
+	if (!codeblockpresent[a & 0xffff]) {
+		return;
+	}
+	codeblockpresent[a & 0xffff] = 0;
+	cacheclear_blocks(a, 0);
+
+	// Blocks from the previous page may also have code in this one
+	if (codeblockspans[(a - 1) & 0xffff]) {
+		codeblockspans[(a - 1) & 0xffff] = 0;
+		cacheclear_blocks(a - 1, 1);
+	}
+}
+
+int
+cacheclearwrite(uint32_t addr)
 {
+	// Blocks are only tracked per page
+	cacheclearpage(addr >> 12);
+	return 0;
+}
+
+void
+initcodeblock(uint32_t l, const uint32_t *code)
+{
+	NOT_USED(code);
+
 	codeblockpresent[(l >> 12) & 0xffff] = 1;
 	tempinscount = 0;
 	// rpclog("Initcodeblock %08x\n", l);
@@ -187,6 +224,8 @@ initcodeblock(uint32_t l)
 	codeblocknum[blocknum] = blockpoint;
 	blocks[blockpoint] = blocknum;
 	blockpoint2 = blockpoint;
+	block_startpc = l;
+	block_spans[blockpoint2] = 0;
 
 	// Block Epilogue
 	addbyte(0x83); addbyte(0xc4); addbyte(12); // ADD $12,%esp
@@ -2092,6 +2131,13 @@ generateupdateinscount(void)
 void
 generatepcinc(void)
 {
+	if (((PC ^ block_startpc) >> 12) != 0 && !block_spans[blockpoint2]) {
+		// The block has continued into the next page, so writes to
+		// either page must discard it
+		block_spans[blockpoint2] = 1;
+		codeblockpresent[(PC >> 12) & 0xffff] = 1;
+		codeblockspans[(block_startpc >> 12) & 0xffff] = 1;
+	}
 	tempinscount++;
 	pcinc += 4;
 	if (pcinc == 124) {
@@ -2140,6 +2186,29 @@ endblock(uint32_t opcode)
 	addbyte(0xff); addbyte(0xe0); // JMP *%eax
 }
 
+/**
+ * Log statistics about the use of the code cache.
+ */
+void
+codegen_log_stats(void)
+{
+	rpclog("Dynarec: %" PRIu64 " block lookups, %" PRIu64 " blocks generated\n",
+	       codecache_hits + codecache_misses, codecache_misses);
+}
+
+/**
+ * FPA instructions are always emulated by fpaopcode(), so end the block.
+ *
+ * @param opcode Opcode of coprocessor instruction
+ * @return Zero
+ */
+int
+codegen_fpa_inline(uint32_t opcode)
+{
+	NOT_USED(opcode);
+	return 0;
+}
+
 void
 generateflagtestandbranch(uint32_t opcode, uint32_t *pcpsr)
 {
@@ -24,6 +24,7 @@
 #define BLOCKS 1024
 
 extern uint8_t rcodeblock[BLOCKS][1792+512+64];
+extern uint64_t codecache_hits, codecache_misses;
 extern uint32_t codeblockpc[0x8000];
 extern int codeblocknum[0x8000];
 
@@ -33,4 +34,19 @@ extern uint8_t flaglookup[16][16];
 //uint32_t blocks[1024];
 
 #define HASH(l) (((l)>>2)&0x7FFF)
+
+/**
+ * Find the block starting at an ARM address.
+ *
+ * @param pc ARM address
+ * @return Block number, or -1 if there is no block for this address
+ */
+static inline int
+codeblock_lookup(uint32_t pc)
+{
+	if (codeblockpc[HASH(pc)] == pc) {
+		return codeblocknum[HASH(pc)];
+	}
+	return -1;
+}
 //#define callblock(l) (((codeblockpc[0][HASH(l)]==l)||(codeblockpc[1][HASH(l)]==l))?codecallblock(l):0)
@@ -19,11 +19,21 @@
  */
 
 /* System coprocessor + MMU emulation*/
+#include <inttypes.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#if defined __linux__
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#if defined SYS_memfd_create
+#define CP15_SPARSE_TABLES
+#endif
+#endif
+
 #include "rpcemu.h"
 #include "arm.h"
 #include "cp15.h"
@@ -31,16 +41,61 @@
 
 int dcache = 0; /* Data cache on StrongARM, unified cache pre-StrongARM */
 
-#define TLBCACHESIZE 256
+#define TLB_ENTRIES_MIN 16		/**< Fewest entries in each TLB */
+#define TLB_ENTRIES_MAX 65536		/**< Most entries in each TLB */
+
+/** Value of tlbcache[] for a page parked in the given entry of tlbcache2[] */
+#define TLB_PARKED(entry)	(((entry) << 12) | 0x800)
+
+/* tlbcache[], vraddrl[] and vwaddrl[] are flat tables of every virtual page,
+   of which a guest only uses a small part. Where supported they are aligned
+   so that cp15_sparse_init() can map them over a pattern of misses, and host
+   memory is only used for the parts written to */
+#if defined CP15_SPARSE_TABLES && defined __GNUC__
+#define SPARSE_ALIGN	__attribute__((aligned(0x10000)))
+#else
+#define SPARSE_ALIGN
+#endif
+
+#define SPARSE_CHUNK	0x40000		/**< Size of the pattern of misses, mapped repeatedly */
+
+static int sparse_tables = 0;	/**< Non-zero if the tables are mapped over a pattern of misses */
+
+/* The translation TLB, with entries replaced by the CLOCK algorithm like the
+   shadow TLBs, see ShadowTLB */
+uint32_t tlbcache[0x100000] SPARSE_ALIGN;
+static uint32_t *tlbcache2;	/**< Virtual page of each entry, or 0xffffffff if free */
+static uint32_t *tlbphys;	/**< Physical page of each entry */
+static uint8_t *tlbref;		/**< Turns of the hand each entry has left before being parked,
+				     or 0 if parked */
+static uint32_t tlbmask;	/**< Number of entries - 1 */
+static uint32_t tlbhand;	/**< Next entry for the hand to examine */
+static uint64_t tlb_fills, tlb_rearms, tlb_evictions;
+
+uintptr_t vraddrl[0x100000] SPARSE_ALIGN;
+uintptr_t vwaddrl[0x100000] SPARSE_ALIGN;
+ShadowTLB vraddr_tlb, vwaddr_tlb;
+static uint8_t tlblarge[0x1000]; /**< Non-zero if a MB has entries translated from a Section or Large page */
+static uint8_t tlbdomain[0x1000]; /**< Domain of each MB when last translated, or 0xff if never */
+int tlbs = 0, flushes = 0, purges = 0, domain_flushes = 0;
+
+#define WALK_CACHE_ENTRIES 64		/**< Entries in the walk cache, a power of two */
+
+/**
+ * Walk cache entry, holding the first-level descriptor of a MB and what has
+ * been worked out from it, so that translating another page of the MB only
+ * needs its second-level descriptor read.
+ */
+typedef struct {
+	uint32_t mb;			/**< Virtual MB (address >> 20), or 0xffffffff if empty */
+	uint32_t fld;			/**< First-level descriptor, Page or Section */
+	uint32_t domain_access;		/**< Access permitted by the descriptor's Domain */
+	const uint32_t *sld_table;	/**< Second-level table of a Page descriptor in host memory,
+					     or NULL if it must be read with mem_phys_read32() */
+} WalkCacheEntry;
 
-uint32_t tlbcache[0x100000] = {0};
-static uint32_t tlbcache2[TLBCACHESIZE];
-uintptr_t vraddrl[0x100000];
-uint32_t vraddrls[1024] = {0}, vraddrphys[1024] = {0};
-uintptr_t vwaddrl[0x100000];
-uint32_t vwaddrls[1024] = {0}, vwaddrphys[1024] = {0};
-static int tlbcachepos = 0;
-int tlbs = 0, flushes = 0;
+static WalkCacheEntry walk_cache[WALK_CACHE_ENTRIES];
+static uint64_t walk_cache_hits, walk_cache_misses;
 
 static struct cp15 {
 	uint32_t ctrl;				/**< Control register */
@@ -78,9 +133,9 @@ static int icache = 0;
 static void
 cp15_tlb_flush(void)
 {
-	int c;
+	uint32_t c;
 
-	for (c = 0; c < TLBCACHESIZE; c++) {
+	for (c = 0; c <= tlbmask; c++) {
 		if (tlbcache2[c] != 0xffffffff) {
 			tlbcache[tlbcache2[c]] = 0xffffffff;
 			tlbcache2[c] = 0xffffffff;
@@ -88,21 +143,172 @@ cp15_tlb_flush(void)
 	}
 }
 
+/**
+ * Empty the walk cache, after the translation table, the Domain Access Control
+ * register or the descriptors themselves may have changed.
+ */
+static void
+cp15_walk_cache_flush(void)
+{
+	uint32_t c;
+
+	for (c = 0; c < WALK_CACHE_ENTRIES; c++) {
+		walk_cache[c].mb = 0xffffffff;
+	}
+}
+
+/**
+ * Remove a single page from the TLB.
+ *
+ * @param page Virtual page number (virtual address >> 12)
+ */
+static void
+cp15_tlb_remove_page(uint32_t page)
+{
+	uint32_t c;
+
+	if (tlbcache[page] == 0xffffffff) {
+		return;
+	}
+	tlbcache[page] = 0xffffffff;
+	for (c = 0; c <= tlbmask; c++) {
+		if (tlbcache2[c] == page) {
+			tlbcache2[c] = 0xffffffff;
+			break;
+		}
+	}
+}
+
+/**
+ * Remove an entry from a shadow TLB, unmapping its page.
+ *
+ * @param t     Shadow TLB
+ * @param entry Entry to remove
+ */
+static void
+cp15_shadow_tlb_remove(ShadowTLB *t, uint32_t entry)
+{
+	t->shadow[t->page[entry]] = 0xffffffff;
+	t->page[entry] = 0xffffffff;
+	t->phys[entry] = 0xffffffff;
+}
+
+/**
+ * Free all entries of a shadow TLB, whose pages are already unmapped.
+ *
+ * @param t Shadow TLB
+ */
+static void
+cp15_shadow_tlb_reset(ShadowTLB *t)
+{
+	memset(t->page, 0xff, (t->mask + 1) * sizeof(uint32_t));
+	memset(t->phys, 0xff, (t->mask + 1) * sizeof(uint32_t));
+	memset(t->ref, 0, t->mask + 1);
+	t->hand = 0;
+}
+
+#ifdef CP15_SPARSE_TABLES
+/**
+ * Map a table over the pattern of misses in the given shared memory.
+ *
+ * @param table Table, aligned to a host page
+ * @param size  Size of table in bytes, a multiple of SPARSE_CHUNK
+ * @param fd    Shared memory holding SPARSE_CHUNK bytes of 0xff
+ * @return Non-zero on success
+ */
+static int
+cp15_sparse_map(void *table, size_t size, int fd)
+{
+	size_t c;
+
+	for (c = 0; c < size; c += SPARSE_CHUNK) {
+		if (mmap((uint8_t *) table + c, SPARSE_CHUNK, PROT_READ | PROT_WRITE,
+		         MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED)
+		{
+			return 0;
+		}
+	}
+	return 1;
+}
+#endif
+
+/**
+ * Map tlbcache[], vraddrl[] and vwaddrl[] privately over shared memory full
+ * of misses. Pages of the tables that are only read are then shared with the
+ * pattern, a page gets its own copy when first written to, and
+ * cp15_sparse_reset() can return the copies to the host instead of filling
+ * the tables.
+ *
+ * If this fails the tables stay as they are, and are filled on reset.
+ */
+static void
+cp15_sparse_init(void)
+{
+#ifdef CP15_SPARSE_TABLES
+	const long page_size = sysconf(_SC_PAGESIZE);
+	void *pattern;
+	int fd;
+
+	if (page_size <= 0 || ((uintptr_t) tlbcache % (uintptr_t) page_size) != 0 ||
+	    ((uintptr_t) vraddrl % (uintptr_t) page_size) != 0 ||
+	    ((uintptr_t) vwaddrl % (uintptr_t) page_size) != 0 ||
+	    (SPARSE_CHUNK % page_size) != 0)
+	{
+		return;
+	}
+
+	fd = (int) syscall(SYS_memfd_create, "rpcemu-tlb", 0);
+	if (fd == -1) {
+		return;
+	}
+	if (ftruncate(fd, SPARSE_CHUNK) != 0) {
+		close(fd);
+		return;
+	}
+	pattern = mmap(NULL, SPARSE_CHUNK, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (pattern == MAP_FAILED) {
+		close(fd);
+		return;
+	}
+	memset(pattern, 0xff, SPARSE_CHUNK);
+	munmap(pattern, SPARSE_CHUNK);
+
+	sparse_tables = cp15_sparse_map(tlbcache, sizeof(tlbcache), fd) &&
+	                cp15_sparse_map(vraddrl, sizeof(vraddrl), fd) &&
+	                cp15_sparse_map(vwaddrl, sizeof(vwaddrl), fd);
+	close(fd);
+#endif
+	rpclog("CP15: sparse TLB tables %s\n", sparse_tables ? "enabled" : "unavailable");
+}
+
+/**
+ * Set every entry of tlbcache[], vraddrl[] or vwaddrl[] to a miss.
+ *
+ * @param table Table
+ * @param size  Size of table in bytes
+ */
+static void
+cp15_sparse_reset(void *table, size_t size)
+{
+#ifdef CP15_SPARSE_TABLES
+	if (sparse_tables && madvise(table, size, MADV_DONTNEED) == 0) {
+		return;
+	}
+#endif
+	memset(table, 0xff, size);
+}
+
 static void
 cp15_vaddr_reset(void)
 {
-	int c;
+	uint32_t c;
 
-	for (c = 0; c < 1024; c++) {
-		if (vraddrls[c] != 0xFFFFFFFF) {
-			vraddrl[vraddrls[c]] = 0xFFFFFFFF;
-			vraddrls[c] = 0xFFFFFFFF;
-			vraddrphys[c] = 0xFFFFFFFF;
+	for (c = 0; c <= vraddr_tlb.mask; c++) {
+		if (vraddr_tlb.page[c] != 0xffffffff) {
+			cp15_shadow_tlb_remove(&vraddr_tlb, c);
 		}
-		if (vwaddrls[c] != 0xFFFFFFFF) {
-			vwaddrl[vwaddrls[c]] = 0xFFFFFFFF;
-			vwaddrls[c] = 0xFFFFFFFF;
-			vwaddrphys[c] = 0xFFFFFFFF;
+		if (vwaddr_tlb.page[c] != 0xffffffff) {
+			cp15_shadow_tlb_remove(&vwaddr_tlb, c);
 		}
 	}
 }
@@ -116,13 +322,11 @@ cp15_vaddr_reset(void)
 void
 cp15_tlb_invalidate_physical(uint32_t addr)
 {
-	int c;
+	uint32_t c;
 
-	for (c = 0; c < 1024; c++) {
-		if ((vwaddrphys[c] & 0x1f000000) == addr) {
-			vwaddrl[vwaddrls[c]] = 0xffffffff;
-			vwaddrls[c] = 0xffffffff;
-			vwaddrphys[c] = 0xffffffff;
+	for (c = 0; c <= vwaddr_tlb.mask; c++) {
+		if (vwaddr_tlb.page[c] != 0xffffffff && (vwaddr_tlb.phys[c] & 0x1f000000) == addr) {
+			cp15_shadow_tlb_remove(&vwaddr_tlb, c);
 		}
 	}
 }
@@ -156,13 +360,56 @@ cp15_reset(CPUModel cpu_model)
 	mmu = 0;
 	prog32 = (cp15.ctrl & CP15_CTRL_PROG32) != 0;
 
-        memset(tlbcache, 0xff, 0x100000 * sizeof(uint32_t));
-        memset(tlbcache2, 0xff, TLBCACHESIZE * sizeof(uint32_t));
-        tlbcachepos=0;
-	memset(vraddrl, 0xff, sizeof(vraddrl));
-	memset(vraddrls, 0xff, sizeof(vraddrls));
-	memset(vwaddrl, 0xff, sizeof(vwaddrl));
-	memset(vwaddrls, 0xff, sizeof(vwaddrls));
+	cp15_sparse_reset(tlbcache, sizeof(tlbcache));
+        memset(tlbcache2, 0xff, (tlbmask + 1) * sizeof(uint32_t));
+	memset(tlbref, 0, tlbmask + 1);
+	tlbhand = 0;
+	memset(tlblarge, 0, sizeof(tlblarge));
+	memset(tlbdomain, 0xff, sizeof(tlbdomain));
+	cp15_walk_cache_flush();
+	cp15_sparse_reset(vraddrl, sizeof(vraddrl));
+	cp15_sparse_reset(vwaddrl, sizeof(vwaddrl));
+	cp15_shadow_tlb_reset(&vraddr_tlb);
+	cp15_shadow_tlb_reset(&vwaddr_tlb);
+}
+
+/**
+ * Round a configured number of TLB entries to a power of two in the range
+ * supported.
+ *
+ * @param entries Number of entries configured
+ * @return Number of entries to use
+ */
+static uint32_t
+cp15_tlb_entries(unsigned entries)
+{
+	uint32_t n = TLB_ENTRIES_MIN;
+
+	while (n < entries && n < TLB_ENTRIES_MAX) {
+		n <<= 1;
+	}
+	return n;
+}
+
+/**
+ * Allocate the entries of a shadow TLB.
+ *
+ * @param t       Shadow TLB
+ * @param shadow  vraddrl or vwaddrl
+ * @param entries Number of entries, a power of two
+ */
+static void
+cp15_shadow_tlb_alloc(ShadowTLB *t, uintptr_t *shadow, uint32_t entries)
+{
+	t->shadow = shadow;
+	t->page = malloc(entries * sizeof(uint32_t));
+	t->host = malloc(entries * sizeof(uintptr_t));
+	t->phys = malloc(entries * sizeof(uint32_t));
+	t->ref = malloc(entries);
+	if (t->page == NULL || t->host == NULL || t->phys == NULL || t->ref == NULL) {
+		fatal("Out of memory allocating %u TLB entries", entries);
+	}
+	t->mask = entries - 1;
 }
 
 /**
@@ -171,6 +418,22 @@ cp15_reset(CPUModel cpu_model)
 void
 cp15_init(void)
 {
+	const uint32_t entries = cp15_tlb_entries(config.tlb_entries);
+	const uint32_t shadow_entries = cp15_tlb_entries(config.shadow_tlb_entries);
+
+	tlbcache2 = malloc(entries * sizeof(uint32_t));
+	tlbphys = malloc(entries * sizeof(uint32_t));
+	tlbref = malloc(entries);
+	if (tlbcache2 == NULL || tlbphys == NULL || tlbref == NULL) {
+		fatal("Out of memory allocating %u TLB entries", entries);
+	}
+	tlbmask = entries - 1;
+
+	cp15_sparse_init();
+	cp15_shadow_tlb_alloc(&vraddr_tlb, vraddrl, shadow_entries);
+	cp15_shadow_tlb_alloc(&vwaddr_tlb, vwaddrl, shadow_entries);
+	rpclog("CP15: %u TLB entries, %u read and write shadow TLB entries\n",
+	       entries, shadow_entries);
 }
 
 static uint32_t *tlbram;
@@ -182,19 +445,205 @@ cp15_tlb_flush_all(void)
 	clearmemcache();
 	cp15_tlb_flush();
 	cp15_vaddr_reset();
+	memset(tlblarge, 0, sizeof(tlblarge));
+	cp15_walk_cache_flush();
 	flushes++;
 }
 
+/**
+ * Purge the TLB entry covering a single virtual address.
+ *
+ * Only the translation, the read/write shadow pointers and the code blocks
+ * for that page are discarded. If the address lies within a MB that has been
+ * translated using a Section or Large page descriptor, the real TLB entry
+ * covers more than this page, so the TLB is flushed entirely and the code
+ * blocks of that MB are discarded.
+ *
+ * @param vaddr Virtual address
+ */
+static void
+cp15_tlb_purge(uint32_t vaddr)
+{
+	const uint32_t page = vaddr >> 12;
+	uint32_t c;
+
+	if (tlblarge[vaddr >> 20]) {
+		cp15_tlb_flush_all();
+		for (c = 0; c < 0x100; c++) {
+			cacheclearpage((page & ~0xffu) | c);
+		}
+		return;
+	}
+
+	/* Stale ShadowTLB and tlbcache2 slots left for the purged page are
+	   harmless, as the CLOCK hand only parks that page's entry again when
+	   it reaches them */
+	cp15_tlb_remove_page(page);
+
+	/* The guest may have changed the first-level descriptor of the MB too */
+	if (walk_cache[(vaddr >> 20) & (WALK_CACHE_ENTRIES - 1)].mb == (vaddr >> 20)) {
+		walk_cache[(vaddr >> 20) & (WALK_CACHE_ENTRIES - 1)].mb = 0xffffffff;
+	}
+	vraddrl[page] = 0xffffffff;
+	vwaddrl[page] = 0xffffffff;
+	clearmemcache();
+	if (page == pccache) {
+		pccache = 0xffffffff;
+	}
+	cacheclearpage(page);
+	purges++;
+}
+
 static void
 cp15_tlb_add_entry(uint32_t vaddr, uint32_t paddr)
 {
-	if (tlbcache2[tlbcachepos] != 0xffffffff) {
-		tlbcache[tlbcache2[tlbcachepos]] = 0xffffffff;
+	uint32_t entry;
+
+	/* Ends within SHADOW_TLB_AGE + 1 turns, as each step ages an entry */
+	for (;;) {
+		entry = tlbhand;
+		tlbhand = (tlbhand + 1) & tlbmask;
+		if (tlbcache2[entry] == 0xffffffff) {
+			break;
+		}
+		if (tlbref[entry] == 0) {
+			tlbcache[tlbcache2[entry]] = 0xffffffff;
+			tlb_evictions++;
+			break;
+		}
+		if (--tlbref[entry] == 0) {
+			tlbcache[tlbcache2[entry]] = TLB_PARKED(entry);
+		}
 	}
-	tlbcache2[tlbcachepos] = vaddr >> 12;
+	tlbcache2[entry] = vaddr >> 12;
+	tlbphys[entry] = paddr & 0xfffff000;
+	tlbref[entry] = 1;
 	tlbcache[vaddr >> 12] = paddr & 0xfffff000;
+	tlb_fills++;
+}
+
+/**
+ * Find the translation of a page parked by the TLB's hand, and map it again.
+ *
+ * @param page Virtual page number
+ * @return Physical page address, or 0xffffffff if the page is not parked
+ */
+static uint32_t
+cp15_tlb_rearm(uint32_t page)
+{
+	const uint32_t cached = tlbcache[page];
+	const uint32_t entry = cached >> 12;
 
-	tlbcachepos = (tlbcachepos + 1) & (TLBCACHESIZE - 1);
+	if ((cached & 0xfff) != 0x800 || entry > tlbmask || tlbcache2[entry] != page) {
+		return 0xffffffff;
+	}
+	tlbref[entry] = SHADOW_TLB_AGE;
+	tlbcache[page] = tlbphys[entry];
+	tlb_rearms++;
+	return tlbphys[entry];
+}
+
+/**
+ * Work out which Domains have had their access restricted by a change to the
+ * Domain Access Control register.
+ *
+ * Access to a Domain is restricted if it changes from Client or Manager to
+ * No Access, or from Manager to Client. Any other change only permits more
+ * accesses than before, so the translations already cached remain valid.
+ *
+ * @param old_dacr Previous value of the Domain Access Control register
+ * @param new_dacr New value of the Domain Access Control register
+ * @return Bitfield with a bit set for each restricted Domain
+ */
+static uint32_t
+cp15_domains_restricted(uint32_t old_dacr, uint32_t new_dacr)
+{
+	uint32_t restricted = 0;
+	uint32_t domain;
+
+	for (domain = 0; domain < 16; domain++) {
+		const uint32_t old_access = (old_dacr >> (domain << 1)) & 3;
+		const uint32_t new_access = (new_dacr >> (domain << 1)) & 3;
+
+		if ((old_access & 1) && !(new_access & 1)) {
+			/* Client/Manager -> No Access */
+			restricted |= 1u << domain;
+		} else if (old_access == 3 && new_access == 1) {
+			/* Manager -> Client */
+			restricted |= 1u << domain;
+		}
+	}
+	return restricted;
+}
+
+/**
+ * Discard the translations, read/write shadow pointers and code blocks of all
+ * pages belonging to the given Domains.
+ *
+ * @param domains Bitfield with a bit set for each Domain to discard
+ */
+static void
+cp15_tlb_flush_domains(uint32_t domains)
+{
+	uint32_t mb, c;
+	int mbs = 0;
+
+	for (c = 0; c <= tlbmask; c++) {
+		if (tlbcache2[c] != 0xffffffff && ((domains >> tlbdomain[tlbcache2[c] >> 8]) & 1)) {
+			tlbcache[tlbcache2[c]] = 0xffffffff;
+			tlbcache2[c] = 0xffffffff;
+		}
+	}
+	for (c = 0; c <= vraddr_tlb.mask; c++) {
+		if (vraddr_tlb.page[c] != 0xffffffff && ((domains >> tlbdomain[vraddr_tlb.page[c] >> 8]) & 1)) {
+			cp15_shadow_tlb_remove(&vraddr_tlb, c);
+		}
+		if (vwaddr_tlb.page[c] != 0xffffffff && ((domains >> tlbdomain[vwaddr_tlb.page[c] >> 8]) & 1)) {
+			cp15_shadow_tlb_remove(&vwaddr_tlb, c);
+		}
+	}
+	clearmemcache();
+	pccache = 0xffffffff;
+
+	/* Code blocks are only discarded in the affected MBs, unless there are
+	   so many that resetting all of them is cheaper */
+	for (mb = 0; mb < 0x1000; mb++) {
+		if (tlbdomain[mb] != 0xff && ((domains >> tlbdomain[mb]) & 1)) {
+			mbs++;
+		}
+	}
+	if (mbs > 16) {
+		resetcodeblocks();
+	} else if (mbs != 0) {
+		for (mb = 0; mb < 0x1000; mb++) {
+			if (tlbdomain[mb] != 0xff && ((domains >> tlbdomain[mb]) & 1)) {
+				for (c = 0; c < 0x100; c++) {
+					cacheclearpage((mb << 8) | c);
+				}
+			}
+		}
+	}
+	domain_flushes++;
+}
+
+/**
+ * Log the TLB statistics gathered since startup.
+ */
+void
+cp15_log_stats(void)
+{
+	rpclog("CP15: %d table walks, %d TLB flushes, %d TLB purges, %d Domain flushes\n",
+	       tlbs, flushes, purges, domain_flushes);
+	rpclog("CP15: TLB %" PRIu64 " fills, %" PRIu64 " second chances, %" PRIu64 " evictions\n",
+	       tlb_fills, tlb_rearms, tlb_evictions);
+	rpclog("CP15: read shadow TLB %" PRIu64 " fills, %" PRIu64 " second chances, %" PRIu64 " evictions\n",
+	       vraddr_tlb.fills, vraddr_tlb.rearms, vraddr_tlb.evictions);
+	rpclog("CP15: write shadow TLB %" PRIu64 " fills, %" PRIu64 " second chances, %" PRIu64 " evictions\n",
+	       vwaddr_tlb.fills, vwaddr_tlb.rearms, vwaddr_tlb.evictions);
+	rpclog("CP15: walk cache %" PRIu64 " hits, %" PRIu64 " misses (%.1f%% hit rate)\n",
+	       walk_cache_hits, walk_cache_misses,
+	       (walk_cache_hits + walk_cache_misses) != 0 ?
+	       100.0 * (double) walk_cache_hits / (double) (walk_cache_hits + walk_cache_misses) : 0.0);
 }
 
 /**
@@ -272,9 +721,13 @@ cp15_write(uint32_t opcode, uint32_t val)
 
 	case 3: /* Domain Access Control */
 		if (val != cp15.domain_access_control) {
+			const uint32_t restricted = cp15_domains_restricted(cp15.domain_access_control, val);
+
 			cp15.domain_access_control = val;
-			cp15_tlb_flush_all();
-			resetcodeblocks();
+			cp15_walk_cache_flush();
+			if (restricted != 0) {
+				cp15_tlb_flush_domains(restricted);
+			}
 		}
 		return;
 
@@ -289,13 +742,13 @@ cp15_write(uint32_t opcode, uint32_t val)
 			switch (crn) {
 			case 5: /* TLB Flush */
 				cp15_tlb_flush_all();
+				resetcodeblocks();
 				break;
 
 			case 6: /* TLB Purge */
-				cp15_tlb_flush_all();
+				cp15_tlb_purge(val);
 				break;
 			}
-			resetcodeblocks();
 			return;
 
 		/* ARMv4 Architecture */
@@ -331,12 +784,12 @@ cp15_write(uint32_t opcode, uint32_t val)
 			if (opc2 == 0) {
 				/* TLB Flush */
 				cp15_tlb_flush_all();
+				if (crm & 1) {
+					resetcodeblocks();
+				}
 			} else {
 				/* TLB Purge */
-				cp15_tlb_flush_all();
-			}
-			if (crm & 1) {
-				resetcodeblocks();
+				cp15_tlb_purge(val);
 			}
 			return;
 		}
@@ -444,7 +897,9 @@ cp15_domain_access(uint32_t domain)
 /**
  * Translate a virtual address to a physical address.
  *
- * The access permissions are checked and an Abort may be generated.
+ * The access permissions are checked and an Abort may be generated. The
+ * first-level descriptor of a recently walked MB comes from the walk cache,
+ * so only the second-level descriptor, if any, is read from memory.
  *
  * @param addr     Virtual address
  * @param rw       Bool of whether this is for write access
@@ -461,13 +916,37 @@ translateaddress2(uint32_t addr, int rw, int prefetch)
 	uint32_t temp;
 	uint32_t access_permissions;
 	uint32_t phys_addr;
+	WalkCacheEntry *walk;
+
+	phys_addr = cp15_tlb_rearm(addr >> 12);
+	if (phys_addr != 0xffffffff) {
+		return phys_addr | (addr & 0xfff);
+	}
 
 	tlbs++;
 
-	/* Fetch first-level descriptor */
-	fld_addr = cp15.translation_table | ((addr >> 18) & ~3u);
-	fld = tlbram[(fld_addr >> 2) & tlbrammask];
-	domain = (fld >> 5) & 0xf;
+	walk = &walk_cache[(addr >> 20) & (WALK_CACHE_ENTRIES - 1)];
+	if (walk->mb == (addr >> 20)) {
+		fld = walk->fld;
+		domain = (fld >> 5) & 0xf;
+		domain_access = walk->domain_access;
+		walk_cache_hits++;
+	} else {
+		/* Fetch first-level descriptor */
+		fld_addr = cp15.translation_table | ((addr >> 18) & ~3u);
+		fld = tlbram[(fld_addr >> 2) & tlbrammask];
+		domain = (fld >> 5) & 0xf;
+		domain_access = cp15_domain_access(domain);
+		walk_cache_misses++;
+
+		/* Faults are not cached, as they need no flush to be replaced */
+		if ((fld & 3) == 1 || (fld & 3) == 2) {
+			walk->mb = addr >> 20;
+			walk->fld = fld;
+			walk->domain_access = domain_access;
+			walk->sld_table = (fld & 3) == 1 ? mem_phys_host32(fld & 0xfffffc00) : NULL;
+		}
+	}
 
 	switch (fld & 3) {
 	case 0: /* Fault (Section Translation) */
@@ -475,13 +954,20 @@ translateaddress2(uint32_t addr, int rw, int prefetch)
 		goto do_fault;
 
 	case 1: /* Page */
+		tlbdomain[addr >> 20] = (uint8_t) domain;
+
 		/* Fetch second-level descriptor */
-		sld_addr = (fld & 0xfffffc00) | ((addr >> 10) & 0x3fc);
-		sld = mem_phys_read32(sld_addr);
+		if (walk->sld_table != NULL) {
+			sld = walk->sld_table[(addr >> 12) & 0xff];
+		} else {
+			sld_addr = (fld & 0xfffffc00) | ((addr >> 10) & 0x3fc);
+			sld = mem_phys_read32(sld_addr);
+		}
 
 		/* Check second-level descriptor */
 		switch (sld & 3) {
 		case 1: /* Large page (64 KB) */
+			tlblarge[addr >> 20] = 1;
 			temp = (addr & 0xc000) >> 13;
 			phys_addr = (sld & 0xffff0000) | (addr & 0xffff);
 			break;
@@ -495,7 +981,6 @@ translateaddress2(uint32_t addr, int rw, int prefetch)
 		}
 
 		/* Check Domain */
-		domain_access = cp15_domain_access(domain);
 		if (domain_access == 0 || domain_access == 2) {
 			fault_code = CP15_FAULT_DOMAIN_PAGE;
 			goto do_fault;
@@ -512,8 +997,9 @@ translateaddress2(uint32_t addr, int rw, int prefetch)
 		return phys_addr;
 
 	case 2: /* Section (1 MB) */
+		tlbdomain[addr >> 20] = (uint8_t) domain;
+
 		/* Check Domain */
-		domain_access = cp15_domain_access(domain);
 		if (domain_access == 0 || domain_access == 2) {
 			fault_code = CP15_FAULT_DOMAIN_SECTION;
 			goto do_fault;
@@ -527,6 +1013,7 @@ translateaddress2(uint32_t addr, int rw, int prefetch)
 			}
 		}
 		phys_addr = (fld & 0xfff00000) | (addr & 0xfffff);
+		tlblarge[addr >> 20] = 1;
 		cp15_tlb_add_entry(addr, phys_addr);
 		return phys_addr;
 
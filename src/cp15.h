@@ -30,6 +30,8 @@ extern void cp15_tlb_invalidate_physical(uint32_t addr);
 extern void cp15_reset(CPUModel cpu_model);
 extern void cp15_init(void);
 
+extern void cp15_log_stats(void);
+
 extern void cp15_write(uint32_t opcode, uint32_t val);
 extern uint32_t cp15_read(uint32_t opcode);
 
@@ -37,6 +39,8 @@ extern const uint32_t *getpccache(uint32_t addr);
 extern uint32_t translateaddress2(uint32_t addr, int rw, int prefetch);
 
 extern int flushes;
+extern int purges;
+extern int domain_flushes;
 extern int tlbs;
 extern int dcache;
 
@@ -26,7 +26,7 @@
 #include "mem.h"
 #include "arm.h"
 
-static double fparegs[8] = {0.0}; /*No C variable type for 80-bit floating point, so use 64*/
+double fparegs[8] = {0.0}; /*No C variable type for 80-bit floating point, so use 64*/
 static uint32_t fpsr = 0, fpcr = 0;
 
 void resetfpa(void)
@@ -48,7 +48,7 @@ static inline void setsubf(double op1, double op2)
 	// if ((op1^op2)&(op1^res)&0x80000000) arm.reg[cpsr]|=VFLAG;
 }
 
-static const double fconstants[8]={0.0,1.0,2.0,3.0,4.0,5.0,0.5,10.0};
+const double fconstants[8]={0.0,1.0,2.0,3.0,4.0,5.0,0.5,10.0};
 
 static double convert80to64(uint32_t *temp)
 {
@@ -376,6 +376,12 @@ void fpaopcode(uint32_t opcode)
                                         else          tempf=fparegs[opcode&7];
                                         setsubf(fparegs[FN],tempf);
                                         return;
+                                        case 5: /*CNF*/
+                                        case 7: /*CNFE*/
+                                        if (opcode&8) tempf=fconstants[opcode&7];
+                                        else          tempf=fparegs[opcode&7];
+                                        setsubf(fparegs[FN],-tempf);
+                                        return;
                                 }
                                 fatal("Compare opcode %08X %i\n", opcode, (opcode >> 21) & 7);
                                 return;
@@ -25,7 +25,6 @@
 #include "hostclipboard.h"
 #include "mem.h"
 #include "rpcemu.h"
-#include "network.h"
 
 uint32_t cliptask_pollword_addr = 0;
 int alphabet = 100;
@@ -213,20 +213,16 @@ get_string(ARMul_State *state, ARMword address, char *buf, size_t bufsize)
 static ARMword
 put_string(ARMul_State *state, ARMword address, const char *str)
 {
-  ARMword len = 0;
+  ARMword len;
 
   assert(state);
   assert(str);
 
-  while (*str) {
-    ARMul_StoreByte(state, address++, *str++);
-    len++;
-  }
-
-  /* Write terminator */
-  ARMul_StoreByte(state, address, '\0');
+  /* Includes terminator */
+  len = (ARMword) strlen(str) + 1;
+  ARMul_StoreBytes(state, address, str, len);
 
-  return ROUND_UP_TO_4(len + 1);
+  return ROUND_UP_TO_4(len);
 }
 
 /**
@@ -835,7 +831,6 @@ hostfs_getbytes(ARMul_State *state)
 {
   FILE *f = open_file[state->Reg[1]];
   ARMword ptr = state->Reg[2];
-  ARMword i;
 
   assert(state);
 
@@ -852,9 +847,7 @@ hostfs_getbytes(ARMul_State *state)
 
   fread(buffer, 1, state->Reg[3], f);
 
-  for (i = 0; i < state->Reg[3]; i++) {
-    ARMul_StoreByte(state, ptr++, buffer[i]);
-  }
+  ARMul_StoreBytes(state, ptr, buffer, state->Reg[3]);
 }
 
 static void
@@ -862,7 +855,6 @@ hostfs_putbytes(ARMul_State *state)
 {
   FILE *f = open_file[state->Reg[1]];
   ARMword ptr = state->Reg[2];
-  ARMword i;
 
   assert(state);
 
@@ -877,10 +869,7 @@ hostfs_putbytes(ARMul_State *state)
 
   fseek(f, (long) state->Reg[4], SEEK_SET);
 
-  for (i = 0; i < state->Reg[3]; i++) {
-    buffer[i] = ARMul_LoadByte(state, ptr);
-    ptr++;
-  }
+  ARMul_LoadBytes(state, ptr, buffer, state->Reg[3]);
 
   fwrite(buffer, 1, state->Reg[3], f);
 }
@@ -1130,13 +1119,9 @@ hostfs_write_file(ARMul_State *state, bool with_data)
     size_t bytes_written;
 
     if (with_data) {
-      unsigned i;
-
       /* Copy the correct amount of data into the buffer */
-      for (i = 0; i < buffer_amount; i++) {
-        buffer[i] = ARMul_LoadByte(state, ptr);
-        ptr++;
-      }
+      ARMul_LoadBytes(state, ptr, buffer, (ARMword) buffer_amount);
+      ptr += (ARMword) buffer_amount;
     }
 
     /* TODO check for errors */
@@ -1444,13 +1429,10 @@ hostfs_file_255_load_file(ARMul_State *state)
   hostfs_ensure_buffer_size(BUFSIZE);
 
   do {
-    unsigned i;
-
     bytes_read = fread(buffer, 1, BUFSIZE, f);
 
-    for (i = 0; i < bytes_read; i++) {
-      ARMul_StoreByte(state, ptr++, buffer[i]);
-    }
+    ARMul_StoreBytes(state, ptr, buffer, (ARMword) bytes_read);
+    ptr += (ARMword) bytes_read;
   } while (bytes_read == BUFSIZE);
 
   fclose(f);
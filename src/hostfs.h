@@ -29,5 +29,7 @@ extern void hostfs_reset(void);
 #define ARMul_LoadByte(state, address) mem_read8(address)
 #define ARMul_StoreWordS(state, address, data) mem_write32(address, data)
 #define ARMul_StoreByte(state, address, data) mem_write8(address, data)
+#define ARMul_LoadBytes(state, address, data, len) memcpytohost(data, address, len)
+#define ARMul_StoreBytes(state, address, data, len) memcpyfromhost(address, data, len)
 
 #endif
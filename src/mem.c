@@ -20,6 +20,17 @@
 
 /* Memory handling */
 #include <assert.h>
+#include <errno.h>
+#include <string.h>
+
+#if defined __linux__
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#if defined SYS_memfd_create
+#define MEM_FASTMEM
+#endif
+#endif
 
 #include "rpcemu.h"
 #include "vidc20.h"
@@ -60,6 +71,175 @@ static uint32_t writemembcache = 0,writemembcache2 = 0;
 
 static uint32_t phys_space_mask; /**< Mask used to convert to physical memory address space */
 
+/* With fastmem, ROM, VRAM and RAM are shared memory, mapped once for the
+   pointers above, and again with all their mirrors in a window laid out like
+   the first 512MB of the physical address space. A physical address in
+   memory is then found by adding it to the window's base */
+static uint8_t *phys_window = NULL;	/**< Window of physical memory, or NULL if fastmem is off */
+static uint8_t phys_window_map[0x20];	/**< PHYS_WINDOW_* flags of each 16MB of the window */
+static uint32_t *fastmem_ram1 = NULL;	/**< SIMM 1 with fastmem, mapped whether or not it is fitted */
+
+#define PHYS_WINDOW_SIZE	0x20000000
+#define PHYS_WINDOW_READ	1	/**< Memory is mapped here */
+#define PHYS_WINDOW_WRITE	2	/**< Memory is mapped here, and may be written */
+
+/**
+ * Find the window's mapping of a physical address, if it is in memory.
+ *
+ * @param addr  Physical address, masked by phys_space_mask
+ * @param flags PHYS_WINDOW_READ or PHYS_WINDOW_WRITE, for the access needed
+ * @return Pointer to the address within the window, or NULL
+ */
+static inline uint8_t *
+mem_phys_window(uint32_t addr, uint8_t flags)
+{
+	if (phys_window != NULL && addr < PHYS_WINDOW_SIZE && (phys_window_map[addr >> 24] & flags)) {
+		return phys_window + addr;
+	}
+	return NULL;
+}
+
+#ifdef MEM_FASTMEM
+/* Offset of each memory within the shared memory */
+#define FASTMEM_ROM	0x00000000
+#define FASTMEM_VRAM	0x00800000
+#define FASTMEM_RAM00	0x01000000
+#define FASTMEM_RAM01	0x09000000
+#define FASTMEM_RAM1	0x11000000
+#define FASTMEM_SIZE	0x19000000
+
+static int fastmem_fd = -1;	/**< Shared memory holding ROM, VRAM and RAM */
+
+/**
+ * Map part of the shared memory.
+ *
+ * @param addr   Address to map at, or NULL to map anywhere
+ * @param len    Length in bytes
+ * @param offset Offset within the shared memory
+ * @param prot   Protection of the mapping
+ * @return Pointer to the mapping, or MAP_FAILED
+ */
+static void *
+mem_fastmem_map(void *addr, size_t len, off_t offset, int prot)
+{
+	return mmap(addr, len, prot, MAP_SHARED | (addr != NULL ? MAP_FIXED : 0), fastmem_fd, offset);
+}
+
+/**
+ * Fill a region of the physical window with copies of one memory, which
+ * repeats throughout the region like the real hardware.
+ *
+ * @param base   Physical address of region, a multiple of 16MB
+ * @param size   Size of region in bytes
+ * @param offset Offset of memory within the shared memory
+ * @param len    Size of memory in bytes, or 0 to leave the region unmapped
+ * @param flags  PHYS_WINDOW_* flags for the region
+ */
+static void
+mem_fastmem_alias(uint32_t base, uint32_t size, off_t offset, uint32_t len, uint8_t flags)
+{
+	const int prot = (flags & PHYS_WINDOW_WRITE) ? (PROT_READ | PROT_WRITE) : PROT_READ;
+	uint32_t c;
+
+	if (len == 0) {
+		if (mmap(phys_window + base, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0) == MAP_FAILED) {
+			fatal("Failed to unmap physical memory window: %s", strerror(errno));
+		}
+		flags = 0;
+	} else {
+		if (len > size) {
+			len = size;
+		}
+		for (c = 0; c < size; c += len) {
+			if (mem_fastmem_map(phys_window + base + c, len, offset, prot) == MAP_FAILED) {
+				fatal("Failed to map physical memory window: %s", strerror(errno));
+			}
+		}
+	}
+	for (c = 0; c < size; c += 0x1000000) {
+		phys_window_map[(base + c) >> 24] = flags;
+	}
+}
+
+/**
+ * Set up fastmem, allocating ROM, VRAM and RAM from shared memory and
+ * reserving the physical window.
+ *
+ * @return Non-zero on success, zero if fastmem cannot be used
+ */
+static int
+mem_fastmem_init(void)
+{
+	void *window;
+
+	fastmem_fd = (int) syscall(SYS_memfd_create, "rpcemu", 0);
+	if (fastmem_fd == -1) {
+		rpclog("Memory: fastmem unavailable, no shared memory: %s\n", strerror(errno));
+		return 0;
+	}
+	window = mmap(NULL, PHYS_WINDOW_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (ftruncate(fastmem_fd, FASTMEM_SIZE) != 0 || window == MAP_FAILED) {
+		rpclog("Memory: fastmem unavailable, no address space: %s\n", strerror(errno));
+		if (window != MAP_FAILED) {
+			munmap(window, PHYS_WINDOW_SIZE);
+		}
+		close(fastmem_fd);
+		fastmem_fd = -1;
+		return 0;
+	}
+
+	rom = mem_fastmem_map(NULL, ROMSIZE, FASTMEM_ROM, PROT_READ | PROT_WRITE);
+	vram = mem_fastmem_map(NULL, 8 * 1024 * 1024, FASTMEM_VRAM, PROT_READ | PROT_WRITE);
+	ram00 = mem_fastmem_map(NULL, 128 * 1024 * 1024, FASTMEM_RAM00, PROT_READ | PROT_WRITE);
+	ram01 = mem_fastmem_map(NULL, 128 * 1024 * 1024, FASTMEM_RAM01, PROT_READ | PROT_WRITE);
+	fastmem_ram1 = mem_fastmem_map(NULL, 128 * 1024 * 1024, FASTMEM_RAM1, PROT_READ | PROT_WRITE);
+	if (rom == MAP_FAILED || vram == MAP_FAILED || ram00 == MAP_FAILED ||
+	    ram01 == MAP_FAILED || fastmem_ram1 == MAP_FAILED)
+	{
+		fatal("Failed to map shared memory: %s", strerror(errno));
+	}
+
+	phys_window = window;
+	mem_fastmem_alias(0x00000000, 0x01000000, FASTMEM_ROM, ROMSIZE, PHYS_WINDOW_READ);
+	rpclog("Memory: fastmem physical window at %p\n", window);
+	return 1;
+}
+
+/**
+ * Map VRAM and RAM in the physical window, with the sizes of the current
+ * configuration.
+ *
+ * @param bank_size Size of each bank of SIMM 0 in bytes
+ */
+static void
+mem_fastmem_reset(uint32_t bank_size)
+{
+	mem_fastmem_alias(0x02000000, 0x01000000, FASTMEM_VRAM,
+	                  mem_vrammask != 0 ? mem_vrammask + 1 : 0,
+	                  PHYS_WINDOW_READ | PHYS_WINDOW_WRITE);
+	mem_fastmem_alias(0x10000000, 0x04000000, FASTMEM_RAM00, bank_size,
+	                  PHYS_WINDOW_READ | PHYS_WINDOW_WRITE);
+	mem_fastmem_alias(0x14000000, 0x04000000, FASTMEM_RAM01, bank_size,
+	                  PHYS_WINDOW_READ | PHYS_WINDOW_WRITE);
+	mem_fastmem_alias(0x18000000, 0x08000000, FASTMEM_RAM1,
+	                  ram1 != NULL ? 0x08000000 : 0,
+	                  PHYS_WINDOW_READ | PHYS_WINDOW_WRITE);
+}
+#else
+static int
+mem_fastmem_init(void)
+{
+	rpclog("Memory: fastmem unavailable on this platform\n");
+	return 0;
+}
+
+static void
+mem_fastmem_reset(uint32_t bank_size)
+{
+	NOT_USED(bank_size);
+}
+#endif /* MEM_FASTMEM */
+
 void clearmemcache(void)
 {
 	readmemcache = 0xffffffff;
@@ -67,15 +247,15 @@ void clearmemcache(void)
 	writemembcache = 0xffffffff;
 }
 
-static int vraddrlpos, vwaddrlpos;
-
 /**
  * Initialise memory (called only once on program startup)
  */
 void mem_init(void)
 {
-	rom  = malloc(ROMSIZE);
-	vram = malloc(8 * 1024 * 1024); /*8 meg VRAM!*/
+	if (!config.fastmem || !mem_fastmem_init()) {
+		rom  = malloc(ROMSIZE);
+		vram = malloc(8 * 1024 * 1024); /*8 meg VRAM!*/
+	}
 	romb  = (uint8_t *) rom;
 	vramb = (uint8_t *) vram;
 }
@@ -100,11 +280,17 @@ mem_reset(uint32_t ramsize, uint32_t vram_size)
 		ramsize = 128 * 1024 * 1024; /* 128MB for first SIMM */
 
 		/* Allocate additional 128MB */
-		ram1 = realloc(ram1, 128 * 1024 * 1024);
+		if (phys_window != NULL) {
+			ram1 = fastmem_ram1;
+		} else {
+			ram1 = realloc(ram1, 128 * 1024 * 1024);
+		}
 		ramb1 = (uint8_t *) ram1;
 		memset(ram1, 0, 128 * 1024 * 1024);
 	} else {
-		free(ram1);
+		if (phys_window == NULL) {
+			free(ram1);
+		}
 		ram1 = NULL;
 		ramb1 = NULL;
 	}
@@ -119,15 +305,15 @@ mem_reset(uint32_t ramsize, uint32_t vram_size)
 		mem_vrammask = 0;
 	}
 
-	ram00 = realloc(ram00, ramsize / 2);
-	ram01 = realloc(ram01, ramsize / 2);
+	if (phys_window == NULL) {
+		ram00 = realloc(ram00, ramsize / 2);
+		ram01 = realloc(ram01, ramsize / 2);
+	}
 	ramb00 = (uint8_t *) ram00;
 	ramb01 = (uint8_t *) ram01;
 	memset(ram00, 0, ramsize / 2);
 	memset(ram01, 0, ramsize / 2);
 
-	vraddrlpos = vwaddrlpos = 0;
-
 	if (machine.model == Model_Phoebe) {
 		/* 30 address bits are connected to IOMD2. This results in a
 		   physical memory map of 1G that repeats in the 4G address space */
@@ -137,6 +323,80 @@ mem_reset(uint32_t ramsize, uint32_t vram_size)
 		   physical memory map of 512M that repeats in the 4G address space */
 		phys_space_mask = 0x1fffffff;
 	}
+
+	if (phys_window != NULL) {
+		mem_fastmem_reset(ramsize / 2);
+	}
+}
+
+/**
+ * Map a page in vraddrl[] or vwaddrl[] again, without translating its
+ * address, if the hand of its shadow TLB parked it.
+ *
+ * @param t    Shadow TLB
+ * @param addr Virtual address
+ * @return Non-zero if the page is mapped again
+ */
+static inline int
+shadow_tlb_rearm(ShadowTLB *t, uint32_t addr)
+{
+	const uint32_t page = addr >> 12;
+	const uintptr_t cur = t->shadow[page];
+	const uintptr_t entry = cur >> 2;
+
+	if ((cur & 3) != 3 || entry > t->mask || t->page[entry] != page) {
+		return 0;
+	}
+	t->ref[entry] = SHADOW_TLB_AGE;
+	t->shadow[page] = t->host[entry];
+	t->rearms++;
+	return 1;
+}
+
+/**
+ * Map a page in vraddrl[] or vwaddrl[], taking an entry from the CLOCK hand.
+ *
+ * An entry whose page has since been unmapped or mapped by another entry is
+ * reused straight away. Only an entry still mapping its page is parked, so a
+ * page unmapped to catch writes to code is never mapped again by
+ * shadow_tlb_rearm().
+ *
+ * @param t Shadow TLB to add to
+ * @param a Virtual address within page
+ * @param v Host pointer for the page, offset by the page's virtual address
+ * @param p Physical address of page
+ */
+static void
+shadow_tlb_add(ShadowTLB *t, uint32_t a, const void *v, uint32_t p)
+{
+	const uint32_t page = a >> 12;
+	uint32_t entry;
+
+	/* Ends within SHADOW_TLB_AGE + 1 turns, as each step ages an entry */
+	for (;;) {
+		entry = t->hand;
+		t->hand = (t->hand + 1) & t->mask;
+		if (t->page[entry] == 0xffffffff ||
+		    (t->shadow[t->page[entry]] != t->host[entry] &&
+		     t->shadow[t->page[entry]] != SHADOW_TLB_PARKED(entry)))
+		{
+			break;
+		}
+		if (t->ref[entry] == 0) {
+			t->shadow[t->page[entry]] = 0xffffffff;
+			t->evictions++;
+			break;
+		}
+		if (--t->ref[entry] == 0) {
+			t->shadow[t->page[entry]] = SHADOW_TLB_PARKED(entry);
+		}
+	}
+	t->page[entry] = page;
+	t->host[entry] = (uintptr_t) v;
+	t->phys[entry] = p;
+	t->ref[entry] = 1;
+	t->shadow[page] = (uintptr_t) v;
+	t->fills++;
 }
 
 static inline void
@@ -144,13 +404,7 @@ vradd(uint32_t a, const void *v, uint32_t f, uint32_t p)
 {
 	NOT_USED(f);
 
-	if (vraddrls[vraddrlpos] != 0xffffffff) {
-		vraddrl[vraddrls[vraddrlpos]] = 0xffffffff;
-	}
-	vraddrls[vraddrlpos] = a >> 12;
-	vraddrl[a >> 12] = (uintptr_t) v; /* | f; */
-	vraddrphys[vraddrlpos] = p;
-	vraddrlpos = (vraddrlpos + 1) & 0x3ff;
+	shadow_tlb_add(&vraddr_tlb, a, v, p);
 }
 
 static inline void
@@ -158,16 +412,13 @@ vwadd(uint32_t a, const void *v, uint32_t f, uint32_t p)
 {
 	NOT_USED(f);
 
-	/* Invalidate all code blocks on this page, so that any blocks on this
-	   page are forced to be recompiled */
-	cacheclearpage(a >> 12);
-	if (vwaddrls[vwaddrlpos] != 0xffffffff) {
-		vwaddrl[vwaddrls[vwaddrlpos]] = 0xffffffff;
+	/* Invalidate code blocks near the write, so that they are forced to be
+	   recompiled. A page with other code stays out of the TLB, so that
+	   later writes to it are checked too */
+	if (cacheclearwrite(a)) {
+		return;
 	}
-	vwaddrls[vwaddrlpos] = a >> 12;
-	vwaddrl[a >> 12] = (uintptr_t) v; /* | f; */
-	vwaddrphys[vwaddrlpos] = p;
-	vwaddrlpos = (vwaddrlpos + 1) & 0x3ff;
+	shadow_tlb_add(&vwaddr_tlb, a, v, p);
 }
 
 /**
@@ -179,8 +430,15 @@ vwadd(uint32_t a, const void *v, uint32_t f, uint32_t p)
 uint32_t
 mem_phys_read32(uint32_t addr)
 {
+	const uint8_t *host;
+
 	addr &= phys_space_mask;
 
+	host = mem_phys_window(addr, PHYS_WINDOW_READ);
+	if (host != NULL) {
+		return *(const uint32_t *) ((uintptr_t) host & ~(uintptr_t) 3);
+	}
+
 	switch (addr & (phys_space_mask & 0xff000000)) { /* Select in 16MB chunks */
 	case 0x00000000: /* ROM */
 		return rom[(addr & 0x7fffff) >> 2];
@@ -261,6 +519,62 @@ mem_phys_read32(uint32_t addr)
 	return 0;
 }
 
+/**
+ * Find the host memory holding the word at a physical address, for callers
+ * that read it repeatedly, such as the page table walk.
+ *
+ * Only RAM, VRAM and ROM can be found; a word anywhere else must be read
+ * through mem_phys_read32(). The word, and those following it up to the end
+ * of its 4KB page, stay at the pointer returned until the memory is reset.
+ *
+ * @param addr Physical address, word aligned
+ * @return Pointer to the word, or NULL if it is not in RAM, VRAM or ROM
+ */
+const uint32_t *
+mem_phys_host32(uint32_t addr)
+{
+	addr &= phys_space_mask;
+
+	if (phys_window != NULL) {
+		return (const uint32_t *) mem_phys_window(addr, PHYS_WINDOW_READ);
+	}
+
+	switch (addr & (phys_space_mask & 0xff000000)) { /* Select in 16MB chunks */
+	case 0x00000000: /* ROM */
+		return &rom[(addr & 0x7fffff) >> 2];
+
+	case 0x02000000: /* VRAM */
+		if (mem_vrammask == 0)
+			return NULL;
+		return &vram[(addr & mem_vrammask) >> 2];
+
+	case 0x10000000: /* SIMM 0 bank 0 */
+	case 0x11000000:
+	case 0x12000000:
+	case 0x13000000:
+		return &ram00[(addr & mem_rammask) >> 2];
+
+	case 0x14000000: /* SIMM 0 bank 1 */
+	case 0x15000000:
+	case 0x16000000:
+	case 0x17000000:
+		return &ram01[(addr & mem_rammask) >> 2];
+
+	case 0x18000000: /* SIMM 1 bank 0 */
+	case 0x19000000:
+	case 0x1a000000:
+	case 0x1b000000:
+	case 0x1c000000: /* SIMM 1 bank 1 */
+	case 0x1d000000:
+	case 0x1e000000:
+	case 0x1f000000:
+		if (ram1 != NULL) {
+			return &ram1[(addr & 0x7ffffff) >> 2];
+		}
+	}
+	return NULL;
+}
+
 /**
  * Read a byte from a physical address.
  *
@@ -270,8 +584,19 @@ mem_phys_read32(uint32_t addr)
 static uint32_t
 mem_phys_read8(uint32_t addr)
 {
+	const uint8_t *host;
+
 	addr &= phys_space_mask;
 
+#ifdef _RPCEMU_BIG_ENDIAN
+	host = mem_phys_window(addr ^ 3, PHYS_WINDOW_READ);
+#else
+	host = mem_phys_window(addr, PHYS_WINDOW_READ);
+#endif
+	if (host != NULL) {
+		return *host;
+	}
+
 	switch (addr & (phys_space_mask & 0xff000000)) { /* Select in 16MB chunks */
 	case 0x00000000: /* ROM */
 #ifdef _RPCEMU_BIG_ENDIAN
@@ -601,7 +926,11 @@ uint32_t
 readmemfl(uint32_t addr)
 {
 	uint32_t phys_addr = addr;
+	const uint8_t *host;
 
+	if (shadow_tlb_rearm(&vraddr_tlb, addr)) {
+		return mem_read32(addr);
+	}
 	if (mmu) {
 		if ((addr >> 12) == readmemcache) {
 			phys_addr = readmemcache2 + (addr & 0xfff);
@@ -614,6 +943,11 @@ readmemfl(uint32_t addr)
 			}
 			readmemcache2 = phys_addr & 0xfffff000;
 		}
+		host = mem_phys_window(readmemcache2 & phys_space_mask, PHYS_WINDOW_READ);
+		if (host != NULL) {
+			vradd(addr, (const void *) ((uintptr_t) host - (addr & ~0xfffu)), 0, readmemcache2);
+			return *(const uint32_t *) (host + (addr & 0xffc));
+		}
 		switch (readmemcache2 & (phys_space_mask & 0xff000000)) {
 		case 0x00000000: /* ROM */
 			vradd(addr, &rom[((readmemcache2 & 0x7ff000) - (uintptr_t) (addr & ~0xfffu)) >> 2], 2, readmemcache2);
@@ -698,7 +1032,11 @@ uint32_t
 readmemfb(uint32_t addr)
 {
 	uint32_t phys_addr = addr;
+	const uint8_t *host;
 
+	if (shadow_tlb_rearm(&vraddr_tlb, addr)) {
+		return mem_read8(addr);
+	}
 	if (mmu) {
 		if ((addr >> 12) == readmemcache) {
 			phys_addr = readmemcache2 + (addr & 0xfff);
@@ -711,6 +1049,14 @@ readmemfb(uint32_t addr)
 			}
 			readmemcache2 = phys_addr & 0xfffff000;
 		}
+		host = mem_phys_window(readmemcache2 & phys_space_mask, PHYS_WINDOW_READ);
+		if (host != NULL) {
+			vradd(addr, (const void *) ((uintptr_t) host - (addr & ~0xfffu)), 0, readmemcache2);
+#ifdef _RPCEMU_BIG_ENDIAN
+			addr ^= 3;
+#endif
+			return host[addr & 0xfff];
+		}
 		switch (readmemcache2 & (phys_space_mask & 0xff000000)) {
 		case 0x00000000: /* ROM */
 			vradd(addr, &rom[((readmemcache2 & 0x7ff000) - (uintptr_t) (addr & ~0xfffu)) >> 2], 2, readmemcache2);
@@ -774,7 +1120,12 @@ void
 writememfl(uint32_t addr, uint32_t val)
 {
 	uint32_t phys_addr = addr;
+	uint8_t *host;
 
+	if (shadow_tlb_rearm(&vwaddr_tlb, addr)) {
+		mem_write32(addr, val);
+		return;
+	}
 	if (mmu) {
 		if ((addr >> 12) == writememcache) {
 			phys_addr = writememcache2 + (addr & 0xfff);
@@ -787,6 +1138,12 @@ writememfl(uint32_t addr, uint32_t val)
 			}
 			writememcache2 = phys_addr & 0xfffff000;
 		}
+		host = mem_phys_window(writememcache2 & phys_space_mask, PHYS_WINDOW_WRITE);
+		if (host != NULL) {
+			vwadd(addr, (void *) ((uintptr_t) host - (addr & ~0xfffu)), 0, writememcache2);
+			mem_phys_write32(phys_addr, val);
+			return;
+		}
 		switch (writememcache2 & (phys_space_mask & 0xff000000)) {
 		case 0x02000000: /* VRAM */
 			if (mem_vrammask != 0) {
@@ -829,7 +1186,12 @@ void
 writememfb(uint32_t addr, uint8_t val)
 {
 	uint32_t phys_addr = addr;
+	uint8_t *host;
 
+	if (shadow_tlb_rearm(&vwaddr_tlb, addr)) {
+		mem_write8(addr, val);
+		return;
+	}
 	if (mmu) {
 		if ((addr >> 12) == writemembcache) {
 			phys_addr = writemembcache2 + (addr & 0xfff);
@@ -842,6 +1204,12 @@ writememfb(uint32_t addr, uint8_t val)
 			}
 			writemembcache2 = phys_addr & 0xfffff000;
 		}
+		host = mem_phys_window(writemembcache2 & phys_space_mask, PHYS_WINDOW_WRITE);
+		if (host != NULL) {
+			vwadd(addr, (void *) ((uintptr_t) host - (addr & ~0xfffu)), 0, writemembcache2);
+			mem_phys_write8(phys_addr, val);
+			return;
+		}
 		switch (writemembcache2 & (phys_space_mask & 0xff000000)) {
 		case 0x02000000: /* VRAM */
 			if (mem_vrammask != 0) {
@@ -879,3 +1247,112 @@ writememfb(uint32_t addr, uint8_t val)
 	}
 	mem_phys_write8(phys_addr, val);
 }
+
+/**
+ * Copy bytes from emulated memory to host memory.
+ *
+ * Each page is translated once, by reading its first byte, and the rest of
+ * the page is then copied with memcpy() if the page can be read directly. A
+ * Data Abort stops the copy at the page that faulted, leaving the abort
+ * pending for the instruction being emulated.
+ *
+ * @param dest Pointer to storage in host memory
+ * @param src  Virtual address in emulated memory
+ * @param len  Amount in bytes to copy
+ * @return Amount in bytes copied, less than len if a Data Abort occurred
+ */
+uint32_t
+memcpytohost(void *dest, uint32_t src, uint32_t len)
+{
+	uint8_t *dst = dest;
+	uint32_t copied = 0;
+
+	while (copied < len) {
+		uint32_t run = 0x1000 - (src & 0xfff);
+		uint32_t i = 1;
+
+		if (run > len - copied) {
+			run = len - copied;
+		}
+
+		dst[0] = (uint8_t) mem_read8(src);
+		if (arm.event & 0x40) {
+			return copied;
+		}
+#ifndef _RPCEMU_BIG_ENDIAN
+		if ((vraddrl[src >> 12] & 1) == 0) {
+			memcpy(dst + 1, (const uint8_t *) ((src + 1) + vraddrl[src >> 12]), run - 1);
+			i = run;
+		}
+#endif
+		for (; i < run; i++) {
+			dst[i] = (uint8_t) mem_read8(src + i);
+		}
+		dst += run;
+		src += run;
+		copied += run;
+	}
+	return copied;
+}
+
+/**
+ * Copy bytes from host memory to emulated memory.
+ *
+ * Each page is translated once, by writing its first byte, and the rest of
+ * the page is then copied with memcpy() if the page can be written directly.
+ * Writing the first byte through the usual path marks the page in
+ * dirtybuffer[] if it is displayed, and discards any code translated from
+ * it; a page holding code is never mapped for direct writes, so every byte
+ * written to it is checked. A Data Abort stops the copy at the page that
+ * faulted, leaving the abort pending for the instruction being emulated.
+ *
+ * @param dest   Virtual address in emulated memory
+ * @param source Pointer to storage in host memory
+ * @param len    Amount in bytes to copy
+ * @return Amount in bytes copied, less than len if a Data Abort occurred
+ */
+uint32_t
+memcpyfromhost(uint32_t dest, const void *source, uint32_t len)
+{
+	const uint8_t *src = source;
+	uint32_t copied = 0;
+
+	while (copied < len) {
+		uint32_t run = 0x1000 - (dest & 0xfff);
+		uint32_t i = 1;
+
+		if (run > len - copied) {
+			run = len - copied;
+		}
+
+		mem_write8(dest, src[0]);
+		if (arm.event & 0x40) {
+			return copied;
+		}
+#ifndef _RPCEMU_BIG_ENDIAN
+		if ((vwaddrl[dest >> 12] & 3) == 0) {
+			memcpy((uint8_t *) ((dest + 1) + vwaddrl[dest >> 12]), src + 1, run - 1);
+			i = run;
+		}
+#endif
+		for (; i < run; i++) {
+			mem_write8(dest + i, src[i]);
+		}
+		dest += run;
+		src += run;
+		copied += run;
+	}
+	return copied;
+}
+
+/**
+ * Copy null-terminated string from host to emulated memory
+ *
+ * @param dest   Virtual address in emulated memory
+ * @param source Pointer to null-terminated string
+ */
+void
+strcpyfromhost(uint32_t dest, const char *source)
+{
+	memcpyfromhost(dest, source, (uint32_t) strlen(source) + 1);
+}
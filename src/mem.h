@@ -26,24 +26,54 @@
 #include "rpcemu.h"
 
 extern uint32_t mem_phys_read32(uint32_t addr);
+extern const uint32_t *mem_phys_host32(uint32_t addr);
 
 extern uint32_t readmemfl(uint32_t addr);
 extern uint32_t readmemfb(uint32_t addr);
 extern void writememfb(uint32_t addr, uint8_t val);
 extern void writememfl(uint32_t addr, uint32_t val);
 
+extern uint32_t memcpytohost(void *dest, uint32_t src, uint32_t len);
+extern uint32_t memcpyfromhost(uint32_t dest, const void *source, uint32_t len);
+extern void strcpyfromhost(uint32_t dest, const char *source);
+
 extern void clearmemcache(void);
 extern void mem_init(void);
 extern void mem_reset(uint32_t ramsize, uint32_t vram_size);
 
 extern uintptr_t vraddrl[0x100000];
-extern uint32_t vraddrls[1024],vraddrphys[1024];
-
 extern uintptr_t vwaddrl[0x100000];
-extern uint32_t vwaddrls[1024],vwaddrphys[1024];
+
+/**
+ * The pages mapped by vraddrl[] or vwaddrl[], with entries replaced by the
+ * CLOCK algorithm. Hits in these tables are not seen, so the hand parks a page
+ * once its reference count runs out: its pointer is replaced by a marker that
+ * misses, and if the page is used again before the hand returns it is mapped
+ * again with a fresh count, without translating its address. A page still
+ * parked when the hand returns is evicted.
+ */
+typedef struct {
+	uintptr_t	*shadow;	/**< vraddrl or vwaddrl */
+	uint32_t	*page;		/**< Virtual page of each entry, or 0xffffffff if free */
+	uintptr_t	*host;		/**< Pointer mapping each entry's page */
+	uint32_t	*phys;		/**< Physical address of each entry's page */
+	uint8_t		*ref;		/**< Turns of the hand each entry has left before being parked,
+	                                     or 0 if parked */
+	uint32_t	mask;		/**< Number of entries - 1 */
+	uint32_t	hand;		/**< Next entry for the hand to examine */
+	uint64_t	fills;		/**< Pages given an entry */
+	uint64_t	rearms;		/**< Parked pages added again, keeping their entry */
+	uint64_t	evictions;	/**< Pages evicted to free an entry */
+} ShadowTLB;
+
+#define SHADOW_TLB_AGE	4	/**< Turns of the hand a page survives after being used while parked */
+
+/** Value of vraddrl[] or vwaddrl[] for a page parked in the given entry */
+#define SHADOW_TLB_PARKED(entry)	(((uintptr_t) (entry) << 2) | 3)
+
+extern ShadowTLB vraddr_tlb, vwaddr_tlb;
 
 //uint8_t pagedirty[0x1000];
-#define HASH(l) (((l)>>2)&0x7FFF)
 
 #define ROMSIZE (8*1024*1024)
 
@@ -56,6 +86,7 @@ extern uint32_t tlbcache[0x100000];
 extern int mmu,memmode;
 
 extern void cacheclearpage(uint32_t a);
+extern int cacheclearwrite(uint32_t addr);
 
 extern uint32_t mem_rammask;
 extern uint32_t mem_vrammask;
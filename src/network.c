@@ -158,55 +158,6 @@ readpoduleetherrpcem(podule *p, int easi, uint32_t addr)
 	return 0xff;
 }
 
-/**
- * Copy bytes from emulated memory map to host
- *
- * @param dest Pointer to storage in host memory
- * @param src  Memory address in emulated memory map
- * @param len  Amount in bytes to copy
- */
-void
-memcpytohost(void *dest, uint32_t src, uint32_t len)
-{
-	char *dst = dest;
-
-	while (len--) {
-		*dst++ = mem_read8(src);
-		src++;
-	}
-}
-
-/**
- * Copy bytes from host to emulated memory
- *
- * @param dest   Memory address in emulated memory map
- * @param source Pointer to storage in host memory
- * @param len    Amount in bytes to copy
- */
-void
-memcpyfromhost(uint32_t dest, const void *source, uint32_t len)
-{
-	const char *src = source;
-
-	while (len--) {
-		mem_write8(dest, *src);
-		src++;
-		dest++;
-	}
-}
-
-/**
- * Copy null-terminated string from host to emulated memory
- *
- * @param dest   Memory address in emulated memory map
- * @param source Pointer to null-terminated string
- */
-void
-strcpyfromhost(uint32_t dest, const char *source)
-{
-	memcpyfromhost(dest, source, strlen(source) + 1);
-}
-
 /**
  * Handle setting new values of networking parameters, and let caller
  * know if they have altered enough to require an emulated machine restart.
@@ -41,10 +41,6 @@ void network_init(void);
 void network_reset(void);
 
 /* Functions shared between each platform, in network.c */
-void memcpytohost(void *dest, uint32_t src, uint32_t len);
-void memcpyfromhost(uint32_t dest, const void *source, uint32_t len);
-void strcpyfromhost(uint32_t dest, const char *source);
-
 int network_config_changed(NetworkType networktype, const char *bridgename,
                            const char *ipaddress);
 int network_macaddress_parse(const char *macaddress, uint8_t hwaddr[6]);
@@ -242,6 +242,14 @@ config_load(Config * config)
 
 	config->show_fullscreen_message = settings.value("show_fullscreen_message", "1").toInt();
 
+	config->dynarec_cache_size = settings.value("dynarec_cache_size", "16").toUInt();
+	config->dynarec_hot_threshold = settings.value("dynarec_hot_threshold", "32").toUInt();
+	config->dynarec_compile_thread = settings.value("dynarec_compile_thread", "0").toInt();
+	config->dynarec_perf_map = settings.value("dynarec_perf_map", "0").toInt();
+	config->tlb_entries = settings.value("tlb_entries", "256").toUInt();
+	config->shadow_tlb_entries = settings.value("shadow_tlb_entries", "1024").toUInt();
+	config->fastmem = settings.value("fastmem", "0").toInt();
+
 	sText = settings.value("network_capture", "").toString();
 	if (sText != "") {
 		ba = sText.toUtf8();
@@ -328,6 +336,13 @@ config_save(Config *config)
 
 	settings.setValue("cpu_idle", config->cpu_idle);
 	settings.setValue("show_fullscreen_message", config->show_fullscreen_message);
+	settings.setValue("dynarec_cache_size", config->dynarec_cache_size);
+	settings.setValue("dynarec_hot_threshold", config->dynarec_hot_threshold);
+	settings.setValue("dynarec_compile_thread", config->dynarec_compile_thread);
+	settings.setValue("dynarec_perf_map", config->dynarec_perf_map);
+	settings.setValue("tlb_entries", config->tlb_entries);
+	settings.setValue("shadow_tlb_entries", config->shadow_tlb_entries);
+	settings.setValue("fastmem", config->fastmem);
 
 	if (config->network_capture) {
 		settings.setValue("network_capture", config->network_capture);
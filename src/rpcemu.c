@@ -98,6 +98,13 @@ Config config = {
 	0,
 	0,
 	1,
+	16,			/* dynarec_cache_size */
+	32,			/* dynarec_hot_threshold */
+	0,			/* dynarec_compile_thread */
+	0,			/* dynarec_perf_map */
+	256,			/* tlb_entries */
+	1024,			/* shadow_tlb_entries */
+	0,			/* fastmem */
 };
 
 /* Performance measuring variables */
@@ -336,6 +343,84 @@ rpcemu_start(void)
 	resetrpc();
 }
 
+/**
+ * Run down the callback timers of devices by one step, making any callbacks
+ * that have become due.
+ *
+ * @return Non-zero if a callback was made
+ */
+static int
+run_callbacks(void)
+{
+	int called = 0;
+
+	if (kcallback) {
+		kcallback--;
+		if (kcallback <= 0) {
+			kcallback = 0;
+			keyboard_callback_rpcemu();
+			called = 1;
+		}
+	}
+	if (mcallback) {
+		mcallback -= 10;
+		if (mcallback <= 0) {
+			mcallback = 0;
+			mouse_ps2_callback();
+			called = 1;
+		}
+	}
+	if (fdccallback) {
+		fdccallback -= 100;
+		if (fdccallback <= 0) {
+			fdccallback = 0;
+			fdc_callback();
+			called = 1;
+		}
+	}
+	if (idecallback) {
+		idecallback -= 10;
+		if (idecallback <= 0) {
+			idecallback = 0;
+			callbackide();
+			called = 1;
+		}
+	}
+	return called;
+}
+
+/**
+ * Sleep for a short period of time if no interrupts are pending, then run
+ * other periodic actions, including the platform's timers.
+ */
+static void
+idle_sleep(void)
+{
+	/* Sleep if no interrupts pending */
+	if (!arm.event) {
+#ifdef RPCEMU_WIN
+		Sleep(1);
+#else
+		struct timespec tm;
+
+		tm.tv_sec = 0;
+		tm.tv_nsec = 1000000;
+		nanosleep(&tm, NULL);
+#endif
+	}
+	/* Run other periodic actions */
+	if (!arm.event) {
+		if (drawscre > 0) {
+			drawscr();
+			drawscre--;
+			if (drawscre > 5) {
+				drawscre = 0;
+			}
+		}
+		rpcemu_idle_process_events();
+	}
+}
+
 /**
  * Execute a chunk of ARM instructions. This is the main entry point for the
  * emulation of the virtual hardware.
@@ -350,34 +435,7 @@ execrpcemu(void)
 	while (cycles > 0) {
 		cycles -= arm_exec();
 
-		if (kcallback) {
-			kcallback--;
-			if (kcallback <= 0) {
-				kcallback = 0;
-				keyboard_callback_rpcemu();
-			}
-		}
-		if (mcallback) {
-			mcallback -= 10;
-			if (mcallback <= 0) {
-				mcallback = 0;
-				mouse_ps2_callback();
-			}
-		}
-		if (fdccallback) {
-			fdccallback -= 100;
-			if (fdccallback <= 0) {
-				fdccallback = 0;
-				fdc_callback();
-			}
-		}
-		if (idecallback) {
-			idecallback -= 10;
-			if (idecallback <= 0) {
-				idecallback = 0;
-				callbackide();
-			}
-		}
+		run_callbacks();
 		if (motoron) {
 			disc_poll();
 		}
@@ -404,62 +462,35 @@ rpcemu_idle(void)
 	/* Loop while no interrupts pending */
 	while (!arm.event) {
 		/* Run down any callback timers */
-		if (kcallback) {
-			kcallback--;
-			if (kcallback <= 0) {
-				kcallback = 0;
-				keyboard_callback_rpcemu();
-			}
-		}
-		if (mcallback) {
-			mcallback -= 10;
-			if (mcallback <= 0) {
-				mcallback = 0;
-				mouse_ps2_callback();
-			}
-		}
-		if (fdccallback) {
-			fdccallback -= 100;
-			if (fdccallback <= 0) {
-				fdccallback = 0;
-				fdc_callback();
-			}
-		}
-		if (idecallback) {
-			idecallback -= 10;
-			if (idecallback <= 0) {
-				idecallback = 0;
-				callbackide();
-			}
-		}
+		run_callbacks();
 		if (motoron) {
 			/* Not much point putting a counter here */
 			iomd.irqa.status |= IOMD_IRQA_FLOPPY_INDEX;
 			updateirqs();
 		}
-		/* Sleep if no interrupts pending */
-		if (!arm.event) {
-#ifdef RPCEMU_WIN
-			Sleep(1);
-#else
-			struct timespec tm;
+		idle_sleep();
+	}
+}
 
-			tm.tv_sec = 0;
-			tm.tv_nsec = 1000000;
-			nanosleep(&tm, NULL);
-#endif
-		}
-		/* Run other periodic actions */
-		if (!arm.event) {
-			if (drawscre > 0) {
-				drawscr();
-				drawscre--;
-				if (drawscre > 5) {
-					drawscre = 0;
-				}
-			}
-			rpcemu_idle_process_events();
+/**
+ * Let time pass for a loop that is only polling memory or I/O, found by the
+ * dynarec. A loop like this is most likely waiting for a device, so any
+ * pending callback is brought forward to now, as though the loop had spun
+ * until it was due. Otherwise, if reducing CPU usage, sleep briefly.
+ *
+ * Unlike rpcemu_idle() this returns without waiting for an interrupt, as
+ * the loop may be waiting for something that does not raise one.
+ */
+void
+rpcemu_idle_poll(void)
+{
+	if ((kcallback || mcallback || fdccallback || idecallback) && !motoron) {
+		while (!run_callbacks()) {
 		}
+		return;
+	}
+	if (config.cpu_idle) {
+		idle_sleep();
 	}
 }
 
@@ -482,6 +513,8 @@ endrpcemu(void)
         free(rom);
         savecmos();
         config_save(&config);
+	cp15_log_stats();
+	codegen_log_stats();
 
 #ifdef RPCEMU_NETWORKING
 	network_reset();
@@ -136,6 +136,18 @@ typedef struct {
 	int start_fullscreen;
     int exit_on_shutdown;
     int special_key;
+	unsigned dynarec_cache_size;	/**< Size of dynarec code cache in megabytes */
+	unsigned dynarec_hot_threshold;	/**< Times a dynarec block runs before being recompiled
+	                                     with full optimisation, 0 to always optimise */
+	int dynarec_compile_thread;	/**< Optimise hot dynarec blocks on a separate thread */
+	int dynarec_perf_map;		/**< Describe dynarec code for Linux perf: 0 off, 1 perf map,
+	                                     2 jitdump */
+	unsigned tlb_entries;		/**< Entries in the TLB of translated pages, rounded to a
+	                                     power of two */
+	unsigned shadow_tlb_entries;	/**< Entries in each of the TLBs of host pointers for reads
+	                                     and writes, rounded to a power of two */
+	int fastmem;			/**< Map physical memory in a window of host memory, where
+	                                     supported; takes effect on restart */
 } Config;
 
 extern Config config;
@@ -223,6 +235,7 @@ extern void rpcemu_prestart(void);
 extern void rpcemu_start(void);
 extern void execrpcemu(void);
 extern void rpcemu_idle(void);
+extern void rpcemu_idle_poll(void);
 extern void endrpcemu(void);
 extern void resetrpc(void);
 extern void rpcemu_floppy_load(int drive, const char *filename);
@@ -291,6 +304,13 @@ extern Perf perf;
 #define NOT_USED(arg)	(void) arg
 
 /*FPA*/
+/*Preliminary FPA emulation. This works to an extent - !Draw works with it, !SICK
+  seems to (FPA Whetstone scores are around 100x without), but !AMPlayer doesn't
+  work, and GCC stuff tends to crash.*/
+//#define FPA
+
+extern double fparegs[8];
+extern const double fconstants[8];
 extern void resetfpa(void);
 extern void fpaopcode(uint32_t opcode);
 